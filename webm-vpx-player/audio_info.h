@@ -19,7 +19,13 @@ enum error_type {
 	//Sanity check for invalid usage
 	E_INVALID_OPERATION,
 	//Sanity check for invalid topology building
-	E_PROTOCOL_MISMATCH
+	E_PROTOCOL_MISMATCH,
+	//Input the decoder could not decode, it goes on with the next
+	E_DECODE_ERROR,
+	//Reading or writing the underlying file failed
+	E_IO_ERROR,
+	//The file is complete but without the index asked for
+	E_NO_INDEX
 };
 
 struct SampleFormat {
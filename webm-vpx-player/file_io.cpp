@@ -0,0 +1,511 @@
+#include "file_io.h"
+
+#include <cstring>
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#ifdef _WIN32
+bool file_mapping::open(const char* path)
+{
+	close();
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size{};
+	if (!GetFileSizeEx(file, &size) || !size.QuadPart) {
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE section = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!section) {
+		CloseHandle(file);
+		return false;
+	}
+	void* view = MapViewOfFile(section, FILE_MAP_READ, 0, 0, 0);
+	if (!view) {
+		CloseHandle(section);
+		CloseHandle(file);
+		return false;
+	}
+	file_handle = file;
+	section_handle = section;
+	base = (const uint8_t*)view;
+	length = size.QuadPart;
+	return true;
+}
+
+void file_mapping::close()
+{
+	if (base)
+		UnmapViewOfFile(base);
+	if (section_handle)
+		CloseHandle(section_handle);
+	if (file_handle)
+		CloseHandle(file_handle);
+	base = nullptr;
+	length = 0;
+	section_handle = nullptr;
+	file_handle = nullptr;
+}
+#else
+bool file_mapping::open(const char* path)
+{
+	close();
+	int file = ::open(path, O_RDONLY | O_CLOEXEC);
+	if (file < 0)
+		return false;
+	struct stat st{};
+	if (fstat(file, &st) || !st.st_size) {
+		::close(file);
+		return false;
+	}
+	void* view = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, file, 0);
+	if (view == MAP_FAILED) {
+		::close(file);
+		return false;
+	}
+	//demuxing walks the file front to back
+	madvise(view, st.st_size, MADV_SEQUENTIAL);
+	fd = file;
+	base = (const uint8_t*)view;
+	length = st.st_size;
+	return true;
+}
+
+void file_mapping::close()
+{
+	if (base)
+		munmap((void*)base, length);
+	if (fd >= 0)
+		::close(fd);
+	base = nullptr;
+	length = 0;
+	fd = -1;
+}
+#endif
+
+#ifdef _WIN32
+bool file_identity(const char* path, uint64_t& size, int64_t& mtime)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesExA(path, GetFileExInfoStandard, &attributes))
+		return false;
+	size = ((uint64_t)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+	mtime = ((int64_t)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+	return true;
+}
+#else
+bool file_identity(const char* path, uint64_t& size, int64_t& mtime)
+{
+	struct stat st;
+	if (stat(path, &st))
+		return false;
+	size = st.st_size;
+#ifdef __APPLE__
+	mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+	mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+	return true;
+}
+#endif
+
+#ifdef _WIN32
+bool positional_file::open(const char* path)
+{
+	close();
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size{};
+	if (!GetFileSizeEx(file, &size)) {
+		CloseHandle(file);
+		return false;
+	}
+	file_handle = file;
+	length = size.QuadPart;
+	return true;
+}
+
+void positional_file::close()
+{
+	if (file_handle)
+		CloseHandle(file_handle);
+	file_handle = nullptr;
+	length = 0;
+}
+
+size_t positional_file::read_at(uint64_t pos, void* buffer, size_t count) const
+{
+	size_t done = 0;
+	while (done < count) {
+		//the offset in OVERLAPPED makes the read positional
+		OVERLAPPED ov{};
+		uint64_t at = pos + done;
+		ov.Offset = (DWORD)at;
+		ov.OffsetHigh = (DWORD)(at >> 32);
+		DWORD chunk = (count - done) > 0x40000000 ? 0x40000000 : (DWORD)(count - done);
+		DWORD got = 0;
+		if (!ReadFile(file_handle, (uint8_t*)buffer + done, chunk, &got, &ov) || !got)
+			break;
+		done += got;
+	}
+	return done;
+}
+#else
+bool positional_file::open(const char* path)
+{
+	close();
+	int file = ::open(path, O_RDONLY | O_CLOEXEC);
+	if (file < 0)
+		return false;
+	struct stat st{};
+	if (fstat(file, &st)) {
+		::close(file);
+		return false;
+	}
+	fd = file;
+	length = st.st_size;
+	return true;
+}
+
+void positional_file::close()
+{
+	if (fd >= 0)
+		::close(fd);
+	fd = -1;
+	length = 0;
+}
+
+size_t positional_file::read_at(uint64_t pos, void* buffer, size_t count) const
+{
+	size_t done = 0;
+	while (done < count) {
+		ssize_t got = pread(fd, (uint8_t*)buffer + done, count - done, pos + done);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			break;
+		done += got;
+	}
+	return done;
+}
+#endif
+
+buffered_reader::buffered_reader(std::shared_ptr<const positional_file> pfile, size_t block):
+	file(std::move(pfile)), block_size(block)
+{
+	if (block_size)
+		window.reset(new uint8_t[block_size]);
+}
+
+bool buffered_reader::fill(uint64_t at)
+{
+	//start on a page boundary, parsing often steps back a few bytes
+	win_pos = at & ~uint64_t(4095);
+	if (at - win_pos >= block_size / 2)
+		win_pos = at;
+	win_len = fetch(win_pos, window.get(), block_size);
+	return at - win_pos < win_len;
+}
+
+const uint8_t* buffered_reader::refill(size_t count)
+{
+	if (count > block_size)
+		return nullptr;
+	win_pos = pos;
+	win_len = fetch(win_pos, window.get(), block_size);
+	return count <= win_len ? window.get() : nullptr;
+}
+
+size_t buffered_reader::read(void* buffer, size_t count)
+{
+	uint8_t* out = (uint8_t*)buffer;
+	size_t done = 0;
+	while (done < count) {
+		if (pos - win_pos < win_len) {
+			size_t avail = win_len - (size_t)(pos - win_pos);
+			size_t chunk = count - done < avail ? count - done : avail;
+			memcpy(out + done, &window[pos - win_pos], chunk);
+			done += chunk;
+			pos += chunk;
+		}
+		else if (count - done >= block_size) {
+			size_t got = fetch(pos, out + done, count - done);
+			done += got;
+			pos += got;
+			break;
+		}
+		else if (!fill(pos)) {
+			break;
+		}
+	}
+	return done;
+}
+
+size_t buffered_reader::read_at(uint64_t at, void* buffer, size_t count) const
+{
+	if (at >= win_pos && at - win_pos + count <= win_len) {
+		memcpy(buffer, &window[at - win_pos], count);
+		return count;
+	}
+	return fetch(at, buffer, count);
+}
+
+#ifdef _WIN32
+bool positional_output::open(const char* path)
+{
+	close();
+	HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	file_handle = file;
+	return true;
+}
+
+void positional_output::close()
+{
+	if (file_handle)
+		CloseHandle(file_handle);
+	file_handle = nullptr;
+}
+
+size_t positional_output::write_at(uint64_t pos, const void* buffer, size_t count)
+{
+	size_t done = 0;
+	while (done < count) {
+		OVERLAPPED ov{};
+		uint64_t at = pos + done;
+		ov.Offset = (DWORD)at;
+		ov.OffsetHigh = (DWORD)(at >> 32);
+		DWORD chunk = (count - done) > 0x40000000 ? 0x40000000 : (DWORD)(count - done);
+		DWORD put = 0;
+		if (!WriteFile(file_handle, (const uint8_t*)buffer + done, chunk, &put, &ov) || !put)
+			break;
+		done += put;
+	}
+	return done;
+}
+
+size_t positional_output::read_at(uint64_t pos, void* buffer, size_t count) const
+{
+	size_t done = 0;
+	while (done < count) {
+		OVERLAPPED ov{};
+		uint64_t at = pos + done;
+		ov.Offset = (DWORD)at;
+		ov.OffsetHigh = (DWORD)(at >> 32);
+		DWORD chunk = (count - done) > 0x40000000 ? 0x40000000 : (DWORD)(count - done);
+		DWORD got = 0;
+		if (!ReadFile(file_handle, (uint8_t*)buffer + done, chunk, &got, &ov) || !got)
+			break;
+		done += got;
+	}
+	return done;
+}
+
+//the allocation size, the end of file stays where it is
+bool positional_output::preallocate(uint64_t size)
+{
+	FILE_ALLOCATION_INFO info{};
+	info.AllocationSize.QuadPart = size;
+	return SetFileInformationByHandle(file_handle, FileAllocationInfo, &info, sizeof(info)) != 0;
+}
+#else
+bool positional_output::open(const char* path)
+{
+	close();
+	int file = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (file < 0)
+		return false;
+	fd = file;
+	return true;
+}
+
+void positional_output::close()
+{
+	if (fd >= 0)
+		::close(fd);
+	fd = -1;
+}
+
+size_t positional_output::write_at(uint64_t pos, const void* buffer, size_t count)
+{
+	size_t done = 0;
+	while (done < count) {
+		ssize_t put = pwrite(fd, (const uint8_t*)buffer + done, count - done, pos + done);
+		if (put < 0 && errno == EINTR)
+			continue;
+		if (put <= 0)
+			break;
+		done += put;
+	}
+	return done;
+}
+
+size_t positional_output::read_at(uint64_t pos, void* buffer, size_t count) const
+{
+	size_t done = 0;
+	while (done < count) {
+		ssize_t got = pread(fd, (uint8_t*)buffer + done, count - done, pos + done);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			break;
+		done += got;
+	}
+	return done;
+}
+
+bool positional_output::preallocate(uint64_t size)
+{
+#ifdef __linux__
+	return !fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+#else
+	return false;
+#endif
+}
+#endif
+
+bool buffered_writer::open(const char* path, size_t block_size, uint64_t expected_size)
+{
+	close();
+	if (!file.open(path))
+		return false;
+	capacity = block_size < 4096 ? 4096 : (block_size + 4095) & ~size_t(4095);
+#ifdef _WIN32
+	buffer = (uint8_t*)_aligned_malloc(capacity, 4096);
+#else
+	void* block = nullptr;
+	buffer = posix_memalign(&block, 4096, capacity) ? nullptr : (uint8_t*)block;
+#endif
+	if (!buffer) {
+		file.close();
+		return false;
+	}
+	buf_pos = 0;
+	buf_len = 0;
+	pos = 0;
+	length = 0;
+	failed = false;
+	//only an optimization, fine if it fails
+	if (expected_size)
+		file.preallocate(expected_size);
+	return true;
+}
+
+void buffered_writer::put_direct(uint64_t at, const void* data, size_t count)
+{
+	if (file.write_at(at, data, count) != count)
+		failed = true;
+}
+
+size_t buffered_writer::write(const void* data, size_t count)
+{
+	if (!buffer)
+		return 0;
+	const uint8_t* in = (const uint8_t*)data;
+	size_t done = 0;
+	while (done < count) {
+		//anywhere from the start of the buffered run to its end
+		if (pos < buf_pos || pos > buf_pos + buf_len || pos - buf_pos == capacity) {
+			if (!flush())
+				break;
+			buf_pos = pos;
+		}
+		size_t at = (size_t)(pos - buf_pos);
+		if (!buf_len && count - done >= capacity) {
+			//a whole buffer or more, no use copying it first
+			put_direct(pos, in + done, count - done);
+			if (failed)
+				break;
+			pos += count - done;
+			done = count;
+		}
+		else {
+			size_t chunk = capacity - at < count - done ? capacity - at : count - done;
+			memcpy(buffer + at, in + done, chunk);
+			if (at + chunk > buf_len)
+				buf_len = at + chunk;
+			pos += chunk;
+			done += chunk;
+		}
+	}
+	if (pos > length)
+		length = pos;
+	return done;
+}
+
+size_t buffered_writer::write_at(uint64_t at, const void* data, size_t count)
+{
+	if (!buffer || !count)
+		return 0;
+	const uint8_t* in = (const uint8_t*)data;
+	uint64_t end = at + count;
+	uint64_t run_end = buf_pos + buf_len;
+	//in front of the buffered run, already on disk or a hole
+	if (at < buf_pos) {
+		size_t front = (size_t)((end < buf_pos ? end : buf_pos) - at);
+		put_direct(at, in, front);
+	}
+	//inside it, patched in place
+	if (end > buf_pos && at < run_end) {
+		uint64_t from = at > buf_pos ? at : buf_pos;
+		uint64_t to = end < run_end ? end : run_end;
+		memcpy(buffer + (from - buf_pos), in + (from - at), (size_t)(to - from));
+	}
+	//past it, nothing buffered there to conflict with
+	if (end > run_end) {
+		uint64_t from = at > run_end ? at : run_end;
+		put_direct(from, in + (from - at), (size_t)(end - from));
+	}
+	if (end > length)
+		length = end;
+	return failed ? 0 : count;
+}
+
+size_t buffered_writer::read_at(uint64_t at, void* data, size_t count)
+{
+	if (!buffer || !flush())
+		return 0;
+	return file.read_at(at, data, count);
+}
+
+bool buffered_writer::flush()
+{
+	if (buf_len) {
+		put_direct(buf_pos, buffer, buf_len);
+		buf_pos += buf_len;
+		buf_len = 0;
+	}
+	return !failed;
+}
+
+bool buffered_writer::close()
+{
+	if (!buffer)
+		return false;
+	bool ok = flush();
+#ifdef _WIN32
+	_aligned_free(buffer);
+#else
+	free(buffer);
+#endif
+	buffer = nullptr;
+	capacity = 0;
+	file.close();
+	return ok;
+}
@@ -0,0 +1,277 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+
+//read only view of a whole file.
+//The view stays valid until close() or destruction,
+//so whoever hands out pointers into it must keep it alive
+//(see mkv_memory_source, which refcounts it through a refed_buffer_block).
+class file_mapping {
+	const uint8_t* base = nullptr;
+	uint64_t length = 0;
+#ifdef _WIN32
+	void* file_handle = nullptr;
+	void* section_handle = nullptr;
+#else
+	int fd = -1;
+#endif
+public:
+	file_mapping() {}
+	file_mapping(const file_mapping&) = delete;
+	file_mapping& operator=(const file_mapping&) = delete;
+	~file_mapping()
+	{
+		close();
+	}
+	bool open(const char* path);
+	void close();
+	const uint8_t* data() const
+	{
+		return base;
+	}
+	uint64_t size() const
+	{
+		return length;
+	}
+};
+
+//file read by absolute position only (pread / ReadFile with an offset).
+//Has no file pointer of its own, so any number of readers,
+//each tracking their own position, can share one instance
+//from different threads without seek races.
+class positional_file {
+#ifdef _WIN32
+	void* file_handle = nullptr;
+#else
+	int fd = -1;
+#endif
+	uint64_t length = 0;
+public:
+	positional_file() {}
+	positional_file(const positional_file&) = delete;
+	positional_file& operator=(const positional_file&) = delete;
+	~positional_file()
+	{
+		close();
+	}
+	bool open(const char* path);
+	void close();
+	bool is_open() const
+	{
+#ifdef _WIN32
+		return file_handle != nullptr;
+#else
+		return fd >= 0;
+#endif
+	}
+	//returns the bytes read, short only at the end of file or on error
+	size_t read_at(uint64_t pos, void* buffer, size_t count) const;
+	uint64_t size() const
+	{
+		return length;
+	}
+#ifndef _WIN32
+	//for submitting reads elsewhere (io_uring)
+	int descriptor() const
+	{
+		return fd;
+	}
+#endif
+};
+
+//size and last write time of path (100 ns units on windows,
+//ns on posix), enough to tell whether something derived from
+//the file, like a saved keyframe index, is still current
+bool file_identity(const char* path, uint64_t& size, int64_t& mtime);
+
+//serves reads of a file from data fetched ahead of time
+//(see cluster_readahead), falling back to the file itself
+class read_cache {
+public:
+	virtual size_t read_at(uint64_t pos, void* buffer, size_t count) = 0;
+	virtual ~read_cache() {}
+};
+
+//sliding window over a positional_file with its own position.
+//Small reads (element ids, sizes, headers) are served from one
+//block sized window that is refilled at the read position when
+//a read or a seek leaves it; reads of at least a whole block go
+//straight to the file without polluting the window.
+//Not thread safe, use one per reader over a shared positional_file.
+class buffered_reader {
+	std::shared_ptr<const positional_file> file;
+	read_cache* cache = nullptr;
+	std::unique_ptr<uint8_t[]> window;
+	size_t block_size = 0;
+	uint64_t win_pos = 0;
+	size_t win_len = 0;
+	uint64_t pos = 0;
+	bool fill(uint64_t at);
+	const uint8_t* refill(size_t count);
+	size_t fetch(uint64_t at, void* buffer, size_t count) const
+	{
+		if (cache)
+			return cache->read_at(at, buffer, count);
+		return file->read_at(at, buffer, count);
+	}
+public:
+	//block_size 0 disables the window
+	buffered_reader(std::shared_ptr<const positional_file> pfile, size_t block_size);
+	size_t read(void* buffer, size_t count);
+	//byte at the position or -1 at the end
+	int getc()
+	{
+		if (pos - win_pos < win_len)
+			return window[pos++ - win_pos];
+		uint8_t ch;
+		if (!read(&ch, 1))
+			return -1;
+		return ch;
+	}
+	//the next count bytes without moving the position, refilling the
+	//window if they are not in it. Valid until the next read, peek or
+	//read_at; null near the end, if count exceeds the block size or
+	//the window is disabled.
+	const uint8_t* peek(size_t count)
+	{
+		if (pos >= win_pos && pos - win_pos + count <= win_len)
+			return &window[pos - win_pos];
+		return refill(count);
+	}
+	//does not move the position, served from the window if it is inside
+	size_t read_at(uint64_t at, void* buffer, size_t count) const;
+	void seek(uint64_t at)
+	{
+		pos = at;
+	}
+	//reads that miss the window go through the cache if set
+	void set_cache(read_cache* read_ahead)
+	{
+		cache = read_ahead;
+	}
+	//drops the window, e.g. if the file may have changed
+	void invalidate()
+	{
+		win_len = 0;
+	}
+	uint64_t tell() const
+	{
+		return pos;
+	}
+	uint64_t size() const
+	{
+		return file->size();
+	}
+	const positional_file& source() const
+	{
+		return *file;
+	}
+};
+
+//file created for writing by absolute position only (pwrite /
+//WriteFile with an offset), the write side of positional_file
+class positional_output {
+#ifdef _WIN32
+	void* file_handle = nullptr;
+#else
+	int fd = -1;
+#endif
+public:
+	positional_output() {}
+	positional_output(const positional_output&) = delete;
+	positional_output& operator=(const positional_output&) = delete;
+	~positional_output()
+	{
+		close();
+	}
+	//creates or truncates path, open for reading back as well
+	bool open(const char* path);
+	void close();
+	bool is_open() const
+	{
+#ifdef _WIN32
+		return file_handle != nullptr;
+#else
+		return fd >= 0;
+#endif
+	}
+	//returns the bytes written, short only on error
+	size_t write_at(uint64_t pos, const void* buffer, size_t count);
+	//returns the bytes read, short at the end of file or on error
+	size_t read_at(uint64_t pos, void* buffer, size_t count) const;
+	//reserves size bytes of disk without changing the file size,
+	//false where the platform or file system cannot
+	bool preallocate(uint64_t size);
+};
+
+//Write coalescing buffer over a positional_output with its own
+//position, for writers that put out many small pieces and go back
+//to patch sizes (the Matroska muxer).
+//Writes collect in one aligned block sized buffer covering a single
+//run of the file, flushed in one write when it is full or a write
+//lands outside it. Positional writes (write_at) into the buffered
+//run patch the buffer in place, the parts outside it go straight
+//to the file, and neither moves the position or flushes.
+//Not thread safe.
+class buffered_writer {
+	positional_output file;
+	//page aligned
+	uint8_t* buffer = nullptr;
+	size_t capacity = 0;
+	//file offset of buffer[0]
+	uint64_t buf_pos = 0;
+	size_t buf_len = 0;
+	uint64_t pos = 0;
+	uint64_t length = 0;
+	bool failed = false;
+	void put_direct(uint64_t at, const void* data, size_t count);
+public:
+	buffered_writer() {}
+	buffered_writer(const buffered_writer&) = delete;
+	buffered_writer& operator=(const buffered_writer&) = delete;
+	~buffered_writer()
+	{
+		close();
+	}
+	//expected_size, if known, is preallocated
+	bool open(const char* path, size_t block_size = 1024 * 1024, uint64_t expected_size = 0);
+	//writes at the position and moves it
+	size_t write(const void* data, size_t count);
+	bool put(uint8_t byte)
+	{
+		if (pos == buf_pos + buf_len && buf_len < capacity) {
+			buffer[buf_len++] = byte;
+			++pos;
+			if (pos > length)
+				length = pos;
+			return true;
+		}
+		return write(&byte, 1) == 1;
+	}
+	//writes at, the position stays where it is
+	size_t write_at(uint64_t at, const void* data, size_t count);
+	void seek(uint64_t at)
+	{
+		pos = at;
+	}
+	uint64_t tell() const
+	{
+		return pos;
+	}
+	//including what is still buffered
+	uint64_t size() const
+	{
+		return length;
+	}
+	//reads back what was written, flushes first
+	size_t read_at(uint64_t at, void* data, size_t count);
+	//false if any write so far failed
+	bool flush();
+	bool close();
+	bool is_open() const
+	{
+		return file.is_open();
+	}
+};
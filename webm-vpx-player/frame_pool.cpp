@@ -0,0 +1,189 @@
+#include "frame_pool.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+const size_t plane_alignment = 64;
+//small differences in the size asked for (a cropped frame of the
+//same stream) still fit the buffers already there
+const size_t size_granule = 64 * 1024;
+const size_t huge_page = 2 * 1024 * 1024;
+
+size_t round_up(size_t size, size_t to)
+{
+	return (size + to - 1) / to * to;
+}
+
+}
+
+void frame_buffer::unref()
+{
+	if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		pool->recycle(this);
+}
+
+frame_pool* frame_pool::create(size_t frame_size, bool huge_pages)
+{
+	return new frame_pool(frame_size, huge_pages);
+}
+
+frame_buffer* frame_pool::allocate(size_t size)
+{
+	frame_buffer* buffer = new frame_buffer();
+	buffer->pool = this;
+	if (size < frame_size)
+		size = frame_size;
+	if (huge_pages) {
+#ifdef _WIN32
+		size_t large = GetLargePageMinimum();
+		if (large) {
+			size_t rounded = round_up(size, large);
+			//needs SeLockMemoryPrivilege, plain pages without it
+			buffer->data = (uint8_t*)VirtualAlloc(nullptr, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (buffer->data) {
+				size = rounded;
+				++huge_allocs;
+			}
+		}
+		if (!buffer->data) {
+			size = round_up(size, huge_page);
+			buffer->data = (uint8_t*)VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		}
+#else
+		size = round_up(size, huge_page);
+		void* view = MAP_FAILED;
+#ifdef MAP_HUGETLB
+		//from the reserved pool (vm.nr_hugepages), often empty
+		view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (view != MAP_FAILED)
+			++huge_allocs;
+#endif
+		if (view == MAP_FAILED) {
+			view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+			if (view != MAP_FAILED)
+				madvise(view, size, MADV_HUGEPAGE);
+#endif
+		}
+		buffer->data = view == MAP_FAILED ? nullptr : (uint8_t*)view;
+#endif
+		buffer->mapped = buffer->data != nullptr;
+		//mapped pages come zeroed
+	}
+	else {
+		size = round_up(size, size_granule);
+#ifdef _WIN32
+		buffer->data = (uint8_t*)_aligned_malloc(size, plane_alignment);
+#else
+		void* block = nullptr;
+		buffer->data = posix_memalign(&block, plane_alignment, size) ? nullptr : (uint8_t*)block;
+#endif
+		//libvpx reads the borders of reference frames before writing
+		//them (its own buffers are zeroed too)
+		if (buffer->data)
+			memset(buffer->data, 0, size);
+	}
+	if (!buffer->data) {
+		delete buffer;
+		return nullptr;
+	}
+	buffer->capacity = size;
+	++allocs;
+	bytes += size;
+	return buffer;
+}
+
+void frame_pool::deallocate(frame_buffer* buffer)
+{
+	++frees;
+	bytes -= buffer->capacity;
+#ifdef _WIN32
+	if (buffer->mapped)
+		VirtualFree(buffer->data, 0, MEM_RELEASE);
+	else
+		_aligned_free(buffer->data);
+#else
+	if (buffer->mapped)
+		munmap(buffer->data, buffer->capacity);
+	else
+		free(buffer->data);
+#endif
+	delete buffer;
+}
+
+frame_buffer* frame_pool::get(size_t size)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	frame_buffer* buffer = nullptr;
+	while (!idle.empty()) {
+		frame_buffer* candidate = idle.back();
+		idle.pop_back();
+		if (candidate->capacity >= size) {
+			buffer = candidate;
+			++reuses;
+			break;
+		}
+		//the stream grew past it
+		deallocate(candidate);
+	}
+	if (!buffer)
+		buffer = allocate(size);
+	if (!buffer)
+		return nullptr;
+	buffer->refs.store(1, std::memory_order_relaxed);
+	++outstanding;
+	return buffer;
+}
+
+void frame_pool::recycle(frame_buffer* buffer)
+{
+	bool last;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		--outstanding;
+		if (closed)
+			deallocate(buffer);
+		else
+			idle.push_back(buffer);
+		last = closed && !outstanding;
+	}
+	if (last)
+		delete this;
+}
+
+void frame_pool::close()
+{
+	bool last;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		closed = true;
+		for (frame_buffer* buffer : idle)
+			deallocate(buffer);
+		idle.clear();
+		last = !outstanding;
+	}
+	if (last)
+		delete this;
+}
+
+frame_pool::stats_t frame_pool::stats() const
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	stats_t s;
+	s.allocs = allocs;
+	s.huge_allocs = huge_allocs;
+	s.reuses = reuses;
+	s.frees = frees;
+	s.outstanding = outstanding;
+	s.bytes = bytes;
+	return s;
+}
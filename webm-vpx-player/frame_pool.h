@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+class frame_pool;
+
+//one buffer of a frame_pool, back in the pool after its last unref.
+//Held by the decoder while it references the frame and by everyone
+//the decoded frame was handed to.
+struct frame_buffer {
+	std::atomic<size_t> refs{0};
+	uint8_t* data = nullptr;
+	size_t capacity = 0;
+	frame_pool* pool = nullptr;
+	//from mmap / VirtualAlloc rather than the aligned heap
+	bool mapped = false;
+	void ref()
+	{
+		refs.fetch_add(1, std::memory_order_relaxed);
+	}
+	void unref();
+	bool contains(const void* p) const
+	{
+		return (const uint8_t*)p >= data && (const uint8_t*)p < data + capacity;
+	}
+};
+
+//Frame buffers for decoders that decode into memory of their own
+//(vpx_codec_set_frame_buffer_functions), so frames can be held past
+//the next decode without a copy.
+//Buffers are 64 byte aligned, allocated at least frame_size large and
+//recycled through a free list; a stream of one resolution stops
+//allocating once the decoder's references and the frames held
+//downstream are covered. With huge_pages, buffers are 2 MiB (large
+//page) multiples mapped with huge pages where the system allows,
+//transparent huge pages or plain pages otherwise.
+//Thread safe: the decoder gets and releases buffers on its threads,
+//consumers unref theirs on any thread.
+class frame_pool {
+	mutable std::mutex mtx;
+	std::vector<frame_buffer*> idle;
+	const size_t frame_size;
+	const bool huge_pages;
+	bool closed = false;
+	uint64_t allocs = 0;
+	uint64_t reuses = 0;
+	uint64_t frees = 0;
+	uint64_t huge_allocs = 0;
+	uint64_t outstanding = 0;
+	uint64_t bytes = 0;
+	frame_pool(size_t frame_size, bool huge_pages) : frame_size(frame_size), huge_pages(huge_pages) {}
+	~frame_pool() {}
+	frame_buffer* allocate(size_t size);
+	void deallocate(frame_buffer* buffer);
+	friend frame_buffer;
+	void recycle(frame_buffer* buffer);
+public:
+	struct stats_t {
+		//buffers allocated from the system, huge_allocs of them
+		//with explicit huge pages
+		uint64_t allocs;
+		uint64_t huge_allocs;
+		//gets served from the free list
+		uint64_t reuses;
+		//buffers given back to the system (too small, or closing)
+		uint64_t frees;
+		//buffers holding refs
+		uint64_t outstanding;
+		//held by the pool, idle or not
+		uint64_t bytes;
+	};
+	frame_pool(const frame_pool&) = delete;
+	frame_pool& operator=(const frame_pool&) = delete;
+	//frame_size: the size the frames are expected to need
+	static frame_pool* create(size_t frame_size, bool huge_pages = false);
+	//a buffer with room for size bytes holding one ref, null if out of memory
+	frame_buffer* get(size_t size);
+	//frees the idle buffers; the pool itself goes with the last
+	//buffer still held. Not to be used after.
+	void close();
+	stats_t stats() const;
+};
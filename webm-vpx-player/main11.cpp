@@ -0,0 +1,91 @@
+//random read micro-benchmark: stdio (tell+seek+read+seek, as in
+//mkv_file_source::read) against positional_file::read_at,
+//single threaded and with several readers sharing one file.
+#include "file_io.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#define _ftelli64 ftello
+#define _fseeki64 fseeko
+#endif
+
+static constexpr size_t reads = 200000;
+static constexpr size_t read_size = 4096;
+
+static std::vector<uint64_t> make_offsets(uint64_t file_size, unsigned seed)
+{
+	std::mt19937_64 rng(seed);
+	std::vector<uint64_t> offsets(reads);
+	uint64_t range = file_size > read_size ? file_size - read_size : 1;
+	for (uint64_t& off : offsets)
+		off = rng() % range;
+	return offsets;
+}
+
+static double stdio_random_reads(FILE* f, const std::vector<uint64_t>& offsets)
+{
+	uint8_t buffer[read_size];
+	auto begin = std::chrono::steady_clock::now();
+	for (uint64_t pos : offsets) {
+		int64_t cur = _ftelli64(f);
+		_fseeki64(f, pos, SEEK_SET);
+		fread(buffer, 1, read_size, f);
+		_fseeki64(f, cur, SEEK_SET);
+	}
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+static double pread_random_reads(const positional_file& f, const std::vector<uint64_t>& offsets)
+{
+	uint8_t buffer[read_size];
+	auto begin = std::chrono::steady_clock::now();
+	for (uint64_t pos : offsets)
+		f.read_at(pos, buffer, read_size);
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		printf("usage: %s file.webm [threads]\n", argv[0]);
+		return 1;
+	}
+	int threads = argc > 2 ? atoi(argv[2]) : 4;
+	positional_file pfile;
+	FILE* sfile = fopen(argv[1], "rb");
+	if (!sfile || !pfile.open(argv[1])) {
+		printf("Cannot open file\n");
+		return 1;
+	}
+	std::vector<uint64_t> offsets = make_offsets(pfile.size(), 1);
+	//warm the page cache so both paths measure syscall cost, not the disk
+	pread_random_reads(pfile, offsets);
+
+	double stdio_time = stdio_random_reads(sfile, offsets);
+	double pread_time = pread_random_reads(pfile, offsets);
+	printf("stdio: %8.1f ns/read\n", stdio_time * 1e9 / reads);
+	printf("pread: %8.1f ns/read\n", pread_time * 1e9 / reads);
+
+	//readers sharing one positional_file, no locking needed
+	std::vector<std::thread> workers;
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < threads; ++i) {
+		workers.emplace_back([&, i]() {
+			std::vector<uint64_t> own = make_offsets(pfile.size(), i + 2);
+			pread_random_reads(pfile, own);
+		});
+	}
+	for (std::thread& t : workers)
+		t.join();
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	printf("pread x%d shared: %8.1f ns/read aggregate\n", threads, wall * 1e9 / (reads * threads));
+	fclose(sfile);
+	return 0;
+}
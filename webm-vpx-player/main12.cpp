@@ -0,0 +1,52 @@
+//open time and demux throughput of the mkv_source I/O paths:
+//stdio, unbuffered pread, pread under a window of several block
+//sizes, and the mapped source. Use a large multi-track webm.
+#include "mkv_source.h"
+
+#include <cstdio>
+#include <chrono>
+
+static void run(const char* name, mkv_source* (*open)(const char*, size_t), const char* path, size_t block_size)
+{
+	auto begin = std::chrono::steady_clock::now();
+	mkv_source* source = open(path, block_size);
+	auto opened = std::chrono::steady_clock::now();
+	if (!source) {
+		printf("%s: cannot open\n", name);
+		return;
+	}
+	_buffer_desc desc{};
+	size_t packets = 0;
+	uint64_t bytes = 0;
+	while (!source->FetchBuffer(desc)) {
+		++packets;
+		bytes += desc.detail.pkt.size;
+	}
+	source->ReleaseBuffer(desc);
+	auto done = std::chrono::steady_clock::now();
+	double open_ms = std::chrono::duration<double, std::milli>(opened - begin).count();
+	double demux_s = std::chrono::duration<double>(done - opened).count();
+	printf("%-12s block %7zu: open %8.3f ms, %10.0f packets/s, %8.1f MB/s\n", name, block_size,
+		open_ms, packets / demux_s, bytes / demux_s / (1024 * 1024));
+	delete source;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		printf("usage: %s file.webm\n", argv[0]);
+		return 1;
+	}
+	const char* path = argv[1];
+	auto stdio_open = [](const char* p, size_t) { return mkv_source_factory::CreateFromFile(p); };
+	auto mmap_open = [](const char* p, size_t) { return mkv_source_factory::CreateFromFileMapped(p); };
+	auto pread_open = [](const char* p, size_t block) { return mkv_source_factory::CreateFromFilePositional(p, block); };
+	//first pass only warms the page cache
+	run("warmup", stdio_open, path, 0);
+	run("stdio", stdio_open, path, 0);
+	run("mmap", mmap_open, path, 0);
+	run("pread", pread_open, path, 0);
+	for (size_t block : {4096, 16384, 65536, 262144, 1048576})
+		run("pread", pread_open, path, block);
+	return 0;
+}
@@ -0,0 +1,57 @@
+//demux with and without the cluster read ahead and report the
+//worst FetchBuffer latency next to the read ahead counters.
+//Drop the page cache between runs to see cold disk behaviour.
+#include "mkv_source.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+
+static void run(const char* path, const readahead_options* readahead)
+{
+	mkv_source* source = mkv_source_factory::CreateFromFilePositional(path, 64 * 1024, readahead);
+	if (!source) {
+		printf("Cannot open file\n");
+		return;
+	}
+	_buffer_desc desc{};
+	size_t packets = 0;
+	double worst_ms = 0;
+	auto begin = std::chrono::steady_clock::now();
+	while (true) {
+		auto fetch = std::chrono::steady_clock::now();
+		if (source->FetchBuffer(desc))
+			break;
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - fetch).count();
+		if (ms > worst_ms)
+			worst_ms = ms;
+		++packets;
+	}
+	source->ReleaseBuffer(desc);
+	double total = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	printf("%s: %zu packets in %.3f s, worst fetch %.3f ms\n", readahead ? "readahead" : "sync", packets, total, worst_ms);
+	if (const readahead_stats* stats = source->GetReadaheadStats()) {
+		printf("  hits %llu misses %llu stall %.3f ms read ahead %.1f MB\n",
+			(unsigned long long)stats->hits, (unsigned long long)stats->misses,
+			stats->stall_ns / 1e6, stats->bytes_read_ahead / (1024.0 * 1024.0));
+	}
+	delete source;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		printf("usage: %s file.webm [clusters_ahead] [budget_mb]\n", argv[0]);
+		return 1;
+	}
+	readahead_options opts;
+	if (argc > 2)
+		opts.clusters_ahead = atoi(argv[2]);
+	if (argc > 3)
+		opts.byte_budget = (size_t)atoi(argv[3]) * 1024 * 1024;
+	run(argv[1], nullptr);
+	run(argv[1], &opts);
+	opts.prefer_io_uring = false;
+	run(argv[1], &opts);
+	return 0;
+}
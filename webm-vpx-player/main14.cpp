@@ -0,0 +1,95 @@
+//packet allocation benchmark: a demux thread allocates VP9 and
+//Opus sized packets, a decoder thread frees them, once with
+//malloc/free and once through packet_pool. Reports time per
+//packet, how many allocations reached malloc and the RSS.
+#include "packet_pool.h"
+#include "media_buffer.h"
+
+#include <rigtorp/SPSCQueue.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <new>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <Psapi.h>
+static size_t rss_bytes()
+{
+	PROCESS_MEMORY_COUNTERS counters{};
+	GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+	return counters.WorkingSetSize;
+}
+#else
+#include <unistd.h>
+static size_t rss_bytes()
+{
+	long pages = 0, resident = 0;
+	FILE* statm = fopen("/proc/self/statm", "r");
+	if (statm) {
+		if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+			resident = 0;
+		fclose(statm);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+#endif
+
+static constexpr size_t packets = 2000000;
+
+static refed_buffer_block* malloc_block(size_t size)
+{
+	refed_buffer_block* block = (refed_buffer_block*)malloc(sizeof(refed_buffer_block) + size);
+	new(block)refed_buffer_block();
+	block->ref();
+	return block;
+}
+
+//60 fps VP9 with a keyframe every 2 s plus 20 ms Opus frames
+static size_t next_size(std::mt19937& rng, size_t i)
+{
+	if (i % 4 != 0)
+		return 120 + rng() % 300;
+	if (i % 480 == 0)
+		return 150000 + rng() % 100000;
+	return 4000 + rng() % 40000;
+}
+
+static void run(const char* name, refed_buffer_block* (*alloc)(size_t))
+{
+	rigtorp::SPSCQueue<refed_buffer_block*> queue(64);
+	auto begin = std::chrono::steady_clock::now();
+	std::thread decoder([&]() {
+		for (size_t i = 0; i < packets; ++i) {
+			while (!queue.front()) {
+			}
+			(*queue.front())->unref();
+			queue.pop();
+		}
+	});
+	std::mt19937 rng(1);
+	for (size_t i = 0; i < packets; ++i) {
+		size_t size = next_size(rng, i);
+		refed_buffer_block* block = alloc(size);
+		block->buffer[0] = 1;
+		block->buffer[size - 1] = 1;
+		queue.push(block);
+	}
+	decoder.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	printf("%-7s %7.1f ns/packet, rss %6.1f MB\n", name, seconds * 1e9 / packets, rss_bytes() / (1024.0 * 1024.0));
+}
+
+int main()
+{
+	run("malloc", malloc_block);
+	run("pool", packet_pool::alloc_block);
+	packet_pool::stats_t stats = packet_pool::stats();
+	printf("pool: %llu allocs, %llu reached malloc (%llu large), %llu freed remotely\n",
+		(unsigned long long)stats.allocs, (unsigned long long)stats.system_allocs,
+		(unsigned long long)stats.large_allocs, (unsigned long long)stats.remote_frees);
+	return 0;
+}
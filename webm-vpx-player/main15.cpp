@@ -0,0 +1,113 @@
+//seek latency: Seek through the Cues, Seek by cluster scan,
+//Seek through a saved keyframe index and reopening the file and
+//demuxing up to the same position. Latency is measured until the
+//first packet after the seek. Also times building the index
+//against opening again with the saved one.
+#include "mkv_source.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <string>
+
+typedef std::chrono::steady_clock clock_type;
+
+static double ms_since(clock_type::time_point begin)
+{
+	return std::chrono::duration<double, std::milli>(clock_type::now() - begin).count();
+}
+
+static void report(const char* name, const std::vector<double>& ms)
+{
+	double total = 0, worst = 0;
+	for (double m : ms) {
+		total += m;
+		if (m > worst)
+			worst = m;
+	}
+	printf("%-10s avg %8.3f ms, worst %8.3f ms\n", name, total / ms.size(), worst);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		printf("usage: %s file.webm [seeks]\n", argv[0]);
+		return 1;
+	}
+	int seeks = argc > 2 ? atoi(argv[2]) : 50;
+	mkv_source* source = mkv_source_factory::CreateFromFilePositional(argv[1]);
+	if (!source) {
+		printf("Cannot open file\n");
+		return 1;
+	}
+	_buffer_desc desc{};
+	uint64_t duration = 0;
+	while (!source->FetchBuffer(desc)) {
+		if (desc.start_timestamp > duration)
+			duration = desc.start_timestamp;
+	}
+	std::mt19937_64 rng(1);
+	std::vector<uint64_t> targets(seeks);
+	for (uint64_t& target : targets)
+		target = duration ? rng() % duration : 0;
+
+	std::vector<double> cues, scan, reopen;
+	std::vector<uint64_t> landed;
+	for (uint64_t target : targets) {
+		auto begin = clock_type::now();
+		source->Seek(target);
+		source->FetchBuffer(desc);
+		cues.push_back(ms_since(begin));
+		landed.push_back(desc.start_timestamp);
+	}
+	//the first one includes the scan itself
+	for (uint64_t target : targets) {
+		auto begin = clock_type::now();
+		source->Seek(target, mkv_source::SEEK_SCAN_CLUSTERS);
+		source->FetchBuffer(desc);
+		scan.push_back(ms_since(begin));
+	}
+	source->ReleaseBuffer(desc);
+	delete source;
+
+	std::string sidecar = std::string(argv[1]) + ".bench.kfidx";
+	remove(sidecar.c_str());
+	std::vector<double> build, load, indexed;
+	auto begin = clock_type::now();
+	source = mkv_source_factory::CreateFromFilePositional(argv[1]);
+	source->LoadIndex(argv[1], sidecar.c_str());
+	build.push_back(ms_since(begin));
+	delete source;
+	begin = clock_type::now();
+	source = mkv_source_factory::CreateFromFilePositional(argv[1]);
+	source->LoadIndex(argv[1], sidecar.c_str());
+	load.push_back(ms_since(begin));
+	for (uint64_t target : targets) {
+		begin = clock_type::now();
+		source->Seek(target);
+		source->FetchBuffer(desc);
+		indexed.push_back(ms_since(begin));
+	}
+	source->ReleaseBuffer(desc);
+	delete source;
+	remove(sidecar.c_str());
+	for (uint64_t target : landed) {
+		auto begin = clock_type::now();
+		mkv_source* fresh = mkv_source_factory::CreateFromFilePositional(argv[1]);
+		_buffer_desc skip{};
+		while (!fresh->FetchBuffer(skip) && skip.start_timestamp < target) {
+		}
+		reopen.push_back(ms_since(begin));
+		fresh->ReleaseBuffer(skip);
+		delete fresh;
+	}
+	report("cues", cues);
+	report("scan", scan);
+	report("indexed", indexed);
+	report("reopen", reopen);
+	report("open+build", build);
+	report("open+load", load);
+	return 0;
+}
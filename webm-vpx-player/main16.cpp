@@ -0,0 +1,100 @@
+//demux with every track, only the video and only the audio connected,
+//reporting bytes read from the file and packet allocations per run.
+//Unconnected tracks are masked, so their payloads should not be read.
+#include "mkv_source.h"
+#include "media_sink.h"
+#include "packet_pool.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+
+#ifdef _WIN32
+#include <Windows.h>
+static uint64_t bytes_read()
+{
+	IO_COUNTERS counters{};
+	GetProcessIoCounters(GetCurrentProcess(), &counters);
+	return counters.ReadTransferCount;
+}
+#else
+static uint64_t bytes_read()
+{
+	unsigned long long rchar = 0;
+	FILE* io = fopen("/proc/self/io", "r");
+	if (io) {
+		if (fscanf(io, "rchar: %llu", &rchar) != 1)
+			rchar = 0;
+		fclose(io);
+	}
+	return rchar;
+}
+#endif
+
+//counts what it is given, the packet stays with the caller
+class counting_sink:public media_sink {
+public:
+	size_t packets = 0;
+	virtual int QueueBuffer(_buffer_desc& buffer) override final
+	{
+		++packets;
+		return S_OK;
+	}
+	virtual int AllocBuffer(_buffer_desc& buffer) override final
+	{
+		return E_INVALID_OPERATION;
+	}
+	virtual int Flush() override final
+	{
+		return S_OK;
+	}
+	virtual int GetInputs(stream_desc *& desc, size_t& num) override final
+	{
+		num = 0;
+		desc = nullptr;
+		return S_OK;
+	}
+};
+
+static void run(const char* path, size_t block_size, stream_desc::major_type wanted)
+{
+	mkv_source* source = mkv_source_factory::CreateFromFilePositional(path, block_size);
+	if (!source) {
+		printf("Cannot open file\n");
+		return;
+	}
+	counting_sink sink;
+	stream_desc* outputs;
+	size_t count;
+	source->GetOutputs(outputs, count);
+	for (size_t i = 0; i < count; ++i) {
+		if (wanted == stream_desc::MTYPE_NONE || outputs[i].type == wanted)
+			outputs[i].downstream = &sink;
+	}
+	uint64_t read_before = bytes_read();
+	uint64_t allocs_before = packet_pool::stats().allocs;
+	auto begin = std::chrono::steady_clock::now();
+	_buffer_desc desc{};
+	while (!source->FetchBuffer(desc)) {
+	}
+	source->ReleaseBuffer(desc);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	const char* name = wanted == stream_desc::MTYPE_VIDEO ? "video" : wanted == stream_desc::MTYPE_AUDIO ? "audio" : "all";
+	printf("%-5s %8zu packets, %8.1f MB read, %8llu allocations, %.3f s\n", name, sink.packets,
+		(bytes_read() - read_before) / (1024.0 * 1024.0),
+		(unsigned long long)(packet_pool::stats().allocs - allocs_before), seconds);
+	delete source;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		printf("usage: %s file.webm [block_size]\n", argv[0]);
+		return 1;
+	}
+	size_t block_size = argc > 2 ? (size_t)atoi(argv[2]) : 4096;
+	run(argv[1], block_size, stream_desc::MTYPE_NONE);
+	run(argv[1], block_size, stream_desc::MTYPE_VIDEO);
+	run(argv[1], block_size, stream_desc::MTYPE_AUDIO);
+	return 0;
+}
@@ -0,0 +1,82 @@
+//demux into a sink one packet per call and in batches,
+//reporting ns per packet. Run on an audio heavy file to see
+//the per call overhead next to small Opus packets.
+#include "mkv_source.h"
+#include "media_sink.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+
+class counting_sink:public media_sink {
+public:
+	size_t packets = 0;
+	virtual int QueueBuffer(_buffer_desc& buffer) override final
+	{
+		++packets;
+		return S_OK;
+	}
+	virtual int QueueBuffers(_buffer_desc* buffers, size_t count, size_t& done) override final
+	{
+		packets += count;
+		done = count;
+		return S_OK;
+	}
+	virtual int AllocBuffer(_buffer_desc& buffer) override final
+	{
+		return E_INVALID_OPERATION;
+	}
+	virtual int Flush() override final
+	{
+		return S_OK;
+	}
+	virtual int GetInputs(stream_desc *& desc, size_t& num) override final
+	{
+		num = 0;
+		desc = nullptr;
+		return S_OK;
+	}
+};
+
+static void run(const char* path, size_t batch)
+{
+	mkv_source* source = mkv_source_factory::CreateFromFileMapped(path);
+	if (!source) {
+		printf("Cannot open file\n");
+		return;
+	}
+	counting_sink sink;
+	stream_desc* outputs;
+	size_t count;
+	source->GetOutputs(outputs, count);
+	for (size_t i = 0; i < count; ++i)
+		outputs[i].downstream = &sink;
+	std::vector<_buffer_desc> buffers(batch);
+	auto begin = std::chrono::steady_clock::now();
+	if (batch == 1) {
+		while (!source->FetchBuffer(buffers[0])) {
+		}
+	}
+	else {
+		size_t done;
+		while (!source->FetchBuffers(buffers.data(), batch, done)) {
+		}
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	for (_buffer_desc& buffer : buffers)
+		source->ReleaseBuffer(buffer);
+	printf("batch %4zu: %8zu packets, %7.1f ns/packet\n", batch, sink.packets, seconds * 1e9 / sink.packets);
+	delete source;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		printf("usage: %s file.webm\n", argv[0]);
+		return 1;
+	}
+	for (size_t batch : { 1, 8, 64, 256 })
+		run(argv[1], batch);
+	return 0;
+}
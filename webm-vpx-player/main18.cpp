@@ -0,0 +1,102 @@
+//open time and demux rate of the three WebM parsers: matroska2
+//(positional source), the built in webm_demuxer (native source)
+//and libwebm's mkvparser. Every frame's payload is read, the
+//sources through FetchBuffer, mkvparser through Frame::Read.
+#include "mkv_source.h"
+#include <libwebm/mkvparser.hpp>
+#include <libwebm/mkvreader.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+
+typedef std::chrono::steady_clock clock_type;
+
+static double ms_since(clock_type::time_point begin)
+{
+	return std::chrono::duration<double, std::milli>(clock_type::now() - begin).count();
+}
+
+static void report(const char* name, double open_ms, double demux_ms, size_t packets)
+{
+	printf("%-10s open %8.3f ms, %8zu packets in %9.3f ms, %10.0f packets/s\n", name, open_ms, packets, demux_ms,
+		demux_ms > 0 ? packets * 1000.0 / demux_ms : 0.0);
+}
+
+static void run_source(const char* name, const char* path, bool native)
+{
+	auto begin = clock_type::now();
+	mkv_source* source = native ? mkv_source_factory::CreateFromFileNative(path) :
+		mkv_source_factory::CreateFromFilePositional(path);
+	double open_ms = ms_since(begin);
+	if (!source) {
+		printf("%-10s cannot open file\n", name);
+		return;
+	}
+	size_t packets = 0;
+	_buffer_desc desc{};
+	begin = clock_type::now();
+	while (!source->FetchBuffer(desc))
+		++packets;
+	double demux_ms = ms_since(begin);
+	source->ReleaseBuffer(desc);
+	delete source;
+	report(name, open_ms, demux_ms, packets);
+}
+
+static void run_mkvparser(const char* path)
+{
+	auto begin = clock_type::now();
+	MkvReader reader;
+	if (reader.Open(path)) {
+		printf("%-10s cannot open file\n", "mkvparser");
+		return;
+	}
+	long long pos = 0;
+	mkvparser::EBMLHeader header;
+	mkvparser::Segment* segment = nullptr;
+	if (header.Parse(&reader, pos) < 0 || mkvparser::Segment::CreateInstance(&reader, pos, segment) || segment->Load() < 0) {
+		printf("%-10s cannot parse file\n", "mkvparser");
+		delete segment;
+		return;
+	}
+	double open_ms = ms_since(begin);
+	size_t packets = 0;
+	std::vector<unsigned char> payload;
+	begin = clock_type::now();
+	for (const mkvparser::Cluster* cluster = segment->GetFirst(); cluster && !cluster->EOS(); cluster = segment->GetNext(cluster)) {
+		const mkvparser::BlockEntry* entry = nullptr;
+		if (cluster->GetFirst(entry) < 0)
+			break;
+		while (entry && !entry->EOS()) {
+			const mkvparser::Block* block = entry->GetBlock();
+			for (int i = 0; i < block->GetFrameCount(); ++i) {
+				const mkvparser::Block::Frame& frame = block->GetFrame(i);
+				payload.resize(frame.len);
+				frame.Read(&reader, payload.data());
+				++packets;
+			}
+			if (cluster->GetNext(entry, entry) < 0)
+				break;
+		}
+	}
+	double demux_ms = ms_since(begin);
+	delete segment;
+	report("mkvparser", open_ms, demux_ms, packets);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		printf("usage: %s file.webm [runs]\n", argv[0]);
+		return 1;
+	}
+	int runs = argc > 2 ? atoi(argv[2]) : 3;
+	for (int i = 0; i < runs; ++i) {
+		run_source("matroska2", argv[1], false);
+		run_source("native", argv[1], true);
+		run_mkvparser(argv[1]);
+	}
+	return 0;
+}
@@ -0,0 +1,50 @@
+//open/close cost per instance: opening and closing a source from
+//memory with the matroska2 context kept registered in the pool, against
+//the same with the context shut down after every close, which is
+//what each instance used to pay for its own registration. A small
+//file (or its first clusters) shows the setup cost best.
+#include "mkv_source.h"
+#include "mkv_context.h"
+#include "file_io.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+
+typedef std::chrono::steady_clock clock_type;
+
+static double run(const file_mapping& mapping, int count, bool per_instance)
+{
+	auto begin = clock_type::now();
+	for (int i = 0; i < count; ++i) {
+		mkv_source* source = mkv_source_factory::CreateFromMemory(mapping.data(), (size_t)mapping.size());
+		if (!source) {
+			printf("Cannot open file\n");
+			return 0;
+		}
+		delete source;
+		if (per_instance)
+			mkv_context::shutdown();
+	}
+	return std::chrono::duration<double, std::micro>(clock_type::now() - begin).count() / count;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		printf("usage: %s file.webm [count]\n", argv[0]);
+		return 1;
+	}
+	int count = argc > 2 ? atoi(argv[2]) : 500;
+	file_mapping mapping;
+	if (!mapping.open(argv[1])) {
+		printf("Cannot open file\n");
+		return 1;
+	}
+	double per_instance = run(mapping, count, true);
+	double shared = run(mapping, count, false);
+	printf("registry per instance %9.1f us/open\n", per_instance);
+	printf("pooled registry       %9.1f us/open\n", shared);
+	mkv_context::shutdown();
+	return 0;
+}
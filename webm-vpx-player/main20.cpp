@@ -0,0 +1,77 @@
+//remux throughput of mkv_sink: demuxes a file into a new one through
+//the buffered sink (with and without preallocating the input's size)
+//and through the stdio one, reporting MB/s of input remuxed.
+#include "mkv_source.h"
+#include "mkv_sink.h"
+#include "file_io.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <string>
+
+enum sink_kind {
+	SINK_STDIO,
+	SINK_BUFFERED,
+	SINK_PREALLOCATED
+};
+
+static void run(const char* path, const char* out_path, sink_kind kind)
+{
+	uint64_t size;
+	int64_t mtime;
+	if (!file_identity(path, size, mtime)) {
+		printf("Cannot open file\n");
+		return;
+	}
+	auto begin = std::chrono::steady_clock::now();
+	mkv_source* source = mkv_source_factory::CreateFromFilePositional(path);
+	if (!source) {
+		printf("Cannot open file\n");
+		return;
+	}
+	stream_desc* outputs;
+	size_t count;
+	source->GetOutputs(outputs, count);
+	mkv_sink* sink = kind == SINK_STDIO ? mkv_sink_factory::CreateFromFileStdio(outputs, count, out_path) :
+		mkv_sink_factory::CreateFromFile(outputs, count, out_path, kind == SINK_PREALLOCATED ? size : 0);
+	if (!sink) {
+		printf("Cannot open %s\n", out_path);
+		delete source;
+		return;
+	}
+	for (size_t i = 0; i < count; ++i)
+		outputs[i].downstream = sink;
+	_buffer_desc desc{};
+	while (!source->FetchBuffer(desc)) {
+	}
+	source->ReleaseBuffer(desc);
+	int err = sink->Flush();
+	delete sink;
+	delete source;
+	if (err) {
+		printf("Cannot write %s\n", out_path);
+		return;
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	uint64_t written;
+	file_identity(out_path, written, mtime);
+	const char* name = kind == SINK_STDIO ? "stdio" : kind == SINK_BUFFERED ? "buffered" : "prealloc";
+	printf("%-9s %8.1f MB/s, %.1f MB written\n", name, size / (1024.0 * 1024.0) / seconds, written / (1024.0 * 1024.0));
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		printf("usage: %s file.webm [out.webm]\n", argv[0]);
+		return 1;
+	}
+	std::string out = argc > 2 ? argv[2] : std::string(argv[1]) + ".remux.webm";
+	for (int i = 0; i < 2; ++i) {
+		run(argv[1], out.c_str(), SINK_STDIO);
+		run(argv[1], out.c_str(), SINK_BUFFERED);
+		run(argv[1], out.c_str(), SINK_PREALLOCATED);
+	}
+	remove(out.c_str());
+	return 0;
+}
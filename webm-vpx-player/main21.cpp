@@ -0,0 +1,234 @@
+//remux: copies the packets of a WebM/Matroska file into a new one
+//without touching the payloads. The source maps the file, so every
+//packet points into the mapping, and the sink's writer thread takes
+//a ref on it instead of a copy.
+//	remux in.webm out.webm [--tracks 0,2] [--start s] [--end s] [--stats]
+//--start seeks to the keyframe at or before it, --end stops at the
+//first video keyframe at or after it (any packet without video), so
+//the output starts at a keyframe and ends before one.
+//Timestamps are shifted to start at 0 when trimming the start.
+//The output gets Cues, after the last cluster.
+#include "mkv_source.h"
+#include "mkv_sink.h"
+#include "file_io.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <vector>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <Psapi.h>
+static double peak_rss_mb()
+{
+	PROCESS_MEMORY_COUNTERS counters{};
+	GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+	return counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+}
+#else
+#include <sys/resource.h>
+static double peak_rss_mb()
+{
+	rusage usage{};
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+	return usage.ru_maxrss / 1024.0;
+#endif
+}
+#endif
+
+//Between the source's selected outputs and the sink: renumbers the
+//tracks to the sink's, trims and rebases the timestamps. Forwards a
+//copy of the packet, the source's own stays as it is.
+class remux_filter:public media_sink {
+public:
+	mkv_sink* sink = nullptr;
+	//sink track per source track, -1 if not copied
+	std::vector<int> tracks;
+	std::vector<bool> video;
+	bool has_video = false;
+	uint64_t end = UINT64_MAX;
+	bool rebase = false;
+	bool started = false;
+	bool done = false;
+	uint64_t base = 0;
+	uint64_t packets = 0;
+	uint64_t bytes = 0;
+	//the sink refused a packet, the output is incomplete
+	int failed = S_OK;
+	virtual int QueueBuffer(_buffer_desc& buffer) override final
+	{
+		uint32_t track = buffer.detail.pkt.track;
+		bool cut = !has_video || video[track];
+		bool key = buffer.detail.pkt.key_frame;
+		if (!started) {
+			//the seek lands before start, on the keyframe to begin with
+			if (!cut || !key)
+				return S_OK;
+			started = true;
+			base = rebase ? buffer.start_timestamp : 0;
+		}
+		if (buffer.start_timestamp < base)
+			return S_OK;
+		if (cut && key && buffer.start_timestamp >= end && buffer.start_timestamp > base) {
+			done = true;
+			return S_OK;
+		}
+		if (done)
+			return S_OK;
+		_buffer_desc out(buffer);
+		out.detail.pkt.track = tracks[track];
+		out.start_timestamp -= base;
+		out.end_timestamp = out.end_timestamp >= base ? out.end_timestamp - base : out.start_timestamp;
+		++packets;
+		bytes += out.detail.pkt.size;
+		int err = sink->QueueBuffer(out);
+		if (err) {
+			failed = err;
+			done = true;
+		}
+		return err;
+	}
+	virtual int AllocBuffer(_buffer_desc& buffer) override final
+	{
+		return E_INVALID_OPERATION;
+	}
+	virtual int Flush() override final
+	{
+		return S_OK;
+	}
+	virtual int GetInputs(stream_desc *& desc, size_t& num) override final
+	{
+		num = 0;
+		desc = nullptr;
+		return S_OK;
+	}
+};
+
+static void usage(const char* name)
+{
+	printf("usage: %s in.webm out.webm [--tracks 0,2] [--start seconds] [--end seconds] [--stats]\n", name);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 3) {
+		usage(argv[0]);
+		return 1;
+	}
+	const char* in_path = argv[1];
+	const char* out_path = argv[2];
+	const char* track_list = nullptr;
+	double start = 0, end = -1;
+	bool stats = false;
+	for (int i = 3; i < argc; ++i) {
+		if (!strcmp(argv[i], "--tracks") && i + 1 < argc) {
+			track_list = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--start") && i + 1 < argc) {
+			start = atof(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--end") && i + 1 < argc) {
+			end = atof(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--stats")) {
+			stats = true;
+		}
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	auto begin = std::chrono::steady_clock::now();
+	mkv_source* source = mkv_source_factory::CreateFromFileMapped(in_path);
+	if (!source) {
+		printf("Cannot open %s\n", in_path);
+		return 1;
+	}
+	stream_desc* outputs;
+	size_t count;
+	source->GetOutputs(outputs, count);
+	std::vector<bool> selected(count, track_list == nullptr);
+	for (const char* p = track_list; p && *p;) {
+		char* next;
+		long index = strtol(p, &next, 10);
+		if (next == p || index < 0 || (size_t)index >= count) {
+			printf("No track %s\n", p);
+			delete source;
+			return 1;
+		}
+		selected[index] = true;
+		p = *next == ',' ? next + 1 : next;
+	}
+	remux_filter filter;
+	filter.tracks.assign(count, -1);
+	filter.video.assign(count, false);
+	std::vector<stream_desc> copied;
+	for (size_t i = 0; i < count; ++i) {
+		if (!selected[i])
+			continue;
+		filter.tracks[i] = (int)copied.size();
+		filter.video[i] = outputs[i].type == stream_desc::MTYPE_VIDEO;
+		filter.has_video |= filter.video[i];
+		copied.push_back(outputs[i]);
+	}
+	if (copied.empty()) {
+		printf("No tracks selected\n");
+		delete source;
+		return 1;
+	}
+	uint64_t in_size;
+	int64_t in_mtime;
+	if (!file_identity(in_path, in_size, in_mtime))
+		in_size = 0;
+	mkv_sink::output_options options;
+	options.expected_size = in_size;
+	options.cues = true;
+	mkv_sink* sink = mkv_sink_factory::CreateFromFile(copied.data(), copied.size(), out_path, options);
+	if (!sink) {
+		printf("Cannot open %s\n", out_path);
+		delete source;
+		return 1;
+	}
+	mkv_sink::async_options async;
+	if (sink->StartAsync(async)) {
+		printf("Cannot start writing %s\n", out_path);
+		delete sink;
+		delete source;
+		return 1;
+	}
+	filter.sink = sink;
+	filter.end = end >= 0 ? (uint64_t)(end * 1e9) : UINT64_MAX;
+	filter.rebase = start > 0;
+	//unselected outputs stay unconnected and are skipped by the parser
+	for (size_t i = 0; i < count; ++i) {
+		if (selected[i])
+			outputs[i].downstream = &filter;
+	}
+	if (start > 0)
+		source->Seek((uint64_t)(start * 1e9));
+	_buffer_desc desc{};
+	while (!filter.done && !source->FetchBuffer(desc)) {
+	}
+	source->ReleaseBuffer(desc);
+	int err = sink->Flush();
+	delete sink;
+	delete source;
+	if (err == E_NO_INDEX)
+		printf("Cannot write the cues, seeking into the output scans it\n");
+	else if (filter.failed || err) {
+		printf("Cannot write %s, it is incomplete\n", out_path);
+		return 1;
+	}
+	if (stats) {
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		printf("%llu packets, %.1f MB in %.3f s: %.1f MB/s, %.0f packets/s, peak RSS %.1f MB\n",
+			(unsigned long long)filter.packets, filter.bytes / (1024.0 * 1024.0), seconds,
+			filter.bytes / (1024.0 * 1024.0) / seconds, filter.packets / seconds, peak_rss_mb());
+	}
+	return 0;
+}
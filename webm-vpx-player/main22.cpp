@@ -0,0 +1,195 @@
+//glass to file latency of the live mkv_sink: a synthetic realtime
+//producer (30 fps video, a keyframe every 2 s, 50 audio packets/s)
+//queues packets stamped with the time they are "captured", the sink
+//writes them into a pipe, and a reader on the other end parses the
+//Clusters as they come and takes the time each block arrives.
+//Run with the clusters flushed as they end, shorter clusters, and
+//every frame flushed.
+//	main22 [seconds per run]
+#include "mkv_sink.h"
+#include "packet_pool.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#define pipe(fds) _pipe(fds, 1 << 16, _O_BINARY)
+#define fdopen _fdopen
+#define read _read
+#define close _close
+#else
+#include <unistd.h>
+#endif
+
+typedef std::chrono::steady_clock clock_type;
+
+//arrival of every block in ms after it was captured. Parses just
+//enough of the live stream: unknown sized Segment and Clusters are
+//entered, the cluster Timecode and SimpleBlocks read, the rest skipped.
+//Assumes the muxer's default 1 ms timecode scale.
+static void read_stream(int fd, clock_type::time_point begin, std::vector<double>& latency)
+{
+	std::vector<uint8_t> data;
+	size_t pos = 0;
+	int64_t cluster_time = 0;
+	uint8_t chunk[65536];
+	while (true) {
+		int got = (int)read(fd, chunk, sizeof(chunk));
+		if (got <= 0)
+			break;
+		auto now = clock_type::now();
+		data.insert(data.end(), chunk, chunk + got);
+		while (pos < data.size()) {
+			const uint8_t* p = &data[pos];
+			size_t avail = data.size() - pos;
+			if (!p[0])
+				return;
+			size_t id_len = 1;
+			while (!(p[0] & (0x80 >> (id_len - 1))))
+				++id_len;
+			if (id_len + 1 > avail)
+				break;
+			uint32_t id = 0;
+			for (size_t i = 0; i < id_len; ++i)
+				id = (id << 8) | p[i];
+			size_t size_len = 1;
+			while (size_len < 8 && !(p[id_len] & (0x80 >> (size_len - 1))))
+				++size_len;
+			if (id_len + size_len > avail)
+				break;
+			uint64_t size = p[id_len] & (0xFF >> size_len);
+			for (size_t i = 1; i < size_len; ++i)
+				size = (size << 8) | p[id_len + i];
+			size_t head = id_len + size_len;
+			//Segment and Cluster, entered
+			if (id == 0x18538067 || id == 0x1F43B675) {
+				pos += head;
+				continue;
+			}
+			if (head + size > avail)
+				break;
+			const uint8_t* body = p + head;
+			if (id == 0xE7) {
+				cluster_time = 0;
+				for (uint64_t i = 0; i < size; ++i)
+					cluster_time = (cluster_time << 8) | body[i];
+			}
+			else if (id == 0xA3) {
+				size_t track_len = 1;
+				while (!(body[0] & (0x80 >> (track_len - 1))))
+					++track_len;
+				int16_t relative = (int16_t)((body[track_len] << 8) | body[track_len + 1]);
+				auto captured = begin + std::chrono::milliseconds(cluster_time + relative);
+				latency.push_back(std::chrono::duration<double, std::milli>(now - captured).count());
+			}
+			pos += head + (size_t)size;
+		}
+		if (pos > (1 << 20)) {
+			data.erase(data.begin(), data.begin() + pos);
+			pos = 0;
+		}
+	}
+}
+
+static void queue(mkv_sink* sink, uint32_t track, uint64_t timestamp, size_t size, bool key)
+{
+	_buffer_desc packet{};
+	packet.detail.pkt.buffer = packet_pool::alloc_block(size);
+	packet.detail.pkt.data = packet.detail.pkt.buffer->buffer;
+	packet.detail.pkt.size = size;
+	memset(packet.detail.pkt.data, 0x5A, size);
+	packet.detail.pkt.track = track;
+	packet.detail.pkt.key_frame = key;
+	packet.start_timestamp = timestamp;
+	packet.end_timestamp = timestamp;
+	sink->QueueBuffer(packet);
+	packet.detail.pkt.buffer->unref();
+}
+
+static void run(const char* name, const mkv_sink::live_options& options, int seconds)
+{
+	int fds[2];
+	if (pipe(fds)) {
+		printf("Cannot create pipe\n");
+		return;
+	}
+	FILE* out = fdopen(fds[1], "wb");
+	//a flush is what puts the data into the pipe, not a full stdio
+	//buffer (glibc ignores the size without a buffer of our own)
+	std::vector<char> out_buffer(1 << 20);
+	setvbuf(out, out_buffer.data(), _IOFBF, out_buffer.size());
+	stream_desc tracks[2]{};
+	tracks[0].type = stream_desc::MTYPE_VIDEO;
+	tracks[0].detail.video.codec = stream_desc::video_info::VCODEC_VP9;
+	tracks[0].detail.video.width = 1280;
+	tracks[0].detail.video.height = 720;
+	tracks[1].type = stream_desc::MTYPE_AUDIO;
+	tracks[1].detail.audio.codec = stream_desc::audio_info::ACODEC_OPUS;
+	tracks[1].detail.audio.Hz = 48000;
+	tracks[1].detail.audio.layout.channel_count = 2;
+	std::vector<double> latency;
+	auto begin = clock_type::now();
+	std::thread reader(read_stream, fds[0], begin, std::ref(latency));
+	mkv_sink* sink = mkv_sink_factory::CreateLive(tracks, 2, out, options);
+	if (!sink) {
+		printf("Cannot start live output\n");
+		fclose(out);
+		reader.join();
+		close(fds[0]);
+		return;
+	}
+	sink->StartAsync(mkv_sink::async_options());
+	//capture clock: a video frame every 33.3 ms, audio every 20 ms
+	uint64_t video = 0, audio = 0;
+	const uint64_t end = (uint64_t)seconds * 1000000000;
+	while (true) {
+		uint64_t video_ts = video * 1000000000 / 30;
+		uint64_t audio_ts = audio * 20000000;
+		uint64_t next = video_ts < audio_ts ? video_ts : audio_ts;
+		if (next >= end)
+			break;
+		std::this_thread::sleep_until(begin + std::chrono::nanoseconds(next));
+		if (video_ts <= audio_ts) {
+			queue(sink, 0, video_ts, video % 60 ? 8000 : 60000, video % 60 == 0);
+			++video;
+		}
+		else {
+			queue(sink, 1, audio_ts, 160, true);
+			++audio;
+		}
+	}
+	sink->Flush();
+	delete sink;
+	fclose(out);
+	reader.join();
+	close(fds[0]);
+	if (latency.empty()) {
+		printf("%-22s nothing arrived\n", name);
+		return;
+	}
+	double sum = 0;
+	for (double ms : latency)
+		sum += ms;
+	std::sort(latency.begin(), latency.end());
+	printf("%-22s %6zu blocks, latency mean %7.1f ms, p50 %7.1f ms, p99 %7.1f ms, max %7.1f ms\n", name, latency.size(),
+		sum / latency.size(), latency[latency.size() / 2], latency[latency.size() * 99 / 100], latency.back());
+}
+
+int main(int argc, char** argv)
+{
+	int seconds = argc > 1 ? atoi(argv[1]) : 10;
+	mkv_sink::live_options options;
+	run("clusters of up to 1 s", options, seconds);
+	options.max_cluster_ms = 200;
+	run("clusters of up to 200ms", options, seconds);
+	options.max_cluster_ms = 1000;
+	options.flush_frames = true;
+	run("every frame flushed", options, seconds);
+	return 0;
+}
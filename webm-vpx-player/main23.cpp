@@ -0,0 +1,125 @@
+//container overhead of lacing in the live mkv_sink: the same synthetic
+//stream (30 fps video, 20 ms Opus frames of varying or constant size)
+//written with each lacing mode, reporting blocks, bytes that are not
+//payload and calls into the output. Each file is demuxed back through
+//the native source, checking every packet and counting the audio
+//packets that are slices of a shared laced block.
+//	main23 [seconds] [out.webm]
+#include "mkv_source.h"
+#include "mkv_sink.h"
+#include "packet_pool.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+//the size of audio frame i, constant for CBR
+static uint32_t audio_size(uint64_t i, bool cbr)
+{
+	return cbr ? 160 : 60 + (uint32_t)((i * 7919) % 121);
+}
+
+static void queue(mkv_sink* sink, uint32_t track, uint64_t start, uint64_t end, uint32_t size, bool key, uint8_t fill)
+{
+	_buffer_desc packet{};
+	packet.detail.pkt.buffer = packet_pool::alloc_block(size);
+	packet.detail.pkt.data = packet.detail.pkt.buffer->buffer;
+	packet.detail.pkt.size = size;
+	memset(packet.detail.pkt.data, fill, size);
+	packet.detail.pkt.track = track;
+	packet.detail.pkt.key_frame = key;
+	packet.start_timestamp = start;
+	packet.end_timestamp = end;
+	sink->QueueBuffer(packet);
+	packet.detail.pkt.buffer->unref();
+}
+
+static void run(const char* name, mkv_sink::live_options::lacing_mode lacing, bool cbr, int seconds, const char* path)
+{
+	stream_desc tracks[2]{};
+	tracks[0].type = stream_desc::MTYPE_VIDEO;
+	tracks[0].detail.video.codec = stream_desc::video_info::VCODEC_VP9;
+	tracks[0].detail.video.width = 1280;
+	tracks[0].detail.video.height = 720;
+	tracks[1].type = stream_desc::MTYPE_AUDIO;
+	tracks[1].detail.audio.codec = stream_desc::audio_info::ACODEC_OPUS;
+	tracks[1].detail.audio.Hz = 48000;
+	tracks[1].detail.audio.layout.channel_count = 2;
+	FILE* out = fopen(path, "wb");
+	if (!out) {
+		printf("Cannot open file\n");
+		return;
+	}
+	mkv_sink::live_options options;
+	options.lacing = lacing;
+	mkv_sink* sink = mkv_sink_factory::CreateLive(tracks, 2, out, options);
+	if (!sink) {
+		printf("Cannot start live output\n");
+		fclose(out);
+		return;
+	}
+	uint64_t video = 0, audio = 0;
+	const uint64_t end = (uint64_t)seconds * 1000000000;
+	while (true) {
+		uint64_t video_ts = video * 1000000000 / 30;
+		uint64_t audio_ts = audio * 20000000;
+		if (video_ts >= end && audio_ts >= end)
+			break;
+		if (video_ts <= audio_ts) {
+			queue(sink, 0, video_ts, video_ts, video % 60 ? 6000 : 40000, video % 60 == 0, (uint8_t)video);
+			++video;
+		}
+		else {
+			queue(sink, 1, audio_ts, audio_ts + 20000000, audio_size(audio, cbr), true, (uint8_t)audio);
+			++audio;
+		}
+	}
+	sink->Flush();
+	mkv_sink::output_stats stats = *sink->GetOutputStats();
+	delete sink;
+	fclose(out);
+	//read back: the packets in order, the laced ones sharing blocks
+	mkv_source* source = mkv_source_factory::CreateFromFileNative(path);
+	uint64_t read[2] = { 0, 0 }, bad = 0, shared = 0;
+	if (source) {
+		_buffer_desc desc{};
+		const refed_buffer_block* last_block = nullptr;
+		while (!source->FetchBuffer(desc)) {
+			uint32_t track = desc.detail.pkt.track;
+			uint64_t index = read[track]++;
+			uint32_t size = track ? audio_size(index, cbr) : (index % 60 ? 6000 : 40000);
+			const uint8_t* data = (const uint8_t*)desc.detail.pkt.data;
+			if (desc.detail.pkt.size != size || data[0] != (uint8_t)index || data[size - 1] != (uint8_t)index ||
+				(track && desc.start_timestamp / 1000000 != index * 20))
+				++bad;
+			//past the start of the block the packet before had, not a recycled one
+			if (track && desc.detail.pkt.buffer == last_block && data != last_block->buffer)
+				++shared;
+			last_block = desc.detail.pkt.buffer;
+		}
+		source->ReleaseBuffer(desc);
+		delete source;
+	}
+	printf("%-12s %6llu frames in %6llu blocks, overhead %7llu bytes (%5.2f%%), %6llu writes | read %llu/%llu, %llu bad, %llu shared\n",
+		name, (unsigned long long)stats.frames, (unsigned long long)stats.blocks, (unsigned long long)stats.overhead_bytes,
+		stats.overhead_bytes * 100.0 / (stats.payload_bytes + stats.overhead_bytes), (unsigned long long)stats.writes,
+		(unsigned long long)(read[0] + read[1]), (unsigned long long)(video + audio), (unsigned long long)bad, (unsigned long long)shared);
+}
+
+int main(int argc, char** argv)
+{
+	int seconds = argc > 1 ? atoi(argv[1]) : 60;
+	std::string path = argc > 2 ? argv[2] : "lacing.webm";
+	typedef mkv_sink::live_options options;
+	for (int cbr = 0; cbr < 2; ++cbr) {
+		printf(cbr ? "constant size audio\n" : "varying size audio\n");
+		run("none", options::LACING_NONE, cbr != 0, seconds, path.c_str());
+		run("xiph", options::LACING_XIPH, cbr != 0, seconds, path.c_str());
+		run("ebml", options::LACING_EBML, cbr != 0, seconds, path.c_str());
+		run("fixed", options::LACING_FIXED, cbr != 0, seconds, path.c_str());
+		run("auto", options::LACING_AUTO, cbr != 0, seconds, path.c_str());
+	}
+	return 0;
+}
@@ -0,0 +1,138 @@
+//frame time jitter at the consumer of the VP9 decoder: a presenter
+//fetches one frame per tick of a fixed rate clock, as a renderer at
+//vsync would, while a feeder thread demuxes the file into the decoder.
+//Decoding in FetchBuffer, a slow frame delays the presentation by its
+//whole decode time; decoding ahead, the fetch only takes a ready frame.
+//Reports the interval between presented frames (its deviation from
+//the tick is the jitter), the time spent in FetchBuffer and the ticks
+//the frame was late by more than half a tick.
+//	main24 in.webm [fps] [decoder threads]
+#include "mkv_source.h"
+#include "media_transform.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+typedef std::chrono::steady_clock clock_type;
+
+static double ms(clock_type::duration d)
+{
+	return std::chrono::duration<double, std::milli>(d).count();
+}
+
+static void run(const char* path, double fps, uint32_t threads, uint32_t depth)
+{
+	mkv_source* source = mkv_source_factory::CreateFromFile(path);
+	if (!source) {
+		printf("Cannot open %s\n", path);
+		return;
+	}
+	stream_desc* outputs;
+	size_t count;
+	source->GetOutputs(outputs, count);
+	video_decoder* decoder = nullptr;
+	for (size_t i = 0; i < count && !decoder; ++i) {
+		if (outputs[i].type == stream_desc::MTYPE_VIDEO && outputs[i].detail.video.codec == stream_desc::video_info::VCODEC_VP9)
+			decoder = video_decoder_factory::CreateDefaultVP9Decoder(&outputs[i], threads, false, depth);
+	}
+	if (!decoder) {
+		printf("No VP9 track in %s\n", path);
+		delete source;
+		return;
+	}
+	//the other tracks stay unconnected and are skipped
+	std::atomic<bool> fed{ false };
+	std::thread feeder([&] {
+		_buffer_desc desc{};
+		int err;
+		//E_AGAIN while the decoder's queue is full
+		while (!(err = source->FetchBuffer(desc)) || err == E_AGAIN) {
+			if (err)
+				std::this_thread::yield();
+		}
+		source->ReleaseBuffer(desc);
+		decoder->Flush();
+		fed = true;
+	});
+	const auto tick = std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(1.0 / fps));
+	std::vector<double> intervals, fetch_ms;
+	uint64_t late = 0;
+	//let the feeder get ahead, as a player buffering before it starts
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	auto begin = clock_type::now();
+	auto last = begin;
+	for (uint64_t n = 0;; ++n) {
+		auto due = begin + tick * n;
+		std::this_thread::sleep_until(due);
+		_buffer_desc frame{};
+		int err;
+		clock_type::duration in_fetch{};
+		while (true) {
+			auto call = clock_type::now();
+			err = decoder->FetchBuffer(frame);
+			in_fetch += clock_type::now() - call;
+			//a damaged packet, the next frame follows
+			if (err == E_DECODE_ERROR)
+				continue;
+			if (err != E_AGAIN)
+				break;
+			//decoding in FetchBuffer there is no end but the fed packets running out
+			if (!depth && fed)
+				break;
+			std::this_thread::yield();
+		}
+		if (err)
+			break;
+		auto now = clock_type::now();
+		if (n)
+			intervals.push_back(ms(now - last));
+		fetch_ms.push_back(ms(in_fetch));
+		if (now - due > tick / 2)
+			++late;
+		last = now;
+		decoder->ReleaseBuffer(frame);
+	}
+	feeder.join();
+	delete decoder;
+	delete source;
+	if (intervals.empty()) {
+		printf("nothing decoded\n");
+		return;
+	}
+	double period = ms(tick), sum = 0, deviation = 0;
+	for (double interval : intervals) {
+		sum += interval;
+		deviation += (interval - period) * (interval - period);
+	}
+	std::sort(intervals.begin(), intervals.end());
+	std::sort(fetch_ms.begin(), fetch_ms.end());
+	char name[32];
+	if (depth)
+		snprintf(name, sizeof(name), "decode ahead %u", depth);
+	else
+		snprintf(name, sizeof(name), "decode in fetch");
+	printf("%-16s %6zu frames, interval mean %6.2f ms, jitter %6.2f ms, p99 %6.2f ms, max %6.2f ms | fetch p50 %6.3f ms, max %6.2f ms | %llu late\n",
+		name, fetch_ms.size(), sum / intervals.size(), sqrt(deviation / intervals.size()), intervals[intervals.size() * 99 / 100],
+		intervals.back(), fetch_ms[fetch_ms.size() / 2], fetch_ms.back(), (unsigned long long)late);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		printf("usage: %s in.webm [fps] [decoder threads]\n", argv[0]);
+		return 1;
+	}
+	double fps = argc > 2 ? atof(argv[2]) : 60;
+	uint32_t threads = argc > 3 ? (uint32_t)atoi(argv[3]) : 1;
+	run(argv[1], fps, threads, 0);
+	run(argv[1], fps, threads, 2);
+	run(argv[1], fps, threads, 4);
+	run(argv[1], fps, threads, 8);
+	return 0;
+}
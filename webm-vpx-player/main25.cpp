@@ -0,0 +1,149 @@
+//allocations of VP9 decoding in steady state: decodes a file with a
+//render queue holding the last few frames, as a presenter that keeps
+//frames queued for vsync does. With the decoder's internal buffers the
+//queue has to copy every frame; with refed frames it keeps refs on the
+//pool's buffers. After a warm up, counts the frame pool's and the
+//packet pool's system allocations and every operator new of the
+//process, which should all stay at 0.
+//(libvpx's own mallocs are not counted; with refed frames its frame
+//buffers are the pool's.)
+//	main25 in.webm [queued frames] [decoder threads]
+#include "mkv_source.h"
+#include "media_transform.h"
+#include "packet_pool.h"
+#include "frame_pool.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <vector>
+
+static std::atomic<uint64_t> news{0};
+
+void* operator new(size_t size)
+{
+	news.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+//a queued frame, the copy with internal buffers
+struct queued_frame {
+	_buffer_desc desc{};
+	std::vector<uint8_t> copy;
+};
+
+static void copy_frame(queued_frame& to, const _buffer_desc& frame)
+{
+	const _buffer_desc::buffer_detail::image_frame& image = frame.detail.image;
+	size_t sizes[3];
+	size_t total = 0;
+	for (int i = 0; i < 3; ++i) {
+		int rows = i ? (image.height + 1) / 2 : image.height;
+		sizes[i] = (size_t)image.line_size[i] * rows;
+		total += sizes[i];
+	}
+	if (to.copy.size() < total)
+		to.copy.resize(total);
+	uint8_t* out = to.copy.data();
+	for (int i = 0; i < 3; ++i) {
+		memcpy(out, image.planes[i], sizes[i]);
+		out += sizes[i];
+	}
+}
+
+static void run(const char* name, const char* path, size_t queued, uint32_t threads, bool refed, bool huge)
+{
+	mkv_source* source = mkv_source_factory::CreateFromFile(path);
+	if (!source) {
+		printf("Cannot open %s\n", path);
+		return;
+	}
+	stream_desc* outputs;
+	size_t count;
+	source->GetOutputs(outputs, count);
+	video_decoder* decoder = nullptr;
+	for (size_t i = 0; i < count && !decoder; ++i) {
+		if (outputs[i].type == stream_desc::MTYPE_VIDEO && outputs[i].detail.video.codec == stream_desc::video_info::VCODEC_VP9)
+			decoder = video_decoder_factory::CreateDefaultVP9Decoder(&outputs[i], threads, false, 0, refed, huge);
+	}
+	if (!decoder) {
+		printf("No VP9 track in %s\n", path);
+		delete source;
+		return;
+	}
+	const uint64_t warm_up = 60;
+	std::vector<queued_frame> queue(queued);
+	uint64_t frames = 0, copied = 0, steady_news = 0;
+	packet_pool::stats_t packets_before{};
+	frame_pool::stats_t frames_before{};
+	const frame_pool* pool = decoder->GetFramePool();
+	auto begin = std::chrono::steady_clock::now();
+	//demux and decode in lockstep on this thread
+	_buffer_desc packet{};
+	while (!source->FetchBuffer(packet)) {
+		queued_frame& slot = queue[frames % queued];
+		if (slot.desc.release)
+			decoder->ReleaseBuffer(slot.desc);
+		if (decoder->FetchBuffer(slot.desc))
+			continue;
+		if (!slot.desc.release) {
+			copy_frame(slot, slot.desc);
+			copied += slot.copy.size();
+		}
+		if (++frames == warm_up) {
+			steady_news = news;
+			packets_before = packet_pool::stats();
+			if (pool)
+				frames_before = pool->stats();
+		}
+	}
+	source->ReleaseBuffer(packet);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	steady_news = frames > warm_up ? news - steady_news : 0;
+	packet_pool::stats_t packets_after = packet_pool::stats();
+	frame_pool::stats_t frames_after{};
+	if (pool)
+		frames_after = pool->stats();
+	for (queued_frame& slot : queue) {
+		if (slot.desc.release)
+			decoder->ReleaseBuffer(slot.desc);
+	}
+	delete decoder;
+	delete source;
+	printf("%-18s %6llu frames, %7.1f fps, %8.1f MB copied | after %llu frames: %llu operator new, %llu packet pool mallocs",
+		name, (unsigned long long)frames, frames / seconds, copied / (1024.0 * 1024.0), (unsigned long long)warm_up,
+		(unsigned long long)steady_news, (unsigned long long)(packets_after.system_allocs - packets_before.system_allocs));
+	if (pool)
+		printf(", %llu frame pool allocs (%llu buffers, %.1f MB, %llu huge)", (unsigned long long)(frames_after.allocs - frames_before.allocs),
+			(unsigned long long)frames_after.allocs, frames_after.bytes / (1024.0 * 1024.0), (unsigned long long)frames_after.huge_allocs);
+	printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		printf("usage: %s in.webm [queued frames] [decoder threads]\n", argv[0]);
+		return 1;
+	}
+	size_t queued = argc > 2 ? (size_t)atoi(argv[2]) : 4;
+	uint32_t threads = argc > 3 ? (uint32_t)atoi(argv[3]) : 1;
+	if (!queued)
+		queued = 1;
+	run("internal, copied", argv[1], queued, threads, false, false);
+	run("refed frames", argv[1], queued, threads, true, false);
+	run("refed, huge pages", argv[1], queued, threads, true, true);
+	return 0;
+}
@@ -0,0 +1,168 @@
+//VP9 decoder settings sweep: encodes a synthetic clip (moving
+//gradients over block noise) at 720p, 1080p and 4K with libvpx's
+//encoder, with as many tile columns as the resolution allows or the
+//number given, then decodes each clip from memory with a set of
+//vp9_options and reports the frames per second of each, to pick the
+//settings for a machine.
+//	main26 [frames] [log2 tile columns, -1 for the most] [max threads]
+#include "media_transform.h"
+
+#include <vpx/vpx_encoder.h>
+#include <vpx/vp8cx.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+
+struct encoded_clip {
+	unsigned width, height;
+	std::vector<std::vector<uint8_t>> packets;
+	size_t bytes = 0;
+};
+
+static uint32_t noise(uint32_t x, uint32_t y, uint32_t t)
+{
+	uint32_t h = x * 73856093u ^ y * 19349663u ^ t * 83492791u;
+	h ^= h >> 13;
+	h *= 0x5bd1e995u;
+	return h ^ (h >> 15);
+}
+
+static void draw(vpx_image_t* img, uint32_t t)
+{
+	for (unsigned y = 0; y < img->d_h; ++y) {
+		uint8_t* row = img->planes[0] + (size_t)y * img->stride[0];
+		for (unsigned x = 0; x < img->d_w; ++x)
+			row[x] = (uint8_t)(x + 2 * y + 3 * t + (noise(x >> 4, y >> 4, t / 30) & 31));
+	}
+	for (int plane = 1; plane < 3; ++plane) {
+		for (unsigned y = 0; y < (img->d_h + 1) / 2; ++y) {
+			uint8_t* row = img->planes[plane] + (size_t)y * img->stride[plane];
+			for (unsigned x = 0; x < (img->d_w + 1) / 2; ++x)
+				row[x] = (uint8_t)(128 + (plane == 1 ? x - t : y + t) / 4);
+		}
+	}
+}
+
+static bool encode(encoded_clip& clip, unsigned width, unsigned height, int frames, int log2_tile_cols)
+{
+	vpx_codec_iface_t* iface = vpx_codec_vp9_cx();
+	vpx_codec_enc_cfg_t cfg;
+	if (vpx_codec_enc_config_default(iface, &cfg, 0))
+		return false;
+	cfg.g_w = width;
+	cfg.g_h = height;
+	cfg.g_timebase.num = 1;
+	cfg.g_timebase.den = 30;
+	cfg.g_threads = std::thread::hardware_concurrency();
+	cfg.g_lag_in_frames = 0;
+	cfg.rc_end_usage = VPX_CBR;
+	cfg.rc_target_bitrate = width * height / 200;
+	cfg.kf_max_dist = 60;
+	vpx_codec_ctx_t ctx;
+	if (vpx_codec_enc_init(&ctx, iface, &cfg, 0))
+		return false;
+	vpx_codec_control(&ctx, VP8E_SET_CPUUSED, 8);
+	//clamped to what the width allows
+	vpx_codec_control(&ctx, VP9E_SET_TILE_COLUMNS, log2_tile_cols < 0 ? 6 : log2_tile_cols);
+	vpx_codec_control(&ctx, VP9E_SET_ROW_MT, 1);
+	vpx_image_t* img = vpx_img_alloc(nullptr, VPX_IMG_FMT_I420, width, height, 32);
+	clip.width = width;
+	clip.height = height;
+	for (int i = 0; i <= frames; ++i) {
+		//the last round flushes
+		if (i < frames)
+			draw(img, i);
+		if (vpx_codec_encode(&ctx, i < frames ? img : nullptr, i, 1, 0, VPX_DL_REALTIME))
+			break;
+		vpx_codec_iter_t iter = nullptr;
+		while (const vpx_codec_cx_pkt_t* pkt = vpx_codec_get_cx_data(&ctx, &iter)) {
+			if (pkt->kind != VPX_CODEC_CX_FRAME_PKT)
+				continue;
+			const uint8_t* data = (const uint8_t*)pkt->data.frame.buf;
+			clip.packets.emplace_back(data, data + pkt->data.frame.sz);
+			clip.bytes += pkt->data.frame.sz;
+		}
+	}
+	vpx_img_free(img);
+	vpx_codec_destroy(&ctx);
+	return !clip.packets.empty();
+}
+
+//frames per second decoding the whole clip, 0 on failure
+static double decode(const encoded_clip& clip, const video_decoder_factory::vp9_options& options)
+{
+	stream_desc upstream{};
+	upstream.type = stream_desc::MTYPE_VIDEO;
+	upstream.detail.video.codec = stream_desc::video_info::VCODEC_VP9;
+	upstream.detail.video.width = clip.width;
+	upstream.detail.video.height = clip.height;
+	upstream.time_base = { 1, 30 };
+	video_decoder* decoder = video_decoder_factory::CreateVP9Decoder(&upstream, options);
+	auto begin = std::chrono::steady_clock::now();
+	size_t frames = 0;
+	for (size_t i = 0; i < clip.packets.size(); ++i) {
+		//owned by the clip, no release
+		_buffer_desc packet{};
+		packet.detail.pkt.data = (uint8_t*)clip.packets[i].data();
+		packet.detail.pkt.size = (uint32_t)clip.packets[i].size();
+		packet.start_timestamp = i;
+		decoder->QueueBuffer(packet);
+		_buffer_desc frame{};
+		if (!decoder->FetchBuffer(frame)) {
+			++frames;
+			decoder->ReleaseBuffer(frame);
+		}
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	delete decoder;
+	return frames == clip.packets.size() ? frames / seconds : 0;
+}
+
+int main(int argc, char** argv)
+{
+	int frames = argc > 1 ? atoi(argv[1]) : 120;
+	int log2_tile_cols = argc > 2 ? atoi(argv[2]) : -1;
+	uint32_t cores = std::thread::hardware_concurrency();
+	uint32_t max_threads = argc > 3 ? (uint32_t)atoi(argv[3]) : (cores ? cores : 1);
+	const struct {
+		const char* name;
+		unsigned width, height;
+	} sizes[] = { { "720p", 1280, 720 }, { "1080p", 1920, 1080 }, { "4K", 3840, 2160 } };
+	for (const auto& size : sizes) {
+		encoded_clip clip;
+		if (!encode(clip, size.width, size.height, frames, log2_tile_cols)) {
+			printf("%s: cannot encode\n", size.name);
+			continue;
+		}
+		printf("%s: %zu frames, %.1f KB/frame\n", size.name, clip.packets.size(), clip.bytes / 1024.0 / clip.packets.size());
+		video_decoder_factory::vp9_options options;
+		std::vector<std::pair<std::string, video_decoder_factory::vp9_options>> configs;
+		for (uint32_t threads = 1; threads <= max_threads; threads *= 2) {
+			options = video_decoder_factory::vp9_options();
+			options.threads = threads;
+			configs.emplace_back("threads " + std::to_string(threads), options);
+			if (threads > 1) {
+				options.row_mt = true;
+				configs.emplace_back("threads " + std::to_string(threads) + " row-mt", options);
+				options.loop_filter_opt = true;
+				configs.emplace_back("threads " + std::to_string(threads) + " row-mt lf-opt", options);
+			}
+		}
+		options = video_decoder_factory::vp9_options();
+		options.threads = max_threads;
+		options.row_mt = max_threads > 1;
+		options.skip_loop_filter = true;
+		configs.emplace_back("threads " + std::to_string(max_threads) + " skip loop filter", options);
+		options = video_decoder_factory::vp9_options();
+		options.auto_threads = true;
+		configs.emplace_back("auto", options);
+		for (const auto& config : configs)
+			printf("  %-32s %8.1f fps\n", config.first.c_str(), decode(clip, config.second));
+	}
+	return 0;
+}
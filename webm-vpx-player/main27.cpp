@@ -0,0 +1,124 @@
+//throughput of offline VP9 decoding: decodes a file as fast as it
+//goes with a single decoder (one thread, then tile/row threads on
+//every core) and with the key frame segment parallel decoder for 1, 2,
+//4... workers up to the cores or the number given, and reports the
+//frames per second of each. The parallel runs check that the frames
+//come out in order. Scales with the number of key frames, a file with
+//a single one decodes on one worker.
+//	main27 in.webm [max workers] [max buffered MB]
+#include "mkv_source.h"
+#include "media_transform.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <string>
+
+static video_decoder* create(mkv_source* source, bool parallel, const video_decoder_factory::gop_options& options)
+{
+	stream_desc* outputs;
+	size_t count;
+	source->GetOutputs(outputs, count);
+	for (size_t i = 0; i < count; ++i) {
+		if (outputs[i].type == stream_desc::MTYPE_VIDEO && outputs[i].detail.video.codec == stream_desc::video_info::VCODEC_VP9) {
+			return parallel ? video_decoder_factory::CreateParallelVP9Decoder(&outputs[i], options) :
+				video_decoder_factory::CreateVP9Decoder(&outputs[i], options.decoder);
+		}
+	}
+	return nullptr;
+}
+
+static void run(const std::string& name, const char* path, bool parallel, const video_decoder_factory::gop_options& options)
+{
+	mkv_source* source = mkv_source_factory::CreateFromFile(path);
+	if (!source) {
+		printf("Cannot open %s\n", path);
+		return;
+	}
+	video_decoder* decoder = create(source, parallel, options);
+	if (!decoder) {
+		printf("No VP9 track in %s\n", path);
+		delete source;
+		return;
+	}
+	uint64_t frames = 0, out_of_order = 0, last = 0;
+	auto begin = std::chrono::steady_clock::now();
+	_buffer_desc frame{};
+	if (!parallel) {
+		//demux and decode in lockstep on this thread
+		_buffer_desc packet{};
+		while (!source->FetchBuffer(packet)) {
+			if (!decoder->FetchBuffer(frame)) {
+				++frames;
+				decoder->ReleaseBuffer(frame);
+			}
+		}
+		source->ReleaseBuffer(packet);
+	}
+	else {
+		//the other tracks stay unconnected and are skipped
+		std::thread feeder([&] {
+			_buffer_desc packet{};
+			int err;
+			//E_AGAIN while the decoder's queue is full
+			while (!(err = source->FetchBuffer(packet)) || err == E_AGAIN) {
+				if (err)
+					std::this_thread::yield();
+			}
+			source->ReleaseBuffer(packet);
+			decoder->Flush();
+		});
+		while (true) {
+			int err = decoder->FetchBuffer(frame);
+			if (err == E_EOF)
+				break;
+			//a damaged packet, the next frame follows
+			if (err == E_DECODE_ERROR)
+				continue;
+			if (err) {
+				//the segment is still being queued
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				continue;
+			}
+			if (frames && frame.start_timestamp < last)
+				++out_of_order;
+			last = frame.start_timestamp;
+			++frames;
+			decoder->ReleaseBuffer(frame);
+		}
+		feeder.join();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	delete decoder;
+	delete source;
+	printf("%-26s %6llu frames, %8.1f fps", name.c_str(), (unsigned long long)frames, frames / seconds);
+	if (out_of_order)
+		printf(", %llu out of order", (unsigned long long)out_of_order);
+	printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		printf("usage: %s in.webm [max workers] [max buffered MB]\n", argv[0]);
+		return 1;
+	}
+	uint32_t cores = std::thread::hardware_concurrency();
+	if (!cores)
+		cores = 1;
+	uint32_t max_workers = argc > 2 ? (uint32_t)atoi(argv[2]) : cores;
+	video_decoder_factory::gop_options options;
+	if (argc > 3)
+		options.max_buffered = (size_t)atoi(argv[3]) * 1024 * 1024;
+	run("single, 1 thread", argv[1], false, options);
+	options.decoder.threads = cores;
+	options.decoder.row_mt = cores > 1;
+	run("single, " + std::to_string(cores) + " threads row-mt", argv[1], false, options);
+	options.decoder = video_decoder_factory::vp9_options();
+	for (uint32_t workers = 1; workers <= max_workers; workers *= 2) {
+		options.workers = workers;
+		run("segments, " + std::to_string(workers) + " workers", argv[1], true, options);
+	}
+	return 0;
+}
@@ -0,0 +1,211 @@
+//late frame skipping against decode-and-drop: encodes a synthetic
+//clip with libvpx in three temporal layers (0212, error resilient, as
+//real time SVC streams are), so every other frame is referenced by
+//none, then plays it on a presenter clock running faster than one
+//decoder thread keeps up with, as on a weak CPU. Decode-and-drop
+//fetches every frame with FetchBuffer and drops the late ones,
+//skipping fetches with FetchBufferBefore the presenter's time. Reports
+//the time spent decoding (one thread, so the CPU it took), the frames
+//decoded, skipped undecoded, dropped late and shown.
+//	main28 [frames] [width] [height] [clock speed over decoding]
+#include "media_transform.h"
+#include "vp9_header.h"
+
+#include <vpx/vpx_encoder.h>
+#include <vpx/vp8cx.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock clock_type;
+
+struct encoded_clip {
+	unsigned width, height;
+	std::vector<std::vector<uint8_t>> packets;
+};
+
+static void draw(vpx_image_t* img, uint32_t t)
+{
+	for (unsigned y = 0; y < img->d_h; ++y) {
+		uint8_t* row = img->planes[0] + (size_t)y * img->stride[0];
+		for (unsigned x = 0; x < img->d_w; ++x)
+			row[x] = (uint8_t)(x + 2 * y + 3 * t + ((x ^ y) >> 4 & 15));
+	}
+	for (int plane = 1; plane < 3; ++plane) {
+		for (unsigned y = 0; y < (img->d_h + 1) / 2; ++y)
+			memset(img->planes[plane] + (size_t)y * img->stride[plane], 128 + (int)(t & 31), (img->d_w + 1) / 2);
+	}
+}
+
+static bool encode(encoded_clip& clip, unsigned width, unsigned height, int frames)
+{
+	vpx_codec_iface_t* iface = vpx_codec_vp9_cx();
+	vpx_codec_enc_cfg_t cfg;
+	if (vpx_codec_enc_config_default(iface, &cfg, 0))
+		return false;
+	cfg.g_w = width;
+	cfg.g_h = height;
+	cfg.g_timebase.num = 1;
+	cfg.g_timebase.den = 30;
+	cfg.g_threads = std::thread::hardware_concurrency();
+	cfg.g_lag_in_frames = 0;
+	cfg.g_error_resilient = VPX_ERROR_RESILIENT_DEFAULT;
+	cfg.rc_end_usage = VPX_CBR;
+	cfg.rc_target_bitrate = width * height / 200;
+	cfg.kf_max_dist = 300;
+	//layer 2 on odd frames, referenced by none
+	cfg.ss_number_layers = 1;
+	cfg.ts_number_layers = 3;
+	cfg.ts_periodicity = 4;
+	cfg.ts_layer_id[0] = 0;
+	cfg.ts_layer_id[1] = 2;
+	cfg.ts_layer_id[2] = 1;
+	cfg.ts_layer_id[3] = 2;
+	cfg.ts_rate_decimator[0] = 4;
+	cfg.ts_rate_decimator[1] = 2;
+	cfg.ts_rate_decimator[2] = 1;
+	cfg.ts_target_bitrate[0] = cfg.rc_target_bitrate * 6 / 10;
+	cfg.ts_target_bitrate[1] = cfg.rc_target_bitrate * 8 / 10;
+	cfg.ts_target_bitrate[2] = cfg.rc_target_bitrate;
+	cfg.layer_target_bitrate[0] = cfg.ts_target_bitrate[0];
+	cfg.layer_target_bitrate[1] = cfg.ts_target_bitrate[1];
+	cfg.layer_target_bitrate[2] = cfg.ts_target_bitrate[2];
+	cfg.temporal_layering_mode = VP9E_TEMPORAL_LAYERING_MODE_0212;
+	vpx_codec_ctx_t ctx;
+	if (vpx_codec_enc_init(&ctx, iface, &cfg, 0))
+		return false;
+	vpx_codec_control(&ctx, VP8E_SET_CPUUSED, 8);
+	vpx_codec_control(&ctx, VP9E_SET_SVC, 1);
+	vpx_image_t* img = vpx_img_alloc(nullptr, VPX_IMG_FMT_I420, width, height, 32);
+	clip.width = width;
+	clip.height = height;
+	for (int i = 0; i <= frames; ++i) {
+		if (i < frames)
+			draw(img, i);
+		if (vpx_codec_encode(&ctx, i < frames ? img : nullptr, i, 1, 0, VPX_DL_REALTIME))
+			break;
+		vpx_codec_iter_t iter = nullptr;
+		while (const vpx_codec_cx_pkt_t* pkt = vpx_codec_get_cx_data(&ctx, &iter)) {
+			if (pkt->kind != VPX_CODEC_CX_FRAME_PKT)
+				continue;
+			const uint8_t* data = (const uint8_t*)pkt->data.frame.buf;
+			clip.packets.emplace_back(data, data + pkt->data.frame.sz);
+		}
+	}
+	vpx_img_free(img);
+	vpx_codec_destroy(&ctx);
+	return !clip.packets.empty();
+}
+
+static video_decoder* create(const encoded_clip& clip, stream_desc& upstream)
+{
+	upstream.type = stream_desc::MTYPE_VIDEO;
+	upstream.detail.video.codec = stream_desc::video_info::VCODEC_VP9;
+	upstream.detail.video.width = clip.width;
+	upstream.detail.video.height = clip.height;
+	upstream.time_base = { 1, 30 };
+	return video_decoder_factory::CreateDefaultVP9Decoder(&upstream);
+}
+
+//owned by the clip, no release; timestamps are frame numbers
+static void queue(video_decoder* decoder, const encoded_clip& clip, size_t i)
+{
+	_buffer_desc packet{};
+	packet.detail.pkt.data = (uint8_t*)clip.packets[i].data();
+	packet.detail.pkt.size = (uint32_t)clip.packets[i].size();
+	packet.start_timestamp = i;
+	packet.end_timestamp = i + 1;
+	decoder->QueueBuffer(packet);
+}
+
+//frames per second of one decoder thread over the whole clip
+static double decode_fps(const encoded_clip& clip)
+{
+	stream_desc upstream{};
+	video_decoder* decoder = create(clip, upstream);
+	auto begin = clock_type::now();
+	for (size_t i = 0; i < clip.packets.size(); ++i) {
+		queue(decoder, clip, i);
+		_buffer_desc frame{};
+		if (!decoder->FetchBuffer(frame))
+			decoder->ReleaseBuffer(frame);
+	}
+	double seconds = std::chrono::duration<double>(clock_type::now() - begin).count();
+	delete decoder;
+	return clip.packets.size() / seconds;
+}
+
+static void play(const char* name, const encoded_clip& clip, double fps, bool skip)
+{
+	stream_desc upstream{};
+	video_decoder* decoder = create(clip, upstream);
+	//the demuxer keeps this many frames queued ahead of the clock
+	const size_t read_ahead = 8;
+	size_t queued = 0;
+	uint64_t decoded = 0, skipped = 0, dropped = 0, shown = 0;
+	clock_type::duration decoding{};
+	auto begin = clock_type::now();
+	while (true) {
+		double now = std::chrono::duration<double>(clock_type::now() - begin).count() * fps;
+		while (queued < clip.packets.size() && queued < now + read_ahead)
+			queue(decoder, clip, queued++);
+		_buffer_desc frame{};
+		auto fetch = clock_type::now();
+		int err = skip ? decoder->FetchBufferBefore(frame, (uint64_t)now) : decoder->FetchBuffer(frame);
+		decoding += clock_type::now() - fetch;
+		if (err == E_DECODE_ERROR)
+			continue;
+		if (err) {
+			if (queued == clip.packets.size())
+				break;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+		++decoded;
+		skipped += frame.detail.image.skipped;
+		now = std::chrono::duration<double>(clock_type::now() - begin).count() * fps;
+		if (frame.start_timestamp < (uint64_t)now) {
+			++dropped;
+		}
+		else {
+			++shown;
+			std::this_thread::sleep_until(begin + std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(frame.start_timestamp / fps)));
+		}
+		decoder->ReleaseBuffer(frame);
+	}
+	double seconds = std::chrono::duration<double>(clock_type::now() - begin).count();
+	delete decoder;
+	printf("%-16s decoding %6.2f s of %6.2f s, %5llu decoded, %5llu skipped, %5llu dropped, %5llu shown\n", name,
+		std::chrono::duration<double>(decoding).count(), seconds, (unsigned long long)decoded, (unsigned long long)skipped,
+		(unsigned long long)dropped, (unsigned long long)shown);
+}
+
+int main(int argc, char** argv)
+{
+	int frames = argc > 1 ? atoi(argv[1]) : 600;
+	unsigned width = argc > 2 ? (unsigned)atoi(argv[2]) : 1920;
+	unsigned height = argc > 3 ? (unsigned)atoi(argv[3]) : 1080;
+	double speed = argc > 4 ? atof(argv[4]) : 1.5;
+	encoded_clip clip;
+	if (!encode(clip, width, height, frames)) {
+		printf("cannot encode\n");
+		return 1;
+	}
+	size_t skippable = 0;
+	for (size_t i = 0; i + 1 < clip.packets.size(); ++i) {
+		const std::vector<uint8_t>& packet = clip.packets[i];
+		const std::vector<uint8_t>& next = clip.packets[i + 1];
+		if (vp9_packet_skippable(packet.data(), packet.size(), next.data(), next.size()))
+			++skippable;
+	}
+	double fps = decode_fps(clip);
+	printf("%ux%u: %zu frames, %zu skippable, one thread decodes %.1f fps, playing at %.1f fps\n", width, height,
+		clip.packets.size(), skippable, fps, fps * speed);
+	play("decode and drop", clip, fps * speed, false);
+	play("skip late", clip, fps * speed, true);
+	return 0;
+}
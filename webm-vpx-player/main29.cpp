@@ -0,0 +1,355 @@
+//encoding checks of the live mkv_sink, which writes the Segment and
+//Clusters itself instead of through the muxer: the unknown sized
+//Segment and Clusters, Info without a Duration, cluster cuts at video
+//keyframes, after max_cluster_ms and where a block timecode would not
+//fit 16 bits, and the lace sizes of each lacing mode at the lengths
+//where their coding changes (EBML size differences around the one and
+//two byte ranges, Xiph sizes at multiples of 255). Walks the top level
+//of each file by hand, then demuxes it back through the native source
+//and checks every packet; segmented output is checked as the init
+//segment followed by the media segments. Returns nonzero on a failure.
+//	main29 [out.webm]
+#include "mkv_source.h"
+#include "mkv_sink.h"
+#include "packet_pool.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+//differences of +-63/64 and +-8191/8192 between neighbours, sizes
+//around multiples of 255, and runs of one size for fixed lacing
+static const uint32_t audio_sizes[] = { 100, 163, 227, 164, 100, 8291, 16483, 8292, 100, 255, 510, 765, 254, 256,
+	1, 1, 1, 1, 1, 160, 160, 160, 160, 160, 2, 65, 1 };
+static const size_t audio_size_count = sizeof(audio_sizes) / sizeof(audio_sizes[0]);
+//ns, all timestamps from gap_at on are late by gap: more than a block
+//timecode reaches at the default 1 ms scale
+static const uint64_t gap_at = 5000000000ull;
+static const uint64_t gap = 40000000000ull;
+static const uint64_t length = 10000000000ull;
+
+static uint64_t video_time(uint64_t i)
+{
+	uint64_t t = i * 1000000000 / 30;
+	return t >= gap_at ? t + gap : t;
+}
+
+static uint64_t audio_time(uint64_t i)
+{
+	uint64_t t = i * 20000000;
+	return t >= gap_at ? t + gap : t;
+}
+
+static uint32_t video_size(uint64_t i)
+{
+	return i % 60 ? 3000 : 20000;
+}
+
+static uint8_t fill(uint32_t track, uint64_t i)
+{
+	return (uint8_t)(i * 7 + track);
+}
+
+static void queue(mkv_sink* sink, uint32_t track, uint64_t start, uint64_t end, uint32_t size, bool key, uint8_t value)
+{
+	_buffer_desc packet{};
+	packet.detail.pkt.buffer = packet_pool::alloc_block(size);
+	packet.detail.pkt.data = packet.detail.pkt.buffer->buffer;
+	packet.detail.pkt.size = size;
+	memset(packet.detail.pkt.data, value, size);
+	packet.detail.pkt.track = track;
+	packet.detail.pkt.key_frame = key;
+	packet.start_timestamp = start;
+	packet.end_timestamp = end;
+	sink->QueueBuffer(packet);
+	packet.detail.pkt.buffer->unref();
+}
+
+static void feed(mkv_sink* sink, uint64_t& video, uint64_t& audio)
+{
+	video = audio = 0;
+	while (video * 1000000000 / 30 < length || audio * 20000000 < length) {
+		if (audio * 20000000 >= length || (video * 1000000000 / 30 < length && video_time(video) <= audio_time(audio))) {
+			queue(sink, 0, video_time(video), video_time(video), video_size(video), video % 60 == 0, fill(0, video));
+			++video;
+		}
+		else {
+			queue(sink, 1, audio_time(audio), audio_time(audio) + 20000000, audio_sizes[audio % audio_size_count], true, fill(1, audio));
+			++audio;
+		}
+	}
+}
+
+struct head {
+	uint32_t id;
+	uint64_t size;
+	size_t len;
+	bool unknown;
+};
+
+//element head at data[pos], false if it is not a whole one
+static bool read_head(const std::vector<uint8_t>& data, size_t pos, head& h)
+{
+	size_t lens[2];
+	uint64_t values[2];
+	for (int k = 0; k < 2; ++k) {
+		if (pos >= data.size() || !data[pos])
+			return false;
+		size_t len = 1;
+		while (!(data[pos] & (0x80 >> (len - 1))))
+			++len;
+		if (pos + len > data.size())
+			return false;
+		uint64_t value = k ? data[pos] & (0xFF >> len) : data[pos];
+		for (size_t i = 1; i < len; ++i)
+			value = (value << 8) | data[pos + i];
+		lens[k] = len;
+		values[k] = value;
+		pos += len;
+	}
+	h.id = (uint32_t)values[0];
+	h.size = values[1];
+	h.len = lens[0] + lens[1];
+	h.unknown = values[1] == (1ull << (7 * lens[1])) - 1;
+	return true;
+}
+
+static int failures = 0;
+
+static void fail(const char* name, const char* what)
+{
+	printf("%s: %s\n", name, what);
+	++failures;
+}
+
+//the top level: the EBML header, a Segment of unknown size with Info
+//(no Duration), Tracks and unknown sized Clusters, each opening with
+//its Timecode, nothing for seeking
+static void check_layout(const char* name, const std::vector<uint8_t>& data, size_t& clusters)
+{
+	const uint8_t unknown8[] = { 0x01, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+	clusters = 0;
+	head h;
+	if (!read_head(data, 0, h) || h.id != 0x1A45DFA3 || h.unknown)
+		return fail(name, "no EBML header");
+	size_t pos = h.len + (size_t)h.size;
+	if (!read_head(data, pos, h) || h.id != 0x18538067 || !h.unknown || memcmp(&data[pos + 4], unknown8, 8))
+		return fail(name, "the Segment is not of 8 byte unknown size");
+	pos += h.len;
+	bool info = false, tracks = false;
+	while (pos < data.size()) {
+		if (!read_head(data, pos, h))
+			return fail(name, "broken element");
+		if (h.id == 0x1F43B675) {
+			if (!h.unknown || memcmp(&data[pos + 4], unknown8, 8))
+				return fail(name, "a Cluster is not of 8 byte unknown size");
+			head first;
+			if (!read_head(data, pos + h.len, first) || first.id != 0xE7)
+				return fail(name, "a Cluster does not open with its Timecode");
+			++clusters;
+			//its children, up to the next Cluster
+			pos += h.len;
+			while (pos < data.size() && read_head(data, pos, h) && h.id != 0x1F43B675) {
+				if (h.unknown || h.size > data.size() - pos - h.len)
+					return fail(name, "broken Cluster child");
+				pos += h.len + (size_t)h.size;
+			}
+			continue;
+		}
+		if (h.unknown || h.size > data.size() - pos - h.len)
+			return fail(name, "broken top level element");
+		if (clusters)
+			return fail(name, "a top level element after the Clusters");
+		if (h.id == 0x1549A966) {
+			info = true;
+			for (size_t at = pos + h.len; at < pos + h.len + h.size;) {
+				head child;
+				if (!read_head(data, at, child))
+					break;
+				if (child.id == 0x4489)
+					fail(name, "Info has a Duration");
+				at += child.len + (size_t)child.size;
+			}
+		}
+		else if (h.id == 0x1654AE6B) {
+			tracks = true;
+		}
+		else if (h.id == 0x114D9B74 || h.id == 0x1C53BB6B) {
+			fail(name, "a SeekHead or Cues in live output");
+		}
+		pos += h.len + (size_t)h.size;
+	}
+	if (!info || !tracks)
+		fail(name, "no Info or Tracks");
+	if (!clusters)
+		fail(name, "no Cluster");
+}
+
+//every packet back, in order, with its size, bytes and timestamp
+static void check_packets(const char* name, const char* path, uint64_t video, uint64_t audio)
+{
+	mkv_source* source = mkv_source_factory::CreateFromFileNative(path);
+	if (!source)
+		return fail(name, "does not open");
+	uint64_t read[2] = { 0, 0 }, bad = 0;
+	_buffer_desc desc{};
+	while (!source->FetchBuffer(desc)) {
+		uint32_t track = desc.detail.pkt.track;
+		if (track > 1) {
+			++bad;
+			continue;
+		}
+		uint64_t index = read[track]++;
+		uint32_t size = track ? audio_sizes[index % audio_size_count] : video_size(index);
+		uint64_t time = track ? audio_time(index) : video_time(index);
+		const uint8_t* data = (const uint8_t*)desc.detail.pkt.data;
+		if (desc.detail.pkt.size != size || data[0] != fill(track, index) || data[size - 1] != fill(track, index) ||
+			desc.start_timestamp / 1000000 != time / 1000000 || desc.detail.pkt.key_frame != (track || index % 60 == 0))
+			++bad;
+	}
+	source->ReleaseBuffer(desc);
+	delete source;
+	if (read[0] != video || read[1] != audio || bad) {
+		char what[128];
+		snprintf(what, sizeof(what), "read %llu/%llu video, %llu/%llu audio, %llu bad", (unsigned long long)read[0],
+			(unsigned long long)video, (unsigned long long)read[1], (unsigned long long)audio, (unsigned long long)bad);
+		fail(name, what);
+	}
+}
+
+static bool load(const char* path, std::vector<uint8_t>& data)
+{
+	FILE* in = fopen(path, "rb");
+	if (!in)
+		return false;
+	uint8_t chunk[65536];
+	size_t got;
+	while ((got = fread(chunk, 1, sizeof(chunk), in)) > 0)
+		data.insert(data.end(), chunk, chunk + got);
+	fclose(in);
+	return true;
+}
+
+static void make_tracks(stream_desc* tracks)
+{
+	tracks[0].type = stream_desc::MTYPE_VIDEO;
+	tracks[0].detail.video.codec = stream_desc::video_info::VCODEC_VP9;
+	tracks[0].detail.video.width = 640;
+	tracks[0].detail.video.height = 360;
+	tracks[1].type = stream_desc::MTYPE_AUDIO;
+	tracks[1].detail.audio.codec = stream_desc::audio_info::ACODEC_OPUS;
+	tracks[1].detail.audio.Hz = 48000;
+	tracks[1].detail.audio.layout.channel_count = 2;
+}
+
+static void run(const char* name, const mkv_sink::live_options& options, const char* path)
+{
+	stream_desc tracks[2]{};
+	make_tracks(tracks);
+	FILE* out = fopen(path, "wb");
+	if (!out)
+		return fail(name, "cannot open the output");
+	mkv_sink* sink = mkv_sink_factory::CreateLive(tracks, 2, out, options);
+	if (!sink) {
+		fclose(out);
+		return fail(name, "cannot start live output");
+	}
+	uint64_t video, audio;
+	feed(sink, video, audio);
+	if (sink->Flush())
+		fail(name, "Flush failed");
+	mkv_sink::output_stats stats = *sink->GetOutputStats();
+	delete sink;
+	fclose(out);
+	std::vector<uint8_t> data;
+	size_t clusters = 0;
+	if (!load(path, data))
+		return fail(name, "cannot read the output back");
+	check_layout(name, data, clusters);
+	check_packets(name, path, video, audio);
+	printf("%-20s %5llu frames in %5llu blocks, %3zu clusters\n", name, (unsigned long long)stats.frames,
+		(unsigned long long)stats.blocks, clusters);
+}
+
+//the init segment and the media segments joined are a live file
+static void run_segmented(const char* name, const mkv_sink::live_options& options, const std::string& path)
+{
+	stream_desc tracks[2]{};
+	make_tracks(tracks);
+	std::string init = path + ".init";
+	std::string pattern = path + ".%03u";
+	mkv_sink* sink = mkv_sink_factory::CreateSegmented(tracks, 2, init.c_str(), pattern.c_str(), options);
+	if (!sink)
+		return fail(name, "cannot write the init segment");
+	uint64_t video, audio;
+	feed(sink, video, audio);
+	if (sink->Flush())
+		fail(name, "Flush failed");
+	delete sink;
+	std::vector<uint8_t> data;
+	if (!load(init.c_str(), data))
+		return fail(name, "no init segment");
+	unsigned segments = 0;
+	while (true) {
+		char segment[1024];
+		snprintf(segment, sizeof(segment), pattern.c_str(), segments);
+		size_t before = data.size();
+		if (!load(segment, data))
+			break;
+		//a media segment starts with a Cluster
+		if (data.size() - before < 4 || data[before] != 0x1F || data[before + 1] != 0x43 ||
+			data[before + 2] != 0xB6 || data[before + 3] != 0x75)
+			fail(name, "a media segment does not start with a Cluster");
+		remove(segment);
+		++segments;
+	}
+	remove(init.c_str());
+	FILE* out = fopen(path.c_str(), "wb");
+	if (!out || fwrite(data.data(), 1, data.size(), out) != data.size()) {
+		if (out)
+			fclose(out);
+		return fail(name, "cannot join the segments");
+	}
+	fclose(out);
+	size_t clusters = 0;
+	check_layout(name, data, clusters);
+	check_packets(name, path.c_str(), video, audio);
+	printf("%-20s %5u segments, %3zu clusters\n", name, segments, clusters);
+}
+
+int main(int argc, char** argv)
+{
+	std::string path = argc > 1 ? argv[1] : "live_check.webm";
+	typedef mkv_sink::live_options options;
+	const struct {
+		const char* name;
+		options::lacing_mode mode;
+	} modes[] = {
+		{ "none", options::LACING_NONE },
+		{ "xiph", options::LACING_XIPH },
+		{ "ebml", options::LACING_EBML },
+		{ "fixed", options::LACING_FIXED },
+		{ "auto", options::LACING_AUTO }
+	};
+	for (const auto& mode : modes) {
+		for (unsigned max_cluster_ms : { 1000u, 60000u }) {
+			options opts;
+			opts.lacing = mode.mode;
+			//long enough that only keyframes and the gap cut clusters
+			opts.max_cluster_ms = max_cluster_ms;
+			std::string name = std::string(mode.name) + (max_cluster_ms > 1000 ? " long clusters" : "");
+			run(name.c_str(), opts, path.c_str());
+		}
+	}
+	options opts;
+	opts.lacing = options::LACING_AUTO;
+	opts.segment_ms = 2000;
+	run_segmented("segmented", opts, path);
+	if (failures)
+		printf("%d failures\n", failures);
+	else
+		printf("all passed\n");
+	return failures ? 1 : 0;
+}
@@ -6,11 +6,20 @@
 #include <atomic>
 struct refed_buffer_block {
 	std::atomic<size_t> refs = 0;
+	//called instead of free() on the last unref, for blocks
+	//that own something other than their trailing buffer
+	//(e.g. a whole mapped file shared by many packets)
+	void (*dispose)(refed_buffer_block* _this) = nullptr;
 	uint8_t buffer[];
 	void unref()
 	{
-		if (1 == refs.fetch_sub(1, std::memory_order_acquire)) {
-			free(this);
+		//a sole owner cannot race with anyone, skip the atomic rmw
+		if (refs.load(std::memory_order_acquire) == 1 ||
+			1 == refs.fetch_sub(1, std::memory_order_acq_rel)) {
+			if (dispose)
+				dispose(this);
+			else
+				free(this);
 			std::atomic_thread_fence(std::memory_order_release);
 		}
 	}
@@ -186,10 +195,16 @@ struct _buffer_desc {
 	uint64_t end_timestamp = 0;
 	union buffer_detail {
 		struct packet {
+			//owner of the payload, unref'd by release
 			refed_buffer_block* buffer;
+			//the payload itself, not necessarily buffer->buffer
+			uint8_t* data;
 			uint32_t size;
 			uint32_t track;
 			bool key_frame;
+			//first packet of the track after a seek,
+			//state carried over from earlier packets is stale
+			bool discontinuity;
 		} pkt;
 		struct image_frame {
 			bool planar;
@@ -199,6 +214,8 @@ struct _buffer_desc {
 			int crop_left, crop_right, crop_top, crop_bottom;
 			color_space space;
 			color_range range;
+			//frames of the stream left undecoded right before this one
+			uint32_t skipped = 0;
 		} image;
 		struct audio_frame {
 			void* channels[max_channels]{};
@@ -207,9 +224,7 @@ struct _buffer_desc {
 		} aframe;
 		buffer_detail(const audio_frame& frame):aframe(frame){};
 		buffer_detail(const image_frame& img):image(img){};
-		buffer_detail(const packet& p):pkt(p){
-			printf("copied");
-		};
+		buffer_detail(const packet& p):pkt(p){};
 		buffer_detail(const buffer_detail& d) {
 			memcpy(this,&d,sizeof(d));
 		};
@@ -258,6 +273,32 @@ public:
 	virtual int Flush() = 0;
 	virtual int GetInputs(stream_desc *& desc, size_t& num) = 0;
 	virtual int GetOutputs(stream_desc *& desc, size_t& num) = 0;
+	//Batched FetchBuffer/QueueBuffer, one virtual call for many
+	//buffers. done is how many were moved; an error after the first
+	//buffer ends the batch early and is returned by the next call.
+	//Defaults loop over the single buffer versions.
+	virtual int FetchBuffers(_buffer_desc* buffers, size_t max, size_t& done)
+	{
+		done = 0;
+		while (done < max) {
+			int err = FetchBuffer(buffers[done]);
+			if (err)
+				return done ? S_OK : err;
+			++done;
+		}
+		return S_OK;
+	}
+	virtual int QueueBuffers(_buffer_desc* buffers, size_t count, size_t& done)
+	{
+		done = 0;
+		while (done < count) {
+			int err = QueueBuffer(buffers[done]);
+			if (err)
+				return done ? S_OK : err;
+			++done;
+		}
+		return S_OK;
+	}
 	//for building topology
 //	virtual int AddUpstream() = 0;
 //	virtual int AddDownstream() = 0;
@@ -10,6 +10,11 @@ public:
 	{
 		return E_INVALID_OPERATION;
 	};
+	virtual int FetchBuffers(_buffer_desc* buffers, size_t max, size_t& done) override final
+	{
+		done = 0;
+		return E_INVALID_OPERATION;
+	}
 	virtual int ReleaseBuffer(_buffer_desc& buffer) override final
 	{
 		return E_INVALID_OPERATION;
@@ -9,6 +9,10 @@ public:
 	virtual int QueueBuffer(_buffer_desc& buffer) override final {
 		return E_INVALID_OPERATION;
 	};
+	virtual int QueueBuffers(_buffer_desc* buffers, size_t count, size_t& done) override final {
+		done = 0;
+		return E_INVALID_OPERATION;
+	}
 	virtual int AllocBuffer(_buffer_desc& buffer) override final {
 		return E_INVALID_OPERATION;
 	}
@@ -32,6 +32,7 @@ public:
 };
 
 class video_decoder_factory;
+class frame_pool;
 
 class video_decoder: public media_decoder {
 public:
@@ -42,18 +43,93 @@ friend video_decoder_factory;
 		VD_VP9_GLTEXTURE_DECODER,
 		VD_VP9_GLBUFFER_DECODER,
 		VD_D3D11_VP9_DECODER,
+		VD_VP9_GOP_PARALLEL_DECODER,
 		VD_LAST
 	};
 	const decoder_type vdecoder_type;
 	video_decoder(decoder_type type) : vdecoder_type(type){}
+	//the pool the frames are decoded into, for its counters;
+	//null if the decoder uses its own buffers
+	virtual const frame_pool* GetFramePool() const
+	{
+		return nullptr;
+	}
+	//FetchBuffer for a presenter falling behind: frames with a
+	//start_timestamp before deadline are late. Decoders that can tell
+	//leave the packets of late frames no other frame depends on
+	//undecoded, image.skipped of the frame fetched counts them; the
+	//late frames that still had to be decoded come out to be dropped.
+	virtual int FetchBufferBefore(_buffer_desc& buffer, uint64_t deadline)
+	{
+		int err = FetchBuffer(buffer);
+		if (!err)
+			buffer.detail.image.skipped = 0;
+		return err;
+	}
 	virtual ~video_decoder() {};
 };
 
 class video_decoder_factory {
 public:
+	//settings of the VP9 decoder
+	struct vp9_options {
+		//libvpx decodes each tile column on a thread, so threads past
+		//the stream's tile columns only help with row_mt
+		uint32_t threads = 1;
+		//row based multithreading, the rows of a tile column shared
+		//between threads
+		bool row_mt = false;
+		//with row_mt, filters rows as they are done, not after the frame
+		bool loop_filter_opt = false;
+		//no loop filter: faster, artifacts build up until the next key frame
+		bool skip_loop_filter = false;
+		//an SVC stream decoded up to this spatial layer (0 the base), -1 all
+		int svc_spatial_layer = -1;
+		//threads from the resolution and the cores, row_mt from the tile
+		//columns of the first key frame; threads and row_mt are ignored
+		bool auto_threads = false;
+		bool post_proc = false;
+		//as for CreateDefaultVP9Decoder
+		uint32_t decode_ahead = 0;
+		bool refed_frames = false;
+		bool huge_pages = false;
+	};
+	//settings of the key frame segment parallel decoder
+	struct gop_options {
+		//decoder instances, each on a thread of its own; 0 one per core
+		uint32_t workers = 0;
+		//bytes of decoded frames waiting for their turn to be fetched;
+		//segments past the one being fetched stop decoding above it
+		size_t max_buffered = 256 * 1024 * 1024;
+		//segments waiting for a worker before QueueBuffer waits, 0 two per worker
+		uint32_t max_queued_segments = 0;
+		//of every instance; refed_frames is always set and decode_ahead cleared
+		vp9_options decoder;
+	};
+	static video_decoder* CreateVP9Decoder(stream_desc* upstream, const vp9_options& options);
+	//creates a decoder for offline jobs that cuts the packets into
+	//segments at key frames and decodes the segments on as many VP9
+	//decoders at once, the frames fetched in order, each holding a ref
+	//until ReleaseBuffer.
+	//QueueBuffer waits while max_queued_segments segments wait for a
+	//worker, so packets are queued on a thread of their own (such as
+	//mkv_source's FetchBuffer pushing them) and frames fetched on another.
+	//FetchBuffer waits for the next frame once its segment is complete,
+	//E_AGAIN while it is still being queued, E_EOF after Flush and the
+	//last frame. Packets before the first key frame are dropped.
+	static video_decoder* CreateParallelVP9Decoder(stream_desc* upstream, const gop_options& options);
 	//creates a decoder that uses the vpx_img_t* as desc.data, all other fields should be ignored
 	//lifetime is valid only between calls to fetch buffer
-	static video_decoder* CreateDefaultVP9Decoder(stream_desc* upstream, uint32_t threads = 1, bool use_post_proc = false);
+	//decode_ahead > 0 decodes on a thread of its own, up to that many
+	//frames ahead, and FetchBuffer does not wait for a decode; the frames
+	//are copies then, valid until the next frame is fetched or released.
+	//A packet that fails to decode makes one fetch return E_DECODE_ERROR,
+	//in order after the frames decoded before it
+	//refed_frames decodes into pooled buffers (huge_pages backed if asked),
+	//each frame fetched holds a ref until ReleaseBuffer and can be kept
+	//past the next fetch without a copy (not postprocessed frames)
+	static video_decoder* CreateDefaultVP9Decoder(stream_desc* upstream, uint32_t threads = 1, bool use_post_proc = false, uint32_t decode_ahead = 0,
+		bool refed_frames = false, bool huge_pages = false);
 	
 };
 
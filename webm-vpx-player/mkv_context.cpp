@@ -0,0 +1,73 @@
+#include "mkv_context.h"
+
+#include <matroska/matroska2.h>
+#include <mutex>
+#include <memory>
+#include <vector>
+
+namespace {
+
+//tears the registries down, so the idle ones still pooled at exit
+//are freed without a call to shutdown
+struct context_done {
+	void operator()(nodecontext* ctx) const
+	{
+		MATROSKA_Done(ctx);
+		MATROSKA_UnRegisterAll((nodemodule*)ctx);
+		EBML_UnRegisterAll((nodemodule*)ctx);
+		NodeContext_Done(ctx);
+		delete ctx;
+	}
+};
+typedef std::unique_ptr<nodecontext, context_done> context_ptr;
+
+std::mutex registry_mtx;
+//registered, not held by any instance
+std::vector<context_ptr> idle;
+size_t holders = 0;
+
+}
+
+nodecontext* mkv_context::acquire()
+{
+	std::lock_guard<std::mutex> lock(registry_mtx);
+	++holders;
+	if (!idle.empty()) {
+		nodecontext* ctx = idle.back().release();
+		idle.pop_back();
+		return ctx;
+	}
+	nodecontext* ctx = new nodecontext{};
+	NodeContext_Init(ctx, nullptr, nullptr, nullptr);
+	EBML_RegisterAll((nodemodule*)ctx);
+	MATROSKA_RegisterAll((nodemodule*)ctx);
+	MATROSKA_Init(ctx);
+	NodeRegisterClassEx((nodemodule*)ctx, HaaliStream_Class);
+	NodeRegisterClassEx((nodemodule*)ctx, WriteStream_Class);
+	return ctx;
+}
+
+void mkv_context::release(nodecontext* ctx)
+{
+	if (!ctx)
+		return;
+	std::lock_guard<std::mutex> lock(registry_mtx);
+	if (holders)
+		--holders;
+	idle.emplace_back(ctx);
+}
+
+bool mkv_context::shutdown()
+{
+	std::lock_guard<std::mutex> lock(registry_mtx);
+	if (holders)
+		return false;
+	idle.clear();
+	return true;
+}
+
+size_t mkv_context::users()
+{
+	std::lock_guard<std::mutex> lock(registry_mtx);
+	return holders;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+
+struct nodecontext;
+
+//Pooled matroska2 class registries (node context, EBML and Matroska
+//element classes, the stream classes) for mkv_source and mkv_sink,
+//instead of each setting up and tearing down its own. The library is
+//built without CONFIG_MULTITHREAD and never locks a context, while
+//creating and deleting nodes changes it, so a context is held by one
+//instance at a time: acquire hands out an idle one, registering a new
+//one only if every registered one is held, and release gives it back.
+//Opening files one after another registers once, concurrent instances
+//register one each; shutdown frees the idle ones once none is held,
+//and whatever is idle at exit is freed then. An instance still alive
+//at exit keeps its context.
+class mkv_context {
+public:
+	static nodecontext* acquire();
+	static void release(nodecontext* ctx);
+	//false, and nothing is freed, while an instance still holds one
+	static bool shutdown();
+	static size_t users();
+};
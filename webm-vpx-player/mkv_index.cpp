@@ -0,0 +1,140 @@
+#include "mkv_index.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <algorithm>
+
+const char keyframe_index::magic[8] = { 'M', 'K', 'V', 'K', 'F', 'I', 'D', 'X' };
+
+void keyframe_index::add(uint32_t track, uint64_t timestamp, uint64_t cluster_pos)
+{
+	if (track >= building.size())
+		building.resize(track + 1);
+	building[track].push_back(entry{ timestamp, cluster_pos });
+}
+
+void keyframe_index::finish(uint32_t track_count, uint64_t file_size, int64_t file_mtime)
+{
+	building.resize(track_count);
+	size_t total = 0;
+	for (std::vector<entry>& track : building) {
+		std::stable_sort(track.begin(), track.end(),
+			[](const entry& a, const entry& b) { return a.timestamp < b.timestamp; });
+		total += track.size();
+	}
+	size_t bytes = sizeof(header) + track_count * sizeof(track_record) + total * sizeof(entry);
+	packed.assign((bytes + 7) / 8, 0);
+	uint8_t* out = (uint8_t*)packed.data();
+	header* head = (header*)out;
+	memcpy(head->magic, magic, sizeof(magic));
+	head->version = version;
+	head->track_count = track_count;
+	head->file_size = file_size;
+	head->file_mtime = file_mtime;
+	track_record* records = (track_record*)(head + 1);
+	entry* entries = (entry*)(records + track_count);
+	uint64_t first = 0;
+	for (uint32_t i = 0; i < track_count; ++i) {
+		records[i].first = first;
+		records[i].count = building[i].size();
+		if (!building[i].empty())
+			memcpy(entries + first, building[i].data(), building[i].size() * sizeof(entry));
+		first += building[i].size();
+	}
+	building.clear();
+	mapping.close();
+	data = out;
+	length = bytes;
+}
+
+//written aside and renamed, so a reader never maps a partial index
+bool keyframe_index::save(const char* path) const
+{
+	if (!data)
+		return false;
+	std::string temp = std::string(path) + ".tmp";
+	FILE* out = fopen(temp.c_str(), "wb");
+	if (!out)
+		return false;
+	bool written = fwrite(data, 1, length, out) == length;
+	written &= fclose(out) == 0;
+	if (written) {
+		remove(path);
+		written = rename(temp.c_str(), path) == 0;
+	}
+	if (!written)
+		remove(temp.c_str());
+	return written;
+}
+
+bool keyframe_index::valid(const uint8_t* at, size_t len) const
+{
+	if (len < sizeof(header))
+		return false;
+	const header* head = (const header*)at;
+	if (memcmp(head->magic, magic, sizeof(magic)) || head->version != version)
+		return false;
+	size_t records_end = sizeof(header) + (size_t)head->track_count * sizeof(track_record);
+	if (records_end > len)
+		return false;
+	const track_record* records = (const track_record*)(head + 1);
+	uint64_t entry_count = (len - records_end) / sizeof(entry);
+	for (uint32_t i = 0; i < head->track_count; ++i) {
+		if (records[i].first > entry_count || records[i].count > entry_count - records[i].first)
+			return false;
+	}
+	return true;
+}
+
+bool keyframe_index::load(const char* path, uint64_t file_size, int64_t file_mtime)
+{
+	clear();
+	if (!mapping.open(path))
+		return false;
+	const header* head = (const header*)mapping.data();
+	if (!valid(mapping.data(), (size_t)mapping.size()) ||
+		head->file_size != file_size || head->file_mtime != file_mtime) {
+		mapping.close();
+		return false;
+	}
+	data = mapping.data();
+	length = (size_t)mapping.size();
+	return true;
+}
+
+void keyframe_index::clear()
+{
+	building.clear();
+	packed.clear();
+	mapping.close();
+	data = nullptr;
+	length = 0;
+}
+
+uint32_t keyframe_index::track_count() const
+{
+	return data ? ((const header*)data)->track_count : 0;
+}
+
+const keyframe_index::entry* keyframe_index::entries(uint32_t track, size_t& count) const
+{
+	count = 0;
+	if (track >= track_count())
+		return nullptr;
+	const header* head = (const header*)data;
+	const track_record* records = (const track_record*)(head + 1);
+	const entry* all = (const entry*)(records + head->track_count);
+	count = (size_t)records[track].count;
+	return all + records[track].first;
+}
+
+const keyframe_index::entry* keyframe_index::find(uint32_t track, uint64_t timestamp) const
+{
+	size_t count;
+	const entry* first = entries(track, count);
+	const entry* last = first + count;
+	const entry* after = std::upper_bound(first, last, timestamp,
+		[](uint64_t t, const entry& e) { return t < e.timestamp; });
+	return after == first ? nullptr : after - 1;
+}
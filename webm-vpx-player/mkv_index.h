@@ -0,0 +1,63 @@
+#pragma once
+
+#include "file_io.h"
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+//Keyframe timestamps and the offsets of the clusters holding them,
+//per track, for random access into files without (usable) Cues.
+//The packed form is what gets saved next to the media file:
+//a header keyed to the file's size and mtime, one record per track,
+//then every track's entries sorted by timestamp. A saved index is
+//used straight from a read only mapping, nothing is parsed on load.
+class keyframe_index {
+public:
+	struct entry {
+		uint64_t timestamp;
+		uint64_t cluster_pos;
+	};
+	keyframe_index() {}
+	keyframe_index(const keyframe_index&) = delete;
+	keyframe_index& operator=(const keyframe_index&) = delete;
+	//collects entries, in any order
+	void add(uint32_t track, uint64_t timestamp, uint64_t cluster_pos);
+	//packs the collected entries for the file they were read from
+	void finish(uint32_t track_count, uint64_t file_size, int64_t file_mtime);
+	bool save(const char* path) const;
+	//fails unless the index at path was built for this file size and mtime
+	bool load(const char* path, uint64_t file_size, int64_t file_mtime);
+	void clear();
+	bool empty() const
+	{
+		return !data;
+	}
+	uint32_t track_count() const;
+	//last keyframe of track at or before timestamp, null if there is none
+	const entry* find(uint32_t track, uint64_t timestamp) const;
+	//all keyframes of track
+	const entry* entries(uint32_t track, size_t& count) const;
+private:
+	struct header {
+		char magic[8];
+		uint32_t version;
+		uint32_t track_count;
+		uint64_t file_size;
+		int64_t file_mtime;
+	};
+	struct track_record {
+		//index of the first entry in the entry array
+		uint64_t first;
+		uint64_t count;
+	};
+	static const char magic[8];
+	static const uint32_t version = 1;
+	std::vector<std::vector<entry>> building;
+	//8 byte aligned, like the mapping
+	std::vector<uint64_t> packed;
+	file_mapping mapping;
+	const uint8_t* data = nullptr;
+	size_t length = 0;
+	bool valid(const uint8_t* at, size_t len) const;
+};
@@ -0,0 +1,310 @@
+#include "mkv_readahead.h"
+
+#include <chrono>
+#include <cstring>
+#include <cassert>
+#include <cerrno>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<liburing.h>)
+#define MKV_READAHEAD_IO_URING 1
+#include <liburing.h>
+#endif
+#endif
+
+cluster_readahead::cluster_readahead(std::shared_ptr<const positional_file> pfile, uint64_t first_cluster, const readahead_options& options):
+	file(std::move(pfile)), opts(options), window_start(first_cluster), next_pos(first_cluster)
+{
+#ifdef MKV_READAHEAD_IO_URING
+	if (opts.prefer_io_uring) {
+		io_uring* r = new io_uring;
+		//reads in flight never exceed clusters_ahead, plus the wake up nop
+		unsigned entries = opts.clusters_ahead * 2 < 8 ? 8 : (unsigned)opts.clusters_ahead * 2;
+		if (!io_uring_queue_init(entries, r, 0)) {
+			ring = r;
+			reaper = std::thread(&cluster_readahead::reaper_proc, this);
+		}
+		else {
+			delete r;
+		}
+	}
+#endif
+	if (!ring) {
+		unsigned threads = opts.threads ? opts.threads : 1;
+		for (unsigned i = 0; i < threads; ++i)
+			workers.emplace_back(&cluster_readahead::worker_proc, this);
+	}
+	scheduler = std::thread(&cluster_readahead::schedule_proc, this);
+}
+
+cluster_readahead::~cluster_readahead()
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stop = true;
+	}
+	schedule_cond.notify_all();
+	work_cond.notify_all();
+	ready_cond.notify_all();
+	scheduler.join();
+	for (std::thread& worker : workers)
+		worker.join();
+#ifdef MKV_READAHEAD_IO_URING
+	if (ring) {
+		//the kernel may still write into the spans, so let the
+		//reaper drain everything in flight before they are freed
+		io_uring* r = (io_uring*)ring;
+		io_uring_sqe* sqe = io_uring_get_sqe(r);
+		assert(sqe);
+		io_uring_prep_nop(sqe);
+		io_uring_sqe_set_data(sqe, nullptr);
+		io_uring_submit(r);
+		reaper.join();
+		io_uring_queue_exit(r);
+		delete r;
+		ring = nullptr;
+	}
+#endif
+}
+
+//total size of the cluster element starting at hdr,
+//0 if it is not a cluster or its size is unknown
+uint64_t cluster_readahead::cluster_length(const uint8_t* hdr, size_t got)
+{
+	if (got < 5 || hdr[0] != 0x1F || hdr[1] != 0x43 || hdr[2] != 0xB6 || hdr[3] != 0x75)
+		return 0;
+	uint8_t first = hdr[4];
+	if (!first)
+		return 0;
+	int len = 1;
+	while (!(first & (0x80 >> (len - 1))))
+		++len;
+	if (got < size_t(4 + len))
+		return 0;
+	uint64_t value = first & (0xFF >> len);
+	bool all_ones = value == uint64_t(0xFF >> len);
+	for (int i = 1; i < len; ++i) {
+		value = (value << 8) | hdr[4 + i];
+		all_ones &= hdr[4 + i] == 0xFF;
+	}
+	if (all_ones)
+		return 0;
+	return 4 + len + value;
+}
+
+//the cluster ID alone also turns up inside frame data, so a
+//match counts only with a known size that ends in the file and,
+//if read, the Timestamp child that opens every cluster
+bool cluster_readahead::is_cluster_at(uint64_t at, const uint8_t* hdr, size_t got) const
+{
+	uint64_t len = cluster_length(hdr, got);
+	if (!len || len > file->size() - at)
+		return false;
+	size_t size_len = 1;
+	while (!(hdr[4] & (0x80 >> (size_len - 1))))
+		++size_len;
+	size_t child = 4 + size_len;
+	return got <= child || hdr[child] == 0xE7;
+}
+
+void cluster_readahead::schedule_proc()
+{
+	std::unique_lock<std::mutex> lock(mtx);
+	while (!stop) {
+		if (ended || spans.size() >= opts.clusters_ahead || held >= opts.byte_budget) {
+			schedule_cond.wait(lock);
+			continue;
+		}
+		uint64_t at = next_pos;
+		uint64_t gen = generation;
+		lock.unlock();
+		uint8_t hdr[12];
+		size_t got = file->read_at(at, hdr, sizeof(hdr));
+		uint64_t len = cluster_length(hdr, got);
+		if (len && at + len > file->size())
+			len = file->size() - at;
+		lock.lock();
+		if (gen != generation)
+			continue;
+		if (!len) {
+			//end of file, unknown sized cluster or lost sync
+			ended = true;
+			continue;
+		}
+		if (held + len > opts.byte_budget) {
+			if (!spans.empty()) {
+				schedule_cond.wait(lock);
+				continue;
+			}
+			//never fits the budget, left to the demuxer
+			next_pos = at + len;
+			continue;
+		}
+		std::unique_ptr<span> s = std::make_unique<span>();
+		s->pos = at;
+		s->len = len;
+		s->data.reset(new uint8_t[len]);
+		span* issued = s.get();
+		spans.push_back(std::move(s));
+		held += len;
+		next_pos = at + len;
+		++inflight;
+		lock.unlock();
+		submit(issued);
+		lock.lock();
+	}
+}
+
+void cluster_readahead::submit(span* s)
+{
+#ifdef MKV_READAHEAD_IO_URING
+	if (ring) {
+		io_uring* r = (io_uring*)ring;
+		io_uring_sqe* sqe = io_uring_get_sqe(r);
+		if (!sqe) {
+			complete(s, file->read_at(s->pos, s->data.get(), s->len));
+			return;
+		}
+		io_uring_prep_read(sqe, file->descriptor(), s->data.get(), (unsigned)s->len, s->pos);
+		io_uring_sqe_set_data(sqe, s);
+		io_uring_submit(r);
+		return;
+	}
+#endif
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		work.push_back(s);
+	}
+	work_cond.notify_one();
+}
+
+void cluster_readahead::complete(span* s, size_t got)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (got == s->len) {
+		s->state = span_state::READY;
+		counters.bytes_read_ahead += got;
+	}
+	else {
+		s->state = span_state::FAILED;
+	}
+	--inflight;
+	ready_cond.notify_all();
+}
+
+void cluster_readahead::worker_proc()
+{
+	std::unique_lock<std::mutex> lock(mtx);
+	while (true) {
+		work_cond.wait(lock, [this]() { return stop || !work.empty(); });
+		if (stop)
+			return;
+		span* s = work.front();
+		work.pop_front();
+		lock.unlock();
+		complete(s, file->read_at(s->pos, s->data.get(), s->len));
+		lock.lock();
+	}
+}
+
+void cluster_readahead::reaper_proc()
+{
+#ifdef MKV_READAHEAD_IO_URING
+	io_uring* r = (io_uring*)ring;
+	bool quit = false;
+	while (true) {
+		io_uring_cqe* cqe = nullptr;
+		int err = io_uring_wait_cqe(r, &cqe);
+		if (err == -EINTR)
+			continue;
+		if (err < 0)
+			return;
+		span* s = (span*)io_uring_cqe_get_data(cqe);
+		int res = cqe->res;
+		io_uring_cqe_seen(r, cqe);
+		if (!s) {
+			quit = true;
+		}
+		else {
+			size_t got = res > 0 ? res : 0;
+			//short reads are finished here
+			if (got < s->len)
+				got += file->read_at(s->pos + got, s->data.get() + got, s->len - got);
+			complete(s, got);
+		}
+		if (quit) {
+			std::lock_guard<std::mutex> lock(mtx);
+			if (!inflight)
+				return;
+		}
+	}
+#endif
+}
+
+void cluster_readahead::restart(std::unique_lock<std::mutex>& lock, uint64_t pos)
+{
+	ready_cond.wait(lock, [this]() { return !inflight; });
+	spans.clear();
+	held = 0;
+	window_start = pos;
+	next_pos = pos;
+	ended = false;
+	++generation;
+	schedule_cond.notify_one();
+}
+
+//Called by the single demuxing reader only, its position
+//is what releases clusters from the window.
+size_t cluster_readahead::read_at(uint64_t pos, void* buffer, size_t count)
+{
+	uint8_t* out = (uint8_t*)buffer;
+	size_t done = 0;
+	std::unique_lock<std::mutex> lock(mtx);
+	bool dropped = false;
+	while (!spans.empty() && spans.front()->end() <= pos && spans.front()->state != span_state::PENDING) {
+		window_start = spans.front()->end();
+		held -= spans.front()->len;
+		spans.pop_front();
+		dropped = true;
+	}
+	if (dropped)
+		schedule_cond.notify_one();
+	//only this thread removes spans, indices stay valid across waits
+	for (size_t i = 0; i < spans.size() && done < count; ++i) {
+		span* s = spans[i].get();
+		uint64_t at = pos + done;
+		if (at < s->pos)
+			break;
+		if (at >= s->end())
+			continue;
+		if (s->state == span_state::PENDING) {
+			auto begin = std::chrono::steady_clock::now();
+			ready_cond.wait(lock, [s]() { return s->state != span_state::PENDING; });
+			counters.stall_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+		}
+		if (s->state != span_state::READY)
+			break;
+		size_t chunk = count - done < s->end() - at ? count - done : (size_t)(s->end() - at);
+		memcpy(out + done, s->data.get() + (at - s->pos), chunk);
+		done += chunk;
+	}
+	bool outside = pos + count <= window_start || pos > next_pos;
+	lock.unlock();
+	if (done == count) {
+		++counters.hits;
+		return done;
+	}
+	++counters.misses;
+	done += file->read_at(pos + done, out + done, count - done);
+	if (outside) {
+		//the demuxer jumped, follow it if it landed on a cluster
+		for (size_t i = 0; i + 4 <= done; ++i) {
+			if (is_cluster_at(pos + i, out + i, done - i)) {
+				lock.lock();
+				restart(lock, pos + i);
+				break;
+			}
+		}
+	}
+	return done;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "file_io.h"
+
+#include <cstdint>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+struct readahead_options {
+	//clusters kept read ahead of the demux position
+	size_t clusters_ahead = 4;
+	//bytes held by clusters read ahead, done or in flight
+	size_t byte_budget = 32 * 1024 * 1024;
+	//workers of the thread pool backend
+	unsigned threads = 2;
+	//use io_uring if built with liburing (linux only)
+	bool prefer_io_uring = true;
+};
+
+struct readahead_stats {
+	//reads served fully from clusters read ahead
+	std::atomic<uint64_t> hits{0};
+	//reads that went (at least partly) to the file
+	std::atomic<uint64_t> misses{0};
+	//time the demuxer waited on reads still in flight
+	std::atomic<uint64_t> stall_ns{0};
+	std::atomic<uint64_t> bytes_read_ahead{0};
+};
+
+//Keeps the next clusters after the demux position in memory.
+//Walks the cluster headers from the first cluster on its own
+//thread and reads whole clusters with io_uring or a thread pool,
+//bounded by a cluster count and a byte budget. The demuxer reads
+//through read_at: data in a finished cluster is a hit, data in
+//one still in flight waits for it (stall), anything else is read
+//from the file directly (miss). A miss on a cluster header outside
+//the window (e.g. after a seek) restarts the read ahead there.
+class cluster_readahead: public read_cache {
+	enum class span_state {
+		PENDING,
+		READY,
+		FAILED
+	};
+	struct span {
+		uint64_t pos;
+		uint64_t len;
+		std::unique_ptr<uint8_t[]> data;
+		span_state state = span_state::PENDING;
+		uint64_t end() const
+		{
+			return pos + len;
+		}
+	};
+	const std::shared_ptr<const positional_file> file;
+	const readahead_options opts;
+	readahead_stats counters;
+
+	std::mutex mtx;
+	//wakes the scheduler
+	std::condition_variable schedule_cond;
+	//wakes readers waiting on a span and restarts waiting on inflight
+	std::condition_variable ready_cond;
+	//wakes the thread pool
+	std::condition_variable work_cond;
+	std::deque<std::unique_ptr<span>> spans;
+	std::deque<span*> work;
+	uint64_t window_start;
+	uint64_t next_pos;
+	uint64_t held = 0;
+	size_t inflight = 0;
+	uint64_t generation = 0;
+	bool ended = false;
+	bool stop = false;
+
+	std::thread scheduler;
+	std::vector<std::thread> workers;
+	//struct io_uring*, only with liburing
+	void* ring = nullptr;
+	std::thread reaper;
+public:
+	cluster_readahead(std::shared_ptr<const positional_file> pfile, uint64_t first_cluster, const readahead_options& options);
+	cluster_readahead(const cluster_readahead&) = delete;
+	cluster_readahead& operator=(const cluster_readahead&) = delete;
+	virtual ~cluster_readahead() override;
+	virtual size_t read_at(uint64_t pos, void* buffer, size_t count) override;
+	const readahead_stats& stats() const
+	{
+		return counters;
+	}
+	bool uses_io_uring() const
+	{
+		return ring != nullptr;
+	}
+private:
+	void schedule_proc();
+	void worker_proc();
+	void reaper_proc();
+	void submit(span* s);
+	void complete(span* s, size_t got);
+	void restart(std::unique_lock<std::mutex>& lock, uint64_t pos);
+	static uint64_t cluster_length(const uint8_t* hdr, size_t got);
+	bool is_cluster_at(uint64_t at, const uint8_t* hdr, size_t got) const;
+};
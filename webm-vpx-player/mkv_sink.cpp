@@ -1,20 +1,166 @@
 #include "mkv_sink.h"
+#include "mkv_context.h"
+#include "file_io.h"
 
 #include <matroska/matroska2.h>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <string>
+
+//EBML ids of the elements write_cues reads or writes
+enum : uint32_t {
+	ID_EBML = 0x1A45DFA3,
+	ID_SEGMENT = 0x18538067,
+	ID_SEEKHEAD = 0x114D9B74,
+	ID_SEEK = 0x4DBB,
+	ID_SEEKID = 0x53AB,
+	ID_SEEKPOSITION = 0x53AC,
+	ID_INFO = 0x1549A966,
+	ID_TIMECODESCALE = 0x2AD7B1,
+	ID_TRACKS = 0x1654AE6B,
+	ID_TRACKENTRY = 0xAE,
+	ID_TRACKNUMBER = 0xD7,
+	ID_DURATION = 0x4489,
+	ID_CLUSTER = 0x1F43B675,
+	ID_TIMECODE = 0xE7,
+	ID_SIMPLEBLOCK = 0xA3,
+	ID_BLOCKGROUP = 0xA0,
+	ID_BLOCK = 0xA1,
+	ID_BLOCKDURATION = 0x9B,
+	ID_CUES = 0x1C53BB6B,
+	ID_CUEPOINT = 0xBB,
+	ID_CUETIME = 0xB3,
+	ID_CUETRACKPOSITIONS = 0xB7,
+	ID_CUETRACK = 0xF7,
+	ID_CUECLUSTERPOSITION = 0xF1,
+	ID_CUERELATIVEPOSITION = 0xF0,
+	ID_VOID = 0xEC
+};
+
+//three Seek entries with 8 byte positions and the SeekHead around
+//them take 68 bytes, the rest stays a Void of at least 2
+static const size_t seekhead_room = 96;
+
+//EBML variable length integer, the length marker kept for ids.
+//Returns its length, 0 if it is invalid or not all in avail.
+static size_t get_vint(const uint8_t* data, size_t avail, uint64_t& value, bool keep_marker)
+{
+	if (!avail || !data[0])
+		return 0;
+	size_t len = 1;
+	while (!(data[0] & (0x80 >> (len - 1))))
+		++len;
+	if (len > avail)
+		return 0;
+	value = keep_marker ? data[0] : data[0] & (0xFF >> len);
+	for (size_t i = 1; i < len; ++i)
+		value = (value << 8) | data[i];
+	return len;
+}
+
+//id and size of the element starting at data, returns the length
+//of both, 0 if they are invalid or not all in avail
+static size_t get_head(const uint8_t* data, size_t avail, uint32_t& id, uint64_t& size, size_t& size_len)
+{
+	uint64_t value;
+	size_t id_len = get_vint(data, avail, value, true);
+	if (!id_len || id_len > 4)
+		return 0;
+	size_len = get_vint(data + id_len, avail - id_len, size, false);
+	if (!size_len)
+		return 0;
+	id = (uint32_t)value;
+	return id_len + size_len;
+}
+
+static bool unknown_size(uint64_t size, size_t size_len)
+{
+	return size == (1ull << (7 * size_len)) - 1;
+}
+
+static uint64_t get_uint(const uint8_t* data, uint64_t size)
+{
+	uint64_t value = 0;
+	for (uint64_t i = 0; i < size && i < 8; ++i)
+		value = (value << 8) | data[i];
+	return value;
+}
+
+//calls on_child(id, data, size) for the children in body
+template<class F>
+static void for_children(const uint8_t* body, size_t length, F on_child)
+{
+	for (size_t pos = 0; pos < length;) {
+		uint32_t id;
+		uint64_t size;
+		size_t size_len;
+		size_t head_len = get_head(body + pos, length - pos, id, size, size_len);
+		if (!head_len || size > length - pos - head_len)
+			return;
+		on_child(id, body + pos + head_len, size);
+		pos += head_len + (size_t)size;
+	}
+}
+
+static void put_id(std::vector<uint8_t>& out, uint32_t id)
+{
+	for (int shift = 24; shift >= 0; shift -= 8) {
+		if (id >> shift)
+			out.push_back((uint8_t)(id >> shift));
+	}
+}
+
+//in at least min_len bytes
+static void put_size(std::vector<uint8_t>& out, uint64_t size, size_t min_len = 1)
+{
+	size_t len = 1;
+	//all ones is reserved for unknown sizes
+	while (len < 8 && size >= (1ull << (7 * len)) - 1)
+		++len;
+	if (len < min_len)
+		len = min_len;
+	uint64_t coded = size | (1ull << (7 * len));
+	for (size_t i = len; i-- > 0;)
+		out.push_back((uint8_t)(coded >> (8 * i)));
+}
+
+static void put_uint(std::vector<uint8_t>& out, uint32_t id, uint64_t value, size_t min_len = 1)
+{
+	size_t len = 1;
+	while (len < 8 && value >> (8 * len))
+		++len;
+	if (len < min_len)
+		len = min_len;
+	put_id(out, id);
+	put_size(out, len);
+	for (size_t i = len; i-- > 0;)
+		out.push_back((uint8_t)(value >> (8 * i)));
+}
+
+static void put_master(std::vector<uint8_t>& out, uint32_t id, const std::vector<uint8_t>& body)
+{
+	put_id(out, id);
+	put_size(out, body.size());
+	out.insert(out.end(), body.begin(), body.end());
+}
+
+//a Void element of total bytes, at least 2
+static void put_void(std::vector<uint8_t>& out, size_t total)
+{
+	size_t size_len = total - 2 < 127 ? 1 : 8;
+	put_id(out, ID_VOID);
+	put_size(out, total - 1 - size_len, size_len);
+	out.resize(out.size() + total - 1 - size_len);
+}
 
 mkv_sink::mkv_sink()
 {
-	NodeContext_Init(&ctx, nullptr, nullptr, nullptr);
+	ctx = mkv_context::acquire();
 	ostream.ptr = this;
-	ostream.AnyNode = &ctx;
-	EBML_RegisterAll((nodemodule*)&ctx);
-	MATROSKA_RegisterAll((nodemodule*)&ctx);
-	MATROSKA_Init(&ctx);
-	NodeRegisterClassEx((nodemodule*)&ctx, HaaliStream_Class);
-	NodeRegisterClassEx((nodemodule*)&ctx, WriteStream_Class);
+	ostream.AnyNode = ctx;
 }
 
 int mkv_sink::finish_init()
@@ -136,6 +282,9 @@ int mkv_sink::AddTrack(const stream_desc& info)
 	track.Forced = info.format_info.meta.mkv.Forced;
 	memcpy(track.Language, info.format_info.meta.mkv.Language, 4);
 	track.Name = info.format_info.Name;
+	track.Lacing = lace_audio && info.type == stream_desc::MTYPE_AUDIO;
+	video_tracks.push_back(info.type == stream_desc::MTYPE_VIDEO);
+	++track_count;
 	return mkv_AddTrack(file, &track);
 }
 
@@ -144,27 +293,567 @@ int mkv_sink::write_headers()
 	char err[2048]{};
 	mkv_WriteHeader(file, err, 2048);
 	mkv_TempHeaders(file);
+	if (out_opts.cues) {
+		bool has_video = std::find(video_tracks.begin(), video_tracks.end(), true) != video_tracks.end();
+		cued_tracks = has_video ? video_tracks : std::vector<bool>(track_count, true);
+		frames_written.assign(track_count, 0);
+		//room for the SeekHead and the Cues, before the first cluster
+		reserve_pos = ostream.iotell(&ostream);
+		reserve_size = seekhead_room + out_opts.cue_reserve;
+		std::vector<uint8_t> reserve;
+		put_void(reserve, reserve_size);
+		ostream.iowrite(&ostream, reserve.data(), (int)reserve.size());
+	}
 	writing = true;
 	return S_OK;
 }
 
+void mkv_sink::write_frame(const _buffer_desc& buffer)
+{
+	mkv_WriteFrame(file, buffer.detail.pkt.track, buffer.start_timestamp, buffer.end_timestamp,
+		buffer.detail.pkt.size, buffer.detail.pkt.data, buffer.detail.pkt.key_frame, 0);
+	uint32_t track = buffer.detail.pkt.track;
+	if (track >= cued_tracks.size())
+		return;
+	uint64_t frame = frames_written[track]++;
+	if (buffer.detail.pkt.key_frame && cued_tracks[track])
+		cue_keys.push_back(cue_key{ buffer.start_timestamp, frame, track });
+}
+
+int mkv_sink::QueueBuffer(_buffer_desc& buffer)
+{
+	if (!writing)
+		return E_INVALID_OPERATION;
+	if (async)
+		return push(buffer);
+	write_frame(buffer);
+	return S_OK;
+}
+
+int mkv_sink::Flush()
+{
+	if (!writing)
+		return E_INVALID_OPERATION;
+	//the writer drains every queue before it exits
+	stop_async();
+	mkv_WriteTail(file);
+	bool written = flush_output();
+	int err = S_OK;
+	if (out_opts.cues) {
+		//the file is complete either way, only seeking into it scans
+		if (write_cues())
+			written = flush_output() && written;
+		else
+			err = E_NO_INDEX;
+	}
+	writing = false;
+	return written ? err : E_IO_ERROR;
+}
+
+int mkv_sink::StartAsync(const async_options& options)
+{
+	if (!writing || async)
+		return E_INVALID_OPERATION;
+	async_opts = options;
+	if (async_opts.max_packets < 2)
+		async_opts.max_packets = 2;
+	for (size_t i = 0; i < track_count; ++i)
+		queues.emplace_back(new track_queue(async_opts.max_packets));
+	async = true;
+	async_writer = std::thread(&mkv_sink::writer_proc, this);
+	return S_OK;
+}
+
+//the packets own refs of their own, the caller keeps its packet
+static void release_queued(_buffer_desc* buffer)
+{
+	buffer->detail.pkt.buffer->unref();
+	buffer->detail.pkt.buffer = nullptr;
+}
+
+int mkv_sink::push(_buffer_desc& buffer)
+{
+	uint32_t track = buffer.detail.pkt.track;
+	if (track >= queues.size() || !buffer.detail.pkt.buffer)
+		return E_INVALID_OPERATION;
+	track_queue& queue = *queues[track];
+	size_t size = buffer.detail.pkt.size;
+	if (queue.drop_to_keyframe && !buffer.detail.pkt.key_frame) {
+		++counters.dropped;
+		return S_OK;
+	}
+	auto full = [&]() {
+		size_t bytes = queued_bytes.load();
+		return (bytes && bytes + size > async_opts.max_bytes) ||
+			queue.packets.size() >= queue.packets.capacity();
+	};
+	if (full()) {
+		if (async_opts.overflow == async_options::OVERFLOW_DROP) {
+			queue.drop_to_keyframe = true;
+			++counters.dropped;
+			return S_OK;
+		}
+		auto begin = std::chrono::steady_clock::now();
+		std::unique_lock<std::mutex> lock(async_mtx);
+		producer_waiting = true;
+		//the writer notifies after freeing room if it sees
+		//producer_waiting, the timeout covers the race with that
+		while (full())
+			room_cond.wait_for(lock, std::chrono::milliseconds(10));
+		producer_waiting = false;
+		counters.blocked_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+	}
+	queue.drop_to_keyframe = false;
+	_buffer_desc queued(buffer);
+	queued.release = release_queued;
+	queued.release_private_ptr = this;
+	queued.detail.pkt.buffer->ref();
+	queued_bytes += size;
+	queue.packets.emplace(queued);
+	++counters.queued;
+	if (writer_waiting.load()) {
+		std::lock_guard<std::mutex> lock(async_mtx);
+		packets_cond.notify_one();
+	}
+	return S_OK;
+}
+
+//The earliest head of all queues. all_tracks tells whether every track
+//not idle had one, otherwise a track behind may still bring an earlier one.
+_buffer_desc* mkv_sink::pick(bool& all_tracks)
+{
+	_buffer_desc* earliest = nullptr;
+	all_tracks = true;
+	for (std::unique_ptr<track_queue>& queue : queues) {
+		_buffer_desc* head = queue->packets.front();
+		if (!head) {
+			if (!queue->idle)
+				all_tracks = false;
+			continue;
+		}
+		queue->idle = false;
+		if (!earliest || head->start_timestamp < earliest->start_timestamp)
+			earliest = head;
+	}
+	return earliest;
+}
+
+void mkv_sink::writer_proc()
+{
+	typedef std::chrono::steady_clock clock_type;
+	const auto hold = std::chrono::milliseconds(async_opts.interleave_ms);
+	bool held = false;
+	clock_type::time_point held_since;
+	while (true) {
+		bool all_tracks;
+		_buffer_desc* next = pick(all_tracks);
+		bool draining = stopping.load();
+		if (next && !all_tracks && !draining) {
+			//short of memory, or waited long enough for the missing tracks
+			bool pressed = queued_bytes.load() > async_opts.max_bytes / 2;
+			if (!held) {
+				held = true;
+				held_since = clock_type::now();
+			}
+			if (!pressed && clock_type::now() - held_since < hold) {
+				next = nullptr;
+			}
+			else if (!pressed) {
+				//the tracks still empty have ended, or gone quiet
+				for (std::unique_ptr<track_queue>& queue : queues) {
+					if (!queue->packets.front())
+						queue->idle = true;
+				}
+			}
+		}
+		if (next) {
+			//each packet written starts a new wait for the missing tracks
+			held = false;
+			size_t track = next->detail.pkt.track;
+			size_t size = next->detail.pkt.size;
+			write_frame(*next);
+			next->release(next);
+			queues[track]->packets.pop();
+			queued_bytes -= size;
+			++counters.written;
+			if (producer_waiting.load()) {
+				std::lock_guard<std::mutex> lock(async_mtx);
+				room_cond.notify_one();
+			}
+			continue;
+		}
+		if (draining && !pick(all_tracks))
+			return;
+		std::unique_lock<std::mutex> lock(async_mtx);
+		writer_waiting = true;
+		//push checks writer_waiting after queueing
+		bool all_now;
+		_buffer_desc* head = pick(all_now);
+		if (!stopping.load() && (!head || !all_now))
+			packets_cond.wait_for(lock, head ? hold / 4 + std::chrono::milliseconds(1) : std::chrono::milliseconds(50));
+		writer_waiting = false;
+	}
+}
+
+void mkv_sink::stop_async()
+{
+	if (!async_writer.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(async_mtx);
+		stopping = true;
+	}
+	packets_cond.notify_one();
+	async_writer.join();
+}
 
+//Finds the clusters the muxer wrote and the block of every recorded
+//keyframe, and writes the Cues, in the reserved Void if they fit, else
+//after the last cluster, and a SeekHead to them in the Void.
+//Reads back only the element headers, and of each block its track
+//and lace count, not the frames. False if no Cues were written: no
+//cluster, the Void overwritten, or no room for them after the file.
+bool mkv_sink::write_cues()
+{
+	struct element {
+		uint32_t id;
+		uint64_t start;
+		uint64_t data;
+		uint64_t size;
+		size_t size_len;
+		bool unknown_size;
+		uint64_t end() const
+		{
+			return data + size;
+		}
+	};
+	auto element_at = [this](uint64_t pos, element& e) {
+		uint8_t head[12];
+		size_t got = read_output(pos, head, sizeof(head));
+		size_t head_len = get_head(head, got, e.id, e.size, e.size_len);
+		if (!head_len)
+			return false;
+		e.start = pos;
+		e.data = pos + head_len;
+		e.unknown_size = unknown_size(e.size, e.size_len);
+		return true;
+	};
+	auto read_body = [this](const element& e, std::vector<uint8_t>& body) {
+		//Info and Tracks, CodecPrivate included, are far smaller
+		if (e.unknown_size || e.size > 16 * 1024 * 1024)
+			return false;
+		body.resize((size_t)e.size);
+		return read_output(e.data, body.data(), body.size()) == body.size();
+	};
+	element header, segment;
+	if (!element_at(0, header) || header.id != ID_EBML || header.unknown_size ||
+		!element_at(header.end(), segment) || segment.id != ID_SEGMENT)
+		return false;
+	uint64_t file_end = ostream.getfilesize(&ostream);
+	uint64_t segment_end = segment.unknown_size || segment.end() > file_end ? file_end : segment.end();
+	uint64_t info_pos = 0, tracks_pos = 0, cues_pos = 0, last_end = segment.data;
+	uint64_t scale = 1000000;
+	bool reserved = false, complete = true;
+	std::vector<uint64_t> numbers;
+	size_t clusters = 0;
+	struct point {
+		uint64_t time;
+		uint64_t track;
+		uint64_t cluster;
+		uint64_t relative;
+	};
+	std::vector<point> points;
+	//per track: frames found so far, the next key and the cluster of the last point
+	std::vector<uint64_t> frames_found(track_count, 0);
+	std::vector<std::vector<const cue_key*>> keys(track_count);
+	std::vector<size_t> next_key(track_count, 0);
+	std::vector<uint64_t> last_cluster(track_count, UINT64_MAX);
+	for (const cue_key& key : cue_keys)
+		keys[key.track].push_back(&key);
+	//counts the frames of the block in child, a SimpleBlock or a
+	//BlockGroup, and adds a point for each key among them
+	auto index_block = [&](const element& cluster, const element& child) {
+		element block = child;
+		if (child.id == ID_BLOCKGROUP) {
+			uint64_t pos = child.data;
+			while (pos < child.end() && element_at(pos, block) && !block.unknown_size && block.id != ID_BLOCK)
+				pos = block.end();
+			if (pos >= child.end() || block.id != ID_BLOCK)
+				return;
+		}
+		uint8_t head[12];
+		size_t got = read_output(block.data, head, block.size < sizeof(head) ? (size_t)block.size : sizeof(head));
+		uint64_t number;
+		size_t number_len = get_vint(head, got, number, false);
+		if (!number_len || got < number_len + 3)
+			return;
+		uint8_t flags = head[number_len + 2];
+		uint64_t frames = 1;
+		if (flags & 0x06) {
+			if (got < number_len + 4)
+				return;
+			frames += head[number_len + 3];
+		}
+		size_t track = std::find(numbers.begin(), numbers.end(), number) - numbers.begin();
+		if (numbers.empty())
+			track = (size_t)number - 1;
+		if (track >= track_count)
+			return;
+		frames_found[track] += frames;
+		std::vector<const cue_key*>& track_keys = keys[track];
+		for (; next_key[track] < track_keys.size() && track_keys[next_key[track]]->frame < frames_found[track]; ++next_key[track]) {
+			//one entry per track and cluster is enough
+			if (last_cluster[track] == cluster.start)
+				continue;
+			last_cluster[track] = cluster.start;
+			points.push_back(point{ track_keys[next_key[track]]->timestamp / scale, number,
+				cluster.start - segment.data, child.start - cluster.data });
+		}
+	};
+	std::vector<uint8_t> body;
+	for (uint64_t pos = segment.data; pos < segment_end;) {
+		element e;
+		if (!element_at(pos, e)) {
+			complete = false;
+			break;
+		}
+		switch (e.id) {
+			case ID_INFO:
+				info_pos = e.start;
+				if (read_body(e, body)) {
+					for_children(body.data(), body.size(), [&](uint32_t id, const uint8_t* data, uint64_t size) {
+						if (id == ID_TIMECODESCALE && get_uint(data, size))
+							scale = get_uint(data, size);
+					});
+				}
+				break;
+			case ID_TRACKS:
+				tracks_pos = e.start;
+				if (read_body(e, body)) {
+					for_children(body.data(), body.size(), [&](uint32_t id, const uint8_t* data, uint64_t size) {
+						if (id != ID_TRACKENTRY)
+							return;
+						for_children(data, (size_t)size, [&](uint32_t id, const uint8_t* data, uint64_t size) {
+							if (id == ID_TRACKNUMBER)
+								numbers.push_back(get_uint(data, size));
+						});
+					});
+				}
+				break;
+			case ID_CUES:
+				//the muxer wrote some after all
+				cues_pos = e.start;
+				break;
+			case ID_VOID:
+				reserved |= e.start == reserve_pos && e.end() == reserve_pos + reserve_size;
+				break;
+			case ID_CLUSTER: {
+				++clusters;
+				if (e.unknown_size)
+					break;
+				element child;
+				for (uint64_t at = e.data; at < e.end() && element_at(at, child) && !child.unknown_size && child.end() <= e.end(); at = child.end()) {
+					if (child.id == ID_SIMPLEBLOCK || child.id == ID_BLOCKGROUP)
+						index_block(e, child);
+				}
+				break;
+			}
+		}
+		if (e.unknown_size) {
+			complete = false;
+			break;
+		}
+		pos = e.end();
+		last_end = pos;
+	}
+	//the muxer put its clusters over the Void, nothing to put a SeekHead in
+	if (!reserved || !info_pos || !tracks_pos)
+		return false;
+	std::vector<uint8_t> cues;
+	if (!cues_pos) {
+		if (!clusters)
+			return false;
+		std::stable_sort(points.begin(), points.end(), [](const point& a, const point& b) { return a.time < b.time; });
+		std::vector<uint8_t> body, positions, cue_point;
+		for (const point& p : points) {
+			positions.clear();
+			put_uint(positions, ID_CUETRACK, p.track);
+			put_uint(positions, ID_CUECLUSTERPOSITION, p.cluster);
+			put_uint(positions, ID_CUERELATIVEPOSITION, p.relative);
+			cue_point.clear();
+			put_uint(cue_point, ID_CUETIME, p.time);
+			put_master(cue_point, ID_CUETRACKPOSITIONS, positions);
+			put_master(body, ID_CUEPOINT, cue_point);
+		}
+		put_master(cues, ID_CUES, body);
+	}
+	//fixed size positions, so the SeekHead's size does not depend on them
+	auto seekhead = [&](uint64_t cues_at) {
+		std::vector<uint8_t> body, seek, out;
+		const uint32_t ids[] = { ID_INFO, ID_TRACKS, ID_CUES };
+		const uint64_t positions[] = { info_pos, tracks_pos, cues_at };
+		for (int i = 0; i < 3; ++i) {
+			seek.clear();
+			put_id(seek, ID_SEEKID);
+			put_size(seek, 4);
+			put_id(seek, ids[i]);
+			put_uint(seek, ID_SEEKPOSITION, positions[i] - segment.data, 8);
+			put_master(body, ID_SEEK, seek);
+		}
+		put_master(out, ID_SEEKHEAD, body);
+		return out;
+	};
+	size_t seekhead_size = seekhead(0).size();
+	size_t left = reserve_size - seekhead_size;
+	bool in_front = !cues.empty() && cues.size() <= left && left - cues.size() != 1;
+	if (in_front) {
+		cues_pos = reserve_pos + seekhead_size;
+		left -= cues.size();
+	}
+	else if (!cues.empty()) {
+		//after the last cluster, the Segment grows around them
+		if (!complete || last_end != file_end)
+			return false;
+		cues_pos = last_end;
+		if (!segment.unknown_size) {
+			uint64_t grown = cues_pos + cues.size() - segment.data;
+			if (grown >= (1ull << (7 * segment.size_len)) - 1)
+				return false;
+			std::vector<uint8_t> size;
+			put_size(size, grown, segment.size_len);
+			ostream.write(&ostream, segment.data - segment.size_len, size.data(), size.size());
+		}
+	}
+	std::vector<uint8_t> front = seekhead(cues_pos);
+	if (in_front)
+		front.insert(front.end(), cues.begin(), cues.end());
+	if (left)
+		put_void(front, left);
+	ostream.write(&ostream, reserve_pos, front.data(), front.size());
+	if (!in_front && !cues.empty())
+		ostream.write(&ostream, cues_pos, cues.data(), cues.size());
+	return true;
+}
 
 mkv_sink::~mkv_sink()
 {
-	mkv_CloseOutput(file);
-	MATROSKA_Done(&ctx);
-	MATROSKA_UnRegisterAll((nodemodule*)&ctx);
-	EBML_UnRegisterAll((nodemodule*)&ctx);
-	NodeContext_Done(&ctx);
+	stop_async();
+	if (file)
+		mkv_CloseOutput(file);
+	mkv_context::release(ctx);
 }
 
+//Writes through a buffered_writer: the muxer's many small writes
+//(element ids and sizes byte by byte) collect in one large buffer,
+//and going back to patch a size inside what is still buffered
+//neither seeks nor flushes.
 class mkv_file_sink: public mkv_sink {
+	buffered_writer writer;
+protected:
+friend mkv_sink_factory;
+	mkv_file_sink(const char* path, uint64_t expected_size) {
+		ostream.geterror = geterror;
+		ostream.getfilesize = getfilesize;
+		ostream.iowrite = iowrite;
+		ostream.iowritech = iowritech;
+		ostream.ioseek = ioseek;
+		ostream.iotell = iotell;
+		ostream.memalloc = memalloc;
+		ostream.memfree = memfree;
+		ostream.memrealloc = memrealloc;
+		ostream.progress = progress;
+		ostream.write = write;
+		writer.open(path, 1024 * 1024, expected_size);
+	}
+public:
+	virtual ~mkv_file_sink() override final
+	{
+		if(writing)
+			Flush();
+		//the muxer may still write on close
+		if (file)
+			mkv_CloseOutput(file);
+		file = nullptr;
+		writer.close();
+	}
+	virtual int AllocBuffer(_buffer_desc& buffer) override final
+	{
+		return E_PROTOCOL_MISMATCH;
+	}
+protected:
+	virtual bool flush_output() override final
+	{
+		return writer.flush();
+	}
+	virtual size_t read_output(uint64_t pos, void* buffer, size_t count) override final
+	{
+		return writer.read_at(pos, buffer, count);
+	}
+
+private:
+	static const char* geterror(OutputStream* cc) noexcept 
+	{
+		return "dummy error";
+	}
+	static filepos_t getfilesize(OutputStream* cc) noexcept
+	{
+		return ((mkv_file_sink*)cc->ptr)->writer.size();
+	}
+	static int iowrite(OutputStream* inf, void* buffer, int count) noexcept
+	{
+		return (int)((mkv_file_sink*)inf->ptr)->writer.write(buffer, count);
+	}
+	static bool_t iowritech(OutputStream* inf, int ch) noexcept
+	{
+		return ((mkv_file_sink*)inf->ptr)->writer.put((uint8_t)ch);
+	}
+	static void ioseek(OutputStream* inf, longlong wher, int how) noexcept
+	{
+		buffered_writer& writer = ((mkv_file_sink*)inf->ptr)->writer;
+		switch (how) {
+			case SEEK_CUR:
+				wher += writer.tell();
+				break;
+			case SEEK_END:
+				wher += writer.size();
+				break;
+		}
+		writer.seek(wher < 0 ? 0 : wher);
+	}
+	static filepos_t iotell(OutputStream* inf) noexcept
+	{
+		return ((mkv_file_sink*)inf->ptr)->writer.tell();
+	}
+	static void* memalloc(OutputStream* inf, size_t count) noexcept
+	{
+		return malloc(count);
+	}
+	static void memfree(OutputStream* inf, void* mem) noexcept
+	{
+		free(mem);
+	}
+	static void* memrealloc(OutputStream* inf, void* mem, size_t count) noexcept
+	{
+		return realloc(mem, count);
+	}
+	static int progress(OutputStream* inf, filepos_t cur, filepos_t max) noexcept
+	{
+		return 0;
+	}
+	static int write(OutputStream* inf, filepos_t pos, void* buffer, size_t count) noexcept
+	{
+		return (int)((mkv_file_sink*)inf->ptr)->writer.write_at(pos, buffer, count);
+	}
+};
+
+//Writes through stdio, every positional write seeks the FILE*
+//away and back. Kept for comparison with mkv_file_sink.
+class mkv_stdio_sink: public mkv_sink {
 	FILE* mfile_handle = nullptr;
 	uint64_t file_pos = 0;
 protected:
 friend mkv_sink_factory;
-	mkv_file_sink(const char* path) {
+	mkv_stdio_sink(const char* path) {
 		ostream.geterror = geterror;
 		ostream.getfilesize = getfilesize;
 		ostream.iowrite = iowrite;
@@ -176,15 +865,11 @@ friend mkv_sink_factory;
 		ostream.memrealloc = memrealloc;
 		ostream.progress = progress;
 		ostream.write = write;
-		FILE* file_handle = fopen(path, "wb");
-		if (!file_handle) {
-			printf("Cannot open file\n");
-			return;
-		}
-		mfile_handle = file_handle;
+		//read back for the Cues
+		mfile_handle = fopen(path, "w+b");
 	}
 public:
-	virtual ~mkv_file_sink() override final
+	virtual ~mkv_stdio_sink() override final
 	{
 		if(writing)
 			Flush();
@@ -193,26 +878,22 @@ public:
 			mfile_handle = nullptr;
 		}
 	}
-	virtual int QueueBuffer(_buffer_desc& buffer) override final
-	{
-		if(!writing) 
-			return E_INVALID_OPERATION;
-		mkv_WriteFrame(file, buffer.detail.pkt.track, buffer.start_timestamp, buffer.end_timestamp,
-			buffer.detail.pkt.size, buffer.detail.pkt.buffer, buffer.detail.pkt.key_frame, 0);
-		return S_OK;
-	}
 	virtual int AllocBuffer(_buffer_desc& buffer) override final
 	{
 		return E_PROTOCOL_MISMATCH;
 	}
-	virtual int Flush() override final
+protected:
+	virtual bool flush_output() override final
 	{
-		if(!writing)
-			return E_INVALID_OPERATION;
-		mkv_WriteTail(file);
-		fflush(mfile_handle);
-		writing = false;
-		return S_OK;
+		return fflush(mfile_handle) == 0 && !ferror(mfile_handle);
+	}
+	virtual size_t read_output(uint64_t pos, void* buffer, size_t count) override final
+	{
+		__int64 cur = _ftelli64(mfile_handle);
+		_fseeki64(mfile_handle, pos, SEEK_SET);
+		size_t read = fread(buffer, 1, count, mfile_handle);
+		_fseeki64(mfile_handle, cur, SEEK_SET);
+		return read;
 	}
 
 private:
@@ -222,28 +903,28 @@ private:
 	}
 	static filepos_t getfilesize(OutputStream* cc) noexcept
 	{
-		__int64 cur = _ftelli64(((mkv_file_sink*)cc->ptr)->mfile_handle);
-		fseek(((mkv_file_sink*)cc->ptr)->mfile_handle, 0L, SEEK_END);
-		__int64 size = _ftelli64(((mkv_file_sink*)cc->ptr)->mfile_handle);
-		_fseeki64(((mkv_file_sink*)cc->ptr)->mfile_handle, cur, SEEK_SET);
+		__int64 cur = _ftelli64(((mkv_stdio_sink*)cc->ptr)->mfile_handle);
+		fseek(((mkv_stdio_sink*)cc->ptr)->mfile_handle, 0L, SEEK_END);
+		__int64 size = _ftelli64(((mkv_stdio_sink*)cc->ptr)->mfile_handle);
+		_fseeki64(((mkv_stdio_sink*)cc->ptr)->mfile_handle, cur, SEEK_SET);
 		return size;
 	}
 	static int iowrite(OutputStream* inf, void* buffer, int count) noexcept
 	{
-		return fwrite(buffer, 1, count, ((mkv_file_sink*)inf->ptr)->mfile_handle);
+		return fwrite(buffer, 1, count, ((mkv_stdio_sink*)inf->ptr)->mfile_handle);
 	}
 	static bool_t iowritech(OutputStream* inf, int ch) noexcept
 	{
 		char temp = ch;
-		return fwrite(&temp, 1, 1, ((mkv_file_sink*)inf->ptr)->mfile_handle);
+		return fwrite(&temp, 1, 1, ((mkv_stdio_sink*)inf->ptr)->mfile_handle);
 	}
 	static void ioseek(OutputStream* inf, longlong wher, int how) noexcept
 	{
-		_fseeki64(((mkv_file_sink*)inf->ptr)->mfile_handle, wher, how);
+		_fseeki64(((mkv_stdio_sink*)inf->ptr)->mfile_handle, wher, how);
 	}
 	static filepos_t iotell(OutputStream* inf) noexcept
 	{
-		return _ftelli64(((mkv_file_sink*)inf->ptr)->mfile_handle);
+		return _ftelli64(((mkv_stdio_sink*)inf->ptr)->mfile_handle);
 	}
 	static void* memalloc(OutputStream* inf, size_t count) noexcept
 	{
@@ -263,23 +944,522 @@ private:
 	}
 	static int write(OutputStream* inf, filepos_t pos, void* buffer, size_t count) noexcept
 	{
-		__int64 cur = _ftelli64(((mkv_file_sink*)inf->ptr)->mfile_handle);
-		fseek(((mkv_file_sink*)inf->ptr)->mfile_handle, pos, SEEK_SET);
-		uint64_t write = fwrite(buffer, 1, count, ((mkv_file_sink*)inf->ptr)->mfile_handle);
-		_fseeki64(((mkv_file_sink*)inf->ptr)->mfile_handle, cur, SEEK_SET);
+		__int64 cur = _ftelli64(((mkv_stdio_sink*)inf->ptr)->mfile_handle);
+		fseek(((mkv_stdio_sink*)inf->ptr)->mfile_handle, pos, SEEK_SET);
+		uint64_t write = fwrite(buffer, 1, count, ((mkv_stdio_sink*)inf->ptr)->mfile_handle);
+		_fseeki64(((mkv_stdio_sink*)inf->ptr)->mfile_handle, cur, SEEK_SET);
 		return write;
 	}
 };
 
-mkv_sink* mkv_sink_factory::CreateFromFile(const stream_desc* tracks, size_t num, const char* path)
+//Live output, written front to back only. The muxer still writes the
+//headers (MATROSKA_OUTPUT_NOSEEK), but into memory, from where
+//begin_live takes the EBML header, Info and Tracks and gives the
+//Segment an unknown size. The Clusters are written here, as a muxed
+//cluster gets its size patched once it is complete, which a pipe
+//cannot take: each one has an unknown size and ends where the next
+//starts, at a video keyframe or after max_cluster_ms.
+class mkv_live_sink: public mkv_sink {
+	//what the muxer wrote
+	std::vector<uint8_t> header;
+	uint64_t header_pos = 0;
+	live_options live_opts;
+	FILE* out = nullptr;
+	//segmented: out is ours, one file per media segment
+	std::string segment_pattern;
+	unsigned segment_index = 0;
+	uint64_t segment_start = 0;
+	//track numbers and which tracks start clusters at their keyframes
+	std::vector<uint64_t> numbers;
+	std::vector<bool> cut_tracks;
+	bool cut_at_key = false;
+	uint64_t scale = 1000000;
+	//reused for every block
+	std::vector<uint8_t> block_head;
+	std::vector<uint8_t> track_head;
+	bool in_cluster = false;
+	//in scale units
+	uint64_t cluster_time = 0;
+	bool failed = false;
+	//frames of an audio track waiting to be laced, copied as the
+	//packets are only valid during QueueBuffer without StartAsync
+	struct pending_lace {
+		std::vector<uint8_t> data;
+		std::vector<uint32_t> sizes;
+		//scale units, of the first and the last frame
+		uint64_t time = 0;
+		uint64_t last_time = 0;
+		uint64_t last_duration = 0;
+		bool key = true;
+	};
+	std::vector<pending_lace> laces;
+	std::vector<uint8_t> lace_head;
+	output_stats stats;
+protected:
+friend mkv_sink_factory;
+	mkv_live_sink(const live_options& options):live_opts(options) {
+		lace_audio = options.lacing != live_options::LACING_NONE;
+		ostream.geterror = geterror;
+		ostream.getfilesize = getfilesize;
+		ostream.iowrite = iowrite;
+		ostream.iowritech = iowritech;
+		ostream.ioseek = ioseek;
+		ostream.iotell = iotell;
+		ostream.memalloc = memalloc;
+		ostream.memfree = memfree;
+		ostream.memrealloc = memrealloc;
+		ostream.progress = progress;
+		ostream.write = write;
+	}
+	//writes the init part, to init_path if segmented
+	bool begin_live(const char* init_path);
+	void put(const void* data, size_t count, bool payload = false)
+	{
+		if (out && fwrite(data, 1, count, out) != count)
+			failed = true;
+		++stats.writes;
+		(payload ? stats.payload_bytes : stats.overhead_bytes) += count;
+	}
+	bool next_segment();
+	void start_cluster(uint64_t time, bool at_key);
+	void write_lace(pending_lace& lace, uint64_t number);
+	virtual void write_frame(const _buffer_desc& buffer) override final;
+public:
+	virtual const output_stats* GetOutputStats() const override final
+	{
+		return &stats;
+	}
+	virtual ~mkv_live_sink() override final
+	{
+		if (writing)
+			Flush();
+		mkv_CloseOutput(file);
+		file = nullptr;
+		if (out && !segment_pattern.empty())
+			fclose(out);
+		out = nullptr;
+	}
+	virtual int AllocBuffer(_buffer_desc& buffer) override final
+	{
+		return E_PROTOCOL_MISMATCH;
+	}
+protected:
+	//the laces go in the cluster that is ending
+	virtual bool flush_output() override final
+	{
+		if (in_cluster) {
+			for (size_t i = 0; i < laces.size(); ++i)
+				write_lace(laces[i], numbers[i]);
+		}
+		if (out && fflush(out))
+			failed = true;
+		return !failed;
+	}
+	virtual size_t read_output(uint64_t pos, void* buffer, size_t count) override final
+	{
+		if (pos >= header.size())
+			return 0;
+		size_t read = header.size() - pos < count ? (size_t)(header.size() - pos) : count;
+		memcpy(buffer, &header[(size_t)pos], read);
+		return read;
+	}
+
+private:
+	static const char* geterror(OutputStream* cc) noexcept
+	{
+		return "dummy error";
+	}
+	static filepos_t getfilesize(OutputStream* cc) noexcept
+	{
+		return ((mkv_live_sink*)cc->ptr)->header.size();
+	}
+	static int iowrite(OutputStream* inf, void* buffer, int count) noexcept
+	{
+		mkv_live_sink* sink = (mkv_live_sink*)inf->ptr;
+		write(inf, sink->header_pos, buffer, count);
+		sink->header_pos += count;
+		return count;
+	}
+	static bool_t iowritech(OutputStream* inf, int ch) noexcept
+	{
+		uint8_t byte = (uint8_t)ch;
+		return iowrite(inf, &byte, 1) == 1;
+	}
+	static void ioseek(OutputStream* inf, longlong wher, int how) noexcept
+	{
+		mkv_live_sink* sink = (mkv_live_sink*)inf->ptr;
+		switch (how) {
+			case SEEK_CUR:
+				wher += sink->header_pos;
+				break;
+			case SEEK_END:
+				wher += sink->header.size();
+				break;
+		}
+		sink->header_pos = wher < 0 ? 0 : wher;
+	}
+	static filepos_t iotell(OutputStream* inf) noexcept
+	{
+		return ((mkv_live_sink*)inf->ptr)->header_pos;
+	}
+	static void* memalloc(OutputStream* inf, size_t count) noexcept
+	{
+		return malloc(count);
+	}
+	static void memfree(OutputStream* inf, void* mem) noexcept
+	{
+		free(mem);
+	}
+	static void* memrealloc(OutputStream* inf, void* mem, size_t count) noexcept
+	{
+		return realloc(mem, count);
+	}
+	static int progress(OutputStream* inf, filepos_t cur, filepos_t max) noexcept
+	{
+		return 0;
+	}
+	static int write(OutputStream* inf, filepos_t pos, void* buffer, size_t count) noexcept
+	{
+		std::vector<uint8_t>& header = ((mkv_live_sink*)inf->ptr)->header;
+		if (pos + count > header.size())
+			header.resize((size_t)(pos + count));
+		memcpy(&header[(size_t)pos], buffer, count);
+		return (int)count;
+	}
+};
+
+bool mkv_live_sink::begin_live(const char* init_path)
+{
+	uint32_t id;
+	uint64_t size;
+	size_t size_len;
+	size_t head_len = get_head(header.data(), header.size(), id, size, size_len);
+	if (!head_len || id != ID_EBML || size > header.size() - head_len)
+		return false;
+	std::vector<uint8_t> init(header.begin(), header.begin() + head_len + (size_t)size);
+	size_t pos = init.size();
+	head_len = get_head(header.data() + pos, header.size() - pos, id, size, size_len);
+	if (!head_len || id != ID_SEGMENT)
+		return false;
+	put_id(init, ID_SEGMENT);
+	init.push_back(0x01);
+	init.insert(init.end(), 7, 0xFF);
+	//Info without a Duration, and Tracks, the SeekHead and Voids are of
+	//no use without seeking
+	for (pos += head_len; pos < header.size();) {
+		head_len = get_head(header.data() + pos, header.size() - pos, id, size, size_len);
+		if (!head_len || id == ID_CLUSTER || unknown_size(size, size_len) || size > header.size() - pos - head_len)
+			break;
+		uint8_t* body = header.data() + pos + head_len;
+		if (id == ID_INFO) {
+			for (size_t at = 0; at < size;) {
+				uint32_t child;
+				uint64_t child_size;
+				size_t child_len;
+				size_t child_head = get_head(body + at, (size_t)size - at, child, child_size, child_len);
+				if (!child_head || child_size > size - at - child_head)
+					break;
+				if (child == ID_TIMECODESCALE && get_uint(body + at + child_head, child_size)) {
+					scale = get_uint(body + at + child_head, child_size);
+				}
+				else if (child == ID_DURATION) {
+					//a Void of the same length keeps the sizes around it
+					std::vector<uint8_t> blank;
+					put_void(blank, child_head + (size_t)child_size);
+					memcpy(body + at, blank.data(), blank.size());
+				}
+				at += child_head + (size_t)child_size;
+			}
+		}
+		else if (id == ID_TRACKS) {
+			for_children(body, (size_t)size, [&](uint32_t id, const uint8_t* data, uint64_t size) {
+				if (id != ID_TRACKENTRY)
+					return;
+				for_children(data, (size_t)size, [&](uint32_t id, const uint8_t* data, uint64_t size) {
+					if (id == ID_TRACKNUMBER)
+						numbers.push_back(get_uint(data, size));
+				});
+			});
+		}
+		if (id == ID_INFO || id == ID_TRACKS)
+			init.insert(init.end(), header.begin() + pos, header.begin() + pos + head_len + (size_t)size);
+		pos += head_len + (size_t)size;
+	}
+	if (numbers.size() != track_count)
+		return false;
+	bool has_video = std::find(video_tracks.begin(), video_tracks.end(), true) != video_tracks.end();
+	cut_tracks = has_video ? video_tracks : std::vector<bool>(track_count, false);
+	cut_at_key = has_video;
+	if (live_opts.lacing != live_options::LACING_NONE)
+		laces.resize(track_count);
+	if (init_path) {
+		FILE* init_file = fopen(init_path, "wb");
+		if (!init_file)
+			return false;
+		bool done = fwrite(init.data(), 1, init.size(), init_file) == init.size();
+		++stats.writes;
+		stats.overhead_bytes += init.size();
+		return fclose(init_file) == 0 && done;
+	}
+	put(init.data(), init.size());
+	flush_output();
+	return !failed;
+}
+
+bool mkv_live_sink::next_segment()
+{
+	if (out)
+		fclose(out);
+	char path[1024];
+	snprintf(path, sizeof(path), segment_pattern.c_str(), segment_index++);
+	out = fopen(path, "wb");
+	if (!out)
+		failed = true;
+	return out != nullptr;
+}
+
+void mkv_live_sink::start_cluster(uint64_t time, bool at_key)
+{
+	//the cluster before is complete
+	if (in_cluster)
+		flush_output();
+	if (!segment_pattern.empty()) {
+		uint64_t now = time * scale;
+		if (!out || ((at_key || !cut_at_key) && now - segment_start >= (uint64_t)live_opts.segment_ms * 1000000)) {
+			segment_start = now;
+			if (!next_segment())
+				return;
+		}
+	}
+	std::vector<uint8_t> cluster;
+	put_id(cluster, ID_CLUSTER);
+	cluster.push_back(0x01);
+	cluster.insert(cluster.end(), 7, 0xFF);
+	put_uint(cluster, ID_TIMECODE, time);
+	put(cluster.data(), cluster.size());
+	in_cluster = true;
+	cluster_time = time;
+}
+
+//A Block in a BlockGroup, whose BlockDuration tells readers how to
+//spread the timestamps over the frames, or a SimpleBlock for one frame.
+void mkv_live_sink::write_lace(pending_lace& lace, uint64_t number)
+{
+	size_t count = lace.sizes.size();
+	if (!count)
+		return;
+	int64_t relative = (int64_t)(lace.time - cluster_time);
+	track_head.clear();
+	put_size(track_head, number);
+	track_head.push_back((uint8_t)(relative >> 8));
+	track_head.push_back((uint8_t)relative);
+	lace_head.clear();
+	if (count == 1) {
+		track_head.push_back(lace.key ? 0x80 : 0);
+	}
+	else {
+		bool fixed = std::all_of(lace.sizes.begin(), lace.sizes.end(), [&](uint32_t size) { return size == lace.sizes[0]; });
+		live_options::lacing_mode mode = live_opts.lacing;
+		if (fixed && (mode == live_options::LACING_FIXED || mode == live_options::LACING_AUTO)) {
+			mode = live_options::LACING_FIXED;
+		}
+		else if (mode != live_options::LACING_XIPH) {
+			//the EBML sizes, kept if they are the smaller or asked for
+			lace_head.push_back((uint8_t)(count - 1));
+			put_size(lace_head, lace.sizes[0]);
+			for (size_t i = 1; i + 1 < count; ++i) {
+				int64_t diff = (int64_t)lace.sizes[i] - lace.sizes[i - 1];
+				//signed: biased by half the range of the length, the
+				//all ones value stays reserved
+				size_t len = 1;
+				while (len < 8 && (diff > (int64_t(1) << (7 * len - 1)) - 1 || diff < -((int64_t(1) << (7 * len - 1)) - 1)))
+					++len;
+				put_size(lace_head, (uint64_t)(diff + (int64_t(1) << (7 * len - 1)) - 1), len);
+			}
+			mode = live_options::LACING_EBML;
+			if (live_opts.lacing == live_options::LACING_AUTO) {
+				size_t xiph = 1;
+				for (size_t i = 0; i + 1 < count; ++i)
+					xiph += lace.sizes[i] / 255 + 1;
+				if (xiph < lace_head.size())
+					mode = live_options::LACING_XIPH;
+			}
+		}
+		if (mode != live_options::LACING_EBML) {
+			lace_head.clear();
+			lace_head.push_back((uint8_t)(count - 1));
+		}
+		if (mode == live_options::LACING_XIPH) {
+			for (size_t i = 0; i + 1 < count; ++i) {
+				uint32_t size = lace.sizes[i];
+				for (; size >= 255; size -= 255)
+					lace_head.push_back(255);
+				lace_head.push_back((uint8_t)size);
+			}
+		}
+		track_head.push_back(mode == live_options::LACING_XIPH ? 0x02 : mode == live_options::LACING_FIXED ? 0x04 : 0x06);
+	}
+	size_t block = track_head.size() + lace_head.size() + lace.data.size();
+	block_head.clear();
+	if (count == 1) {
+		put_id(block_head, ID_SIMPLEBLOCK);
+		put_size(block_head, block);
+	}
+	else {
+		//the BlockDuration first, so the payload ends the group
+		std::vector<uint8_t> duration;
+		put_uint(duration, ID_BLOCKDURATION, lace.last_time - lace.time + lace.last_duration);
+		std::vector<uint8_t> block_size;
+		put_size(block_size, block);
+		put_id(block_head, ID_BLOCKGROUP);
+		put_size(block_head, duration.size() + 1 + block_size.size() + block);
+		block_head.insert(block_head.end(), duration.begin(), duration.end());
+		put_id(block_head, ID_BLOCK);
+		block_head.insert(block_head.end(), block_size.begin(), block_size.end());
+	}
+	block_head.insert(block_head.end(), track_head.begin(), track_head.end());
+	block_head.insert(block_head.end(), lace_head.begin(), lace_head.end());
+	put(block_head.data(), block_head.size());
+	put(lace.data.data(), lace.data.size(), true);
+	++stats.blocks;
+	lace.data.clear();
+	lace.sizes.clear();
+}
+
+void mkv_live_sink::write_frame(const _buffer_desc& buffer)
 {
-	mkv_file_sink* rtn = new mkv_file_sink(path);
+	uint32_t track = buffer.detail.pkt.track;
+	if (track >= numbers.size() || failed)
+		return;
+	uint64_t time = buffer.start_timestamp / scale;
+	int64_t relative = (int64_t)(time - cluster_time);
+	bool at_key = buffer.detail.pkt.key_frame && cut_tracks[track];
+	//block timecodes are signed 16 bit relative to the cluster
+	if (!in_cluster || at_key || relative < -32768 || relative > 32767 ||
+		relative >= (int64_t)((uint64_t)live_opts.max_cluster_ms * 1000000 / scale)) {
+		start_cluster(time, at_key);
+		if (failed)
+			return;
+		relative = 0;
+	}
+	++stats.frames;
+	if (!laces.empty() && !video_tracks[track]) {
+		pending_lace& lace = laces[track];
+		uint64_t max_ticks = (uint64_t)live_opts.lace_ms * 1000000 / scale;
+		//256 frames at most, the count is a byte
+		if (!lace.sizes.empty() && (time - lace.time >= max_ticks || lace.sizes.size() == 256))
+			write_lace(lace, numbers[track]);
+		if (lace.sizes.empty()) {
+			lace.time = time;
+			lace.key = true;
+		}
+		uint64_t end = buffer.end_timestamp / scale;
+		//the spacing so far for frames without a duration
+		lace.last_duration = end > time ? end - time :
+			lace.sizes.size() > 0 ? (time - lace.time) / lace.sizes.size() : 0;
+		lace.last_time = time;
+		lace.key &= buffer.detail.pkt.key_frame != 0;
+		lace.sizes.push_back(buffer.detail.pkt.size);
+		const uint8_t* data = (const uint8_t*)buffer.detail.pkt.data;
+		lace.data.insert(lace.data.end(), data, data + buffer.detail.pkt.size);
+		return;
+	}
+	++stats.blocks;
+	track_head.clear();
+	put_size(track_head, numbers[track]);
+	block_head.clear();
+	put_id(block_head, ID_SIMPLEBLOCK);
+	put_size(block_head, track_head.size() + 3 + buffer.detail.pkt.size);
+	block_head.insert(block_head.end(), track_head.begin(), track_head.end());
+	block_head.push_back((uint8_t)(relative >> 8));
+	block_head.push_back((uint8_t)relative);
+	block_head.push_back(buffer.detail.pkt.key_frame ? 0x80 : 0);
+	put(block_head.data(), block_head.size());
+	put(buffer.detail.pkt.data, buffer.detail.pkt.size, true);
+	//the cluster is not over, so only the stdio buffer
+	if (live_opts.flush_frames && out)
+		fflush(out);
+}
+
+mkv_sink* mkv_sink_factory::CreateFromFile(const stream_desc* tracks, size_t num, const char* path, uint64_t expected_size)
+{
+	mkv_sink::output_options options;
+	options.expected_size = expected_size;
+	return CreateFromFile(tracks, num, path, options);
+}
+
+mkv_sink* mkv_sink_factory::CreateFromFile(const stream_desc* tracks, size_t num, const char* path, const mkv_sink::output_options& options)
+{
+	mkv_file_sink* rtn = new mkv_file_sink(path, options.expected_size);
+	if (!rtn->writer.is_open()) {
+		delete rtn;
+		return nullptr;
+	}
+	rtn->out_opts = options;
 	rtn->finish_init();
-	for (int i = 0; i < num; ++i) {
+	for (size_t i = 0; i < num; ++i) {
 		rtn->AddTrack(tracks[i]);
 	}
 	rtn->write_headers();
 //		NodeContext_Init(&ctx, NULL, NULL, NULL);
 
 	return rtn;
-}
\ No newline at end of file
+}
+
+mkv_sink* mkv_sink_factory::CreateFromFileStdio(const stream_desc* tracks, size_t num, const char* path)
+{
+	return CreateFromFileStdio(tracks, num, path, mkv_sink::output_options());
+}
+
+mkv_sink* mkv_sink_factory::CreateFromFileStdio(const stream_desc* tracks, size_t num, const char* path, const mkv_sink::output_options& options)
+{
+	mkv_stdio_sink* rtn = new mkv_stdio_sink(path);
+	if (!rtn->mfile_handle) {
+		delete rtn;
+		return nullptr;
+	}
+	rtn->out_opts = options;
+	rtn->finish_init();
+	for (size_t i = 0; i < num; ++i) {
+		rtn->AddTrack(tracks[i]);
+	}
+	rtn->write_headers();
+	return rtn;
+}
+
+mkv_sink* mkv_sink_factory::CreateLive(const stream_desc* tracks, size_t num, FILE* out, const mkv_sink::live_options& options)
+{
+	mkv_live_sink* rtn = new mkv_live_sink(options);
+	rtn->out = out;
+	rtn->finish_init();
+	for (size_t i = 0; i < num; ++i) {
+		rtn->AddTrack(tracks[i]);
+	}
+	rtn->write_headers();
+	if (!rtn->begin_live(nullptr)) {
+		//nothing to end, out is the caller's
+		rtn->writing = false;
+		rtn->out = nullptr;
+		delete rtn;
+		return nullptr;
+	}
+	return rtn;
+}
+
+mkv_sink* mkv_sink_factory::CreateSegmented(const stream_desc* tracks, size_t num, const char* init_path, const char* segment_pattern,
+	const mkv_sink::live_options& options)
+{
+	mkv_live_sink* rtn = new mkv_live_sink(options);
+	rtn->segment_pattern = segment_pattern;
+	rtn->finish_init();
+	for (size_t i = 0; i < num; ++i) {
+		rtn->AddTrack(tracks[i]);
+	}
+	rtn->write_headers();
+	if (!rtn->begin_live(init_path)) {
+		rtn->writing = false;
+		delete rtn;
+		return nullptr;
+	}
+	return rtn;
+}
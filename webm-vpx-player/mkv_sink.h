@@ -2,6 +2,14 @@
 
 #include "media_sink.h"
 
+#include <cstdio>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <rigtorp/SPSCQueue.h>
 #include <matroska/MatroskaWriter.h>
 
 class mkv_sink_factory;
@@ -11,24 +19,176 @@ class mkv_sink_factory;
 //_buffer_desc.data2: track
 //_buffer_desc.data3: keyframe
 class mkv_sink:	public media_sink {
+public:
+	struct output_options {
+		//preallocated if known, so the file is laid out in one piece
+		//(buffered_writer only)
+		uint64_t expected_size = 0;
+		//records the keyframes of the video tracks (of every track
+		//without video) and writes Cues and a SeekHead on Flush,
+		//so seeks into the file do not have to scan it
+		bool cues = false;
+		//bytes reserved after the headers to put the Cues in front of
+		//the clusters, if they do not fit they follow the last cluster
+		size_t cue_reserve = 0;
+		//no lacing here: the muxer puts every frame it is given in a
+		//block of its own and cannot append to a block, laced output
+		//is written by the live sinks (CreateLive on a file works too)
+	};
+	//see mkv_sink_factory::CreateLive
+	struct live_options {
+		//clusters start at video keyframes, and at the latest after this
+		//(only after this without video)
+		unsigned max_cluster_ms = 1000;
+		//segmented output: a new media segment at the first cluster
+		//starting at a video keyframe after this
+		unsigned segment_ms = 4000;
+		//flush after every frame instead of after every cluster
+		bool flush_frames = false;
+		//the frames of each audio track laced into blocks of up to
+		//lace_ms, to save the block headers and writes of short frames
+		enum lacing_mode {
+			LACING_NONE,
+			LACING_XIPH,
+			LACING_EBML,
+			//where the frames of a block are the same size, EBML otherwise
+			LACING_FIXED,
+			//fixed where possible, else the smaller of Xiph and EBML
+			LACING_AUTO
+		} lacing = LACING_NONE;
+		unsigned lace_ms = 100;
+	};
+	struct output_stats {
+		uint64_t frames = 0;
+		//fewer than frames when lacing
+		uint64_t blocks = 0;
+		uint64_t payload_bytes = 0;
+		//everything else written: headers, clusters, block headers and lace sizes
+		uint64_t overhead_bytes = 0;
+		//calls into the output
+		uint64_t writes = 0;
+	};
 protected:
 friend mkv_sink_factory;
 	mkv_sink();
 	OutputStream ostream{};
-	nodecontext ctx{};
+	//held by this instance alone, see mkv_context
+	nodecontext* ctx = nullptr;
 	MatroskaFile* file = nullptr;
 	bool writing = false;
 protected:
+	//FlagLacing of the audio tracks, set before AddTrack
+	bool lace_audio = false;
 	int AddTrack(const stream_desc& info);
 	int write_headers();
 	int finish_init();
+	size_t track_count = 0;
+	virtual void write_frame(const _buffer_desc& buffer);
+	//pushes what the muxer wrote out to the file, after the tail;
+	//false if any write so far failed
+	virtual bool flush_output() = 0;
+	//reads back what was written so far, for write_cues
+	virtual size_t read_output(uint64_t pos, void* buffer, size_t count) = 0;
+	output_options out_opts;
+	std::vector<bool> video_tracks;
+	std::vector<bool> cued_tracks;
+	//append only, one entry per keyframe of a cued track, found
+	//in the clusters the muxer made by its place in the track on Flush
+	struct cue_key {
+		uint64_t timestamp;
+		//frames written to the track before it
+		uint64_t frame;
+		uint32_t track;
+	};
+	std::vector<cue_key> cue_keys;
+	//per track
+	std::vector<uint64_t> frames_written;
+	//EBMLVoid written after the headers, for the SeekHead and the Cues
+	uint64_t reserve_pos = 0;
+	size_t reserve_size = 0;
+	bool write_cues();
 	//	uint64_t file_pos;
 	stream_desc* desc_in;
 	size_t num_in;
 public:
 	virtual ~mkv_sink();
 	//	virtual int FetchBuffer(_buffer_desc& buffer) override final;
+	//writes the packet, or queues it once StartAsync was called
+	virtual int QueueBuffer(_buffer_desc& buffer) override final;
+	//writes whatever is queued and the tail, nothing can be queued after;
+	//E_IO_ERROR if a write failed (the file is truncated or damaged),
+	//E_NO_INDEX if output_options::cues were asked for and could
+	//not be written, the file is complete without them
+	virtual int Flush() override final;
+	struct async_options {
+		//payload bytes queued before the overflow policy applies,
+		//a packet on its own is always taken
+		size_t max_bytes = 64 * 1024 * 1024;
+		//packets queued per track
+		size_t max_packets = 1024;
+		enum overflow_policy {
+			//QueueBuffer waits for the writer to catch up
+			OVERFLOW_BLOCK,
+			//the packet is dropped, and its track's packets
+			//with it up to the next keyframe
+			OVERFLOW_DROP
+		} overflow = OVERFLOW_BLOCK;
+		//how long the writer holds the queued packets back for a
+		//track that has none queued, to write them in timestamp order
+		unsigned interleave_ms = 200;
+	};
+	struct async_stats {
+		std::atomic<uint64_t> queued{0};
+		std::atomic<uint64_t> written{0};
+		std::atomic<uint64_t> dropped{0};
+		//time QueueBuffer spent waiting on a full queue
+		std::atomic<uint64_t> blocked_ns{0};
+	};
+	//MODE_UP_NOTIFY_DOWN: from now on QueueBuffer takes a ref on the
+	//packet, queues it and returns, and a writer thread muxes the
+	//tracks interleaved by timestamp. For a realtime producer whose
+	//packets must not wait on the disk. Calls to QueueBuffer must be
+	//serialized. Call once, after the headers are written.
+	virtual int StartAsync(const async_options& options);
+	//null unless StartAsync was called
+	virtual const async_stats* GetAsyncStats() const
+	{
+		return async ? &counters : nullptr;
+	}
+	//null where not counted (only the live output counts),
+	//up to date once Flush returned
+	virtual const output_stats* GetOutputStats() const
+	{
+		return nullptr;
+	}
 protected:
+	//one producer (the serialized QueueBuffer), one consumer (the writer)
+	struct track_queue {
+		rigtorp::SPSCQueue<_buffer_desc> packets;
+		//dropping until a keyframe, producer side only
+		bool drop_to_keyframe = false;
+		//writer side only: empty for a whole interleave_ms, taken as
+		//ended and not waited for until it has a packet again
+		bool idle = false;
+		track_queue(size_t capacity):packets(capacity) {}
+	};
+	std::vector<std::unique_ptr<track_queue>> queues;
+	bool async = false;
+	async_options async_opts;
+	async_stats counters;
+	std::atomic<size_t> queued_bytes{0};
+	std::thread async_writer;
+	std::mutex async_mtx;
+	//the writer waits for packets, the producer for room
+	std::condition_variable packets_cond;
+	std::condition_variable room_cond;
+	std::atomic<bool> writer_waiting{false};
+	std::atomic<bool> producer_waiting{false};
+	std::atomic<bool> stopping{false};
+	int push(_buffer_desc& buffer);
+	_buffer_desc* pick(bool& all_tracks);
+	void writer_proc();
+	void stop_async();
 	virtual int GetInputs(stream_desc *& desc, size_t& num) override final
 	{
 		desc = desc_in;
@@ -39,6 +199,25 @@ protected:
 
 class mkv_sink_factory {
 public:
-	static mkv_sink* CreateFromFile(const stream_desc* tracks, size_t num, const char* path);
+	//buffered, see buffered_writer. expected_size, if known,
+	//is preallocated so the file is laid out in one piece.
+	//These return null if the file cannot be opened.
+	static mkv_sink* CreateFromFile(const stream_desc* tracks, size_t num, const char* path, uint64_t expected_size = 0);
+	static mkv_sink* CreateFromFile(const stream_desc* tracks, size_t num, const char* path, const mkv_sink::output_options& options);
+	//through stdio, as before the buffered writer
+	static mkv_sink* CreateFromFileStdio(const stream_desc* tracks, size_t num, const char* path);
+	static mkv_sink* CreateFromFileStdio(const stream_desc* tracks, size_t num, const char* path, const mkv_sink::output_options& options);
+	//Live output that never seeks back, for a pipe or a growing file:
+	//unknown sized Segment and Clusters, each Cluster flushed as soon
+	//as the next one starts. out is not closed (set binary mode on
+	//windows). Null if the headers cannot be written to out.
+	static mkv_sink* CreateLive(const stream_desc* tracks, size_t num, FILE* out, const mkv_sink::live_options& options);
+	//Live output split for DASH/MSE style players: the EBML header,
+	//Segment, Info and Tracks go to init_path, the Clusters to media
+	//segments named by the printf pattern with the segment number
+	//(e.g. "chunk%05u.webm"), each starting at a video keyframe.
+	//Null if the init segment cannot be written.
+	static mkv_sink* CreateSegmented(const stream_desc* tracks, size_t num, const char* init_path, const char* segment_pattern,
+		const mkv_sink::live_options& options);
 };
 
@@ -1,23 +1,26 @@
 #include "mkv_source.h"
 #include "media_buffer.h"
+#include "file_io.h"
+#include "packet_pool.h"
+#include "webm_demux.h"
+#include "mkv_context.h"
 
 #include <cstdio>
 #include <cstdlib>
 #include <vector>
+#include <memory>
 #include <matroska/matroska2.h>
 #include <atomic>
 #include <cassert>
+#include <string>
 
-mkv_source::mkv_source()
+mkv_source::mkv_source(bool use_parser):
+	registered(use_parser)
 {
-	NodeContext_Init(&ctx, nullptr, nullptr, nullptr);
 	istream.ptr = this;
-	istream.AnyNode = &ctx;
-	EBML_RegisterAll((nodemodule*)&ctx);
-	MATROSKA_RegisterAll((nodemodule*)&ctx);
-	MATROSKA_Init(&ctx);
-	NodeRegisterClassEx((nodemodule*)&ctx, HaaliStream_Class);
-	NodeRegisterClassEx((nodemodule*)&ctx, WriteStream_Class);
+	if (registered)
+		ctx = mkv_context::acquire();
+	istream.AnyNode = ctx;
 }
 
 int mkv_source::finish_init()
@@ -28,168 +31,747 @@ int mkv_source::finish_init()
 	if (!file) {
 		return 1;
 	}
-	num_out = mkv_GetNumTracks(file);
+	init_outputs(mkv_GetNumTracks(file));
+	for (size_t i = 0; i < num_out; ++i)
+		describe_track(i, mkv_GetTrackInfo(file, i));
+	istream.progress(&istream, file->pFirstCluster, 0);
+//	file_pos = file->pFirstCluster;
+	return 0;
+}
+
+void mkv_source::init_outputs(size_t count)
+{
+	num_out = count;
 	desc_out = new stream_desc[num_out]();
-	for (size_t i = 0; i < num_out; ++i) {
-		desc_out[i].mode = stream_desc::MODE_DOWN_NOTIFY_UP;
-		TrackInfo* info = mkv_GetTrackInfo(file,i);
-		if (info->Type == TRACK_TYPE_VIDEO) {
-			desc_out[i].type = stream_desc::MTYPE_VIDEO;
-			stream_desc::video_info oinfo{};
-			oinfo.width = info->AV.Video.PixelWidth;
-			oinfo.height = info->AV.Video.PixelHeight;
-			oinfo.fmt.subsample_horiz = 1;
-			oinfo.fmt.subsample_vert = 1;
-			oinfo.fmt.bitdepth = 8;
-			if (info->AV.Video.Colour.CbSubsamplingHorz || info->AV.Video.Colour.CbSubsamplingVert ||
-				info->AV.Video.Colour.ChromaSubsamplingHorz || info->AV.Video.Colour.ChromaSubsamplingVert) {
-				if (!info->AV.Video.Colour.CbSubsamplingHorz && info->AV.Video.Colour.ChromaSubsamplingHorz)
-					info->AV.Video.Colour.CbSubsamplingHorz = info->AV.Video.Colour.ChromaSubsamplingHorz;
-				if (!info->AV.Video.Colour.ChromaSubsamplingHorz && info->AV.Video.Colour.CbSubsamplingHorz)
-					info->AV.Video.Colour.ChromaSubsamplingHorz = info->AV.Video.Colour.CbSubsamplingHorz;
-				if (!info->AV.Video.Colour.CbSubsamplingVert && info->AV.Video.Colour.ChromaSubsamplingVert)
-					info->AV.Video.Colour.CbSubsamplingVert = info->AV.Video.Colour.ChromaSubsamplingVert;
-				if (!info->AV.Video.Colour.ChromaSubsamplingVert && info->AV.Video.Colour.CbSubsamplingVert)
-					info->AV.Video.Colour.ChromaSubsamplingVert = info->AV.Video.Colour.CbSubsamplingVert;
-				if ((info->AV.Video.Colour.CbSubsamplingHorz != info->AV.Video.Colour.ChromaSubsamplingHorz) ||
-					info->AV.Video.Colour.CbSubsamplingVert != info->AV.Video.Colour.CbSubsamplingVert) {
-					//not matching uv subsampling, defaulting to 420, although it still should be decodable.
+	tracks.assign(num_out, track_state{});
+	reset_queues();
+	codec_privates.resize(num_out);
+	track_names.resize(num_out);
+}
+
+//fills output i, info may be adjusted on the way
+void mkv_source::describe_track(size_t i, TrackInfo* info)
+{
+	desc_out[i].mode = stream_desc::MODE_DOWN_NOTIFY_UP;
+	if (info->Type == TRACK_TYPE_VIDEO) {
+		desc_out[i].type = stream_desc::MTYPE_VIDEO;
+		stream_desc::video_info oinfo{};
+		oinfo.width = info->AV.Video.PixelWidth;
+		oinfo.height = info->AV.Video.PixelHeight;
+		oinfo.fmt.subsample_horiz = 1;
+		oinfo.fmt.subsample_vert = 1;
+		oinfo.fmt.bitdepth = 8;
+		if (info->AV.Video.Colour.CbSubsamplingHorz || info->AV.Video.Colour.CbSubsamplingVert ||
+			info->AV.Video.Colour.ChromaSubsamplingHorz || info->AV.Video.Colour.ChromaSubsamplingVert) {
+			if (!info->AV.Video.Colour.CbSubsamplingHorz && info->AV.Video.Colour.ChromaSubsamplingHorz)
+				info->AV.Video.Colour.CbSubsamplingHorz = info->AV.Video.Colour.ChromaSubsamplingHorz;
+			if (!info->AV.Video.Colour.ChromaSubsamplingHorz && info->AV.Video.Colour.CbSubsamplingHorz)
+				info->AV.Video.Colour.ChromaSubsamplingHorz = info->AV.Video.Colour.CbSubsamplingHorz;
+			if (!info->AV.Video.Colour.CbSubsamplingVert && info->AV.Video.Colour.ChromaSubsamplingVert)
+				info->AV.Video.Colour.CbSubsamplingVert = info->AV.Video.Colour.ChromaSubsamplingVert;
+			if (!info->AV.Video.Colour.ChromaSubsamplingVert && info->AV.Video.Colour.CbSubsamplingVert)
+				info->AV.Video.Colour.ChromaSubsamplingVert = info->AV.Video.Colour.CbSubsamplingVert;
+			if ((info->AV.Video.Colour.CbSubsamplingHorz != info->AV.Video.Colour.ChromaSubsamplingHorz) ||
+				info->AV.Video.Colour.CbSubsamplingVert != info->AV.Video.Colour.CbSubsamplingVert) {
+				//not matching uv subsampling, defaulting to 420, although it still should be decodable.
+			}
+			else {
+				//only 2-1 subsampling supported
+				if (info->AV.Video.Colour.CbSubsamplingHorz) {
+					info->AV.Video.Colour.CbSubsamplingHorz = 1;
+					info->AV.Video.Colour.ChromaSubsamplingHorz = 1;
 				}
-				else {
-					//only 2-1 subsampling supported
-					if (info->AV.Video.Colour.CbSubsamplingHorz) {
-						info->AV.Video.Colour.CbSubsamplingHorz = 1;
-						info->AV.Video.Colour.ChromaSubsamplingHorz = 1;
-					}
-					if (info->AV.Video.Colour.CbSubsamplingVert) {
-						info->AV.Video.Colour.CbSubsamplingVert = 1;
-						info->AV.Video.Colour.ChromaSubsamplingVert = 1;
-					}
+				if (info->AV.Video.Colour.CbSubsamplingVert) {
+					info->AV.Video.Colour.CbSubsamplingVert = 1;
+					info->AV.Video.Colour.ChromaSubsamplingVert = 1;
 				}
-				oinfo.fmt.subsample_horiz = info->AV.Video.Colour.CbSubsamplingHorz;
-				oinfo.fmt.subsample_vert = info->AV.Video.Colour.CbSubsamplingVert;
-			}
-			if (info->AV.Video.Colour.BitsPerChannel) {
-				oinfo.fmt.bitdepth = info->AV.Video.Colour.BitsPerChannel;
-				oinfo.fmt.bitdepth = info->AV.Video.Colour.BitsPerChannel;
-			}
-			if (info->AV.Video.Colour.ChromaSitingHorz && info->AV.Video.Colour.ChromaSitingVert) {
-				oinfo.fmt.location = SUBSAMP_LEFT_CORNER;
-			}
-			if (strcmp(info->CodecID, "V_VP9") == 0) {
-				oinfo.codec = stream_desc::video_info::VCODEC_VP9;
-				//decoder creation is defered to topology building
-				//decoders[i] = new libvpx_vp9_decoder(sinfo, oinfo, 4);
-				desc_out[i].detail = std::move(stream_desc::detailed_info(oinfo));
 			}
+			oinfo.fmt.subsample_horiz = info->AV.Video.Colour.CbSubsamplingHorz;
+			oinfo.fmt.subsample_vert = info->AV.Video.Colour.CbSubsamplingVert;
 		}
-		if (info->Type == TRACK_TYPE_AUDIO) {
-			desc_out[i].type = stream_desc::MTYPE_AUDIO;
-			stream_desc::audio_info oinfo;
-			if (info->AV.Audio.SamplingFreq) {
-				oinfo.Hz = info->AV.Audio.SamplingFreq;
-			}
-			if (info->AV.Audio.OutputSamplingFreq) {
-				oinfo.Hz = info->AV.Audio.OutputSamplingFreq;
-			}
-			switch (info->AV.Audio.Channels) {
-				case 0:
-					oinfo.layout = *stream_desc::audio_info::GetBuiltinLayoutFromType(stream_desc::audio_info::CH_LAYOUT_STEREO);
-					break;
-				case 1:
-					oinfo.layout = *stream_desc::audio_info::GetBuiltinLayoutFromType(stream_desc::audio_info::CH_LAYOUT_MONO);
-					break;
-				case 2:
-					oinfo.layout = *stream_desc::audio_info::GetBuiltinLayoutFromType(stream_desc::audio_info::CH_LAYOUT_STEREO);
-					break;
-				default:
-					oinfo.layout = *stream_desc::audio_info::GetBuiltinLayoutFromType(stream_desc::audio_info::CH_LAYOUT_STEREO);
-			}
-			if (strcmp(info->CodecID, "A_OPUS") == 0) {
-				oinfo.Hz = 48000;
+		if (info->AV.Video.Colour.BitsPerChannel) {
+			oinfo.fmt.bitdepth = info->AV.Video.Colour.BitsPerChannel;
+			oinfo.fmt.bitdepth = info->AV.Video.Colour.BitsPerChannel;
+		}
+		if (info->AV.Video.Colour.ChromaSitingHorz && info->AV.Video.Colour.ChromaSitingVert) {
+			oinfo.fmt.location = SUBSAMP_LEFT_CORNER;
+		}
+		if (strcmp(info->CodecID, "V_VP9") == 0) {
+			oinfo.codec = stream_desc::video_info::VCODEC_VP9;
+			//decoder creation is defered to topology building
+			//decoders[i] = new libvpx_vp9_decoder(sinfo, oinfo, 4);
+			desc_out[i].detail = std::move(stream_desc::detailed_info(oinfo));
+		}
+	}
+	if (info->Type == TRACK_TYPE_AUDIO) {
+		desc_out[i].type = stream_desc::MTYPE_AUDIO;
+		stream_desc::audio_info oinfo;
+		if (info->AV.Audio.SamplingFreq) {
+			oinfo.Hz = info->AV.Audio.SamplingFreq;
+		}
+		if (info->AV.Audio.OutputSamplingFreq) {
+			oinfo.Hz = info->AV.Audio.OutputSamplingFreq;
+		}
+		switch (info->AV.Audio.Channels) {
+			case 0:
 				oinfo.layout = *stream_desc::audio_info::GetBuiltinLayoutFromType(stream_desc::audio_info::CH_LAYOUT_STEREO);
-				oinfo.matrix = stream_desc::audio_info::MATRIX_ENCODING_NONE;
-				oinfo.planar = false;
-				oinfo.codec = stream_desc::audio_info::ACODEC_OPUS;
-				//decoder creation is defered to topology building
-				//decoders[i] = new libopus_opus_decoder(sinfo, sinfo);
-				desc_out[i].detail = std::move(stream_desc::detailed_info(oinfo));
-			}
+				break;
+			case 1:
+				oinfo.layout = *stream_desc::audio_info::GetBuiltinLayoutFromType(stream_desc::audio_info::CH_LAYOUT_MONO);
+				break;
+			case 2:
+				oinfo.layout = *stream_desc::audio_info::GetBuiltinLayoutFromType(stream_desc::audio_info::CH_LAYOUT_STEREO);
+				break;
+			default:
+				oinfo.layout = *stream_desc::audio_info::GetBuiltinLayoutFromType(stream_desc::audio_info::CH_LAYOUT_STEREO);
+		}
+		if (strcmp(info->CodecID, "A_OPUS") == 0) {
+			oinfo.Hz = 48000;
+			oinfo.layout = *stream_desc::audio_info::GetBuiltinLayoutFromType(stream_desc::audio_info::CH_LAYOUT_STEREO);
+			oinfo.matrix = stream_desc::audio_info::MATRIX_ENCODING_NONE;
+			oinfo.planar = false;
+			oinfo.codec = stream_desc::audio_info::ACODEC_OPUS;
+			//decoder creation is defered to topology building
+			//decoders[i] = new libopus_opus_decoder(sinfo, sinfo);
+			desc_out[i].detail = std::move(stream_desc::detailed_info(oinfo));
 		}
-		desc_out[i].upstream = desc_out[i].upstream = this;
-		desc_out[i].downstream = nullptr;
-		desc_out[i].format_info.CodecDelay = info->CodecDelay;
-		desc_out[i].format_info.CodecPrivate = info->CodecPrivate;
-		desc_out[i].format_info.CodecPrivateSize = info->CodecPrivateSize;
-		desc_out[i].format_info.meta.mkv.Default = info->Default;
-		desc_out[i].format_info.meta.mkv.Enabled = info->Enabled;
-		desc_out[i].format_info.meta.mkv.Forced = info->Forced;
-		memcpy(desc_out[i].format_info.meta.mkv.Language,info->Language,4);
-		desc_out[i].format_info.Name = info->Name;
-		desc_out[i].upstream = this;
 	}
+	desc_out[i].upstream = desc_out[i].upstream = this;
+	desc_out[i].downstream = nullptr;
+	desc_out[i].format_info.CodecDelay = info->CodecDelay;
+	if (info->CodecPrivate)
+		codec_privates[i].assign(info->CodecPrivate, info->CodecPrivate + info->CodecPrivateSize);
+	desc_out[i].format_info.CodecPrivate = info->CodecPrivate ? codec_privates[i].data() : nullptr;
+	desc_out[i].format_info.CodecPrivateSize = info->CodecPrivateSize;
+	desc_out[i].format_info.meta.mkv.Default = info->Default;
+	desc_out[i].format_info.meta.mkv.Enabled = info->Enabled;
+	desc_out[i].format_info.meta.mkv.Forced = info->Forced;
+	memcpy(desc_out[i].format_info.meta.mkv.Language,info->Language,4);
+	if (info->Name)
+		track_names[i] = info->Name;
+	desc_out[i].format_info.Name = info->Name ? &track_names[i][0] : nullptr;
+	desc_out[i].upstream = this;
+}
+
+void mkv_source::finish_open()
+{
 	istream.progress(&istream, file->pFirstCluster, 0);
-//	file_pos = file->pFirstCluster;
-	return 0;
+	file_pos = file->pFirstCluster;
 }
 
 mkv_source::~mkv_source()
 {
+	drop_parked();
+	drop_refused();
 	delete[] desc_out;
-	mkv_CloseInput(file);
-	MATROSKA_Done(&ctx);
-	MATROSKA_UnRegisterAll((nodemodule*)&ctx);
-	EBML_UnRegisterAll((nodemodule*)&ctx);
-	NodeContext_Done(&ctx);
+	if (file)
+		mkv_CloseInput(file);
+	if (registered)
+		mkv_context::release(ctx);
 }
 
-class mkv_file_source:public mkv_source {
-	FILE* mfile_handle = nullptr;
-	uint64_t file_pos = 0;
-public:
-	virtual int FetchBuffer(_buffer_desc& buffer) override final
-	{
-		//check protocol error here
-		if (buffer.detail.pkt.buffer && buffer.release) {
-			buffer.release(&buffer);
-			buffer.detail.pkt.buffer = nullptr;
-		}
-		unsigned int flags;
-		uint32_t track, size;
-		uint64_t start, end;
-		int err = mkv_ReadFrame(file, 0, &track, &start, &end, &file_pos, &size, (void**)&buffer.detail.pkt.buffer, &flags);
+int mkv_source::read_frame(uint32_t& track, uint64_t& start, uint64_t& end, uint32_t& size, void*& ref, unsigned int& flags)
+{
+	return mkv_ReadFrame(file, 0, &track, &start, &end, &file_pos, &size, &ref, &flags);
+}
+
+void mkv_source::bind_frame(void* ref, _buffer_desc::buffer_detail::packet& pkt)
+{
+	refed_buffer_block* block = (refed_buffer_block*)ref;
+	assert(block->refs == 1);
+	pkt.buffer = block;
+	pkt.data = block->buffer;
+}
+
+//demuxes the next packet into buffer without passing it on
+int mkv_source::read_packet(_buffer_desc& buffer)
+{
+	//check protocol error here
+	if (buffer.detail.pkt.buffer && buffer.release) {
+		buffer.release(&buffer);
+		buffer.detail.pkt.buffer = nullptr;
+	}
+	unsigned int flags;
+	uint32_t track, size;
+	uint64_t start, end;
+	void* ref = nullptr;
+	while (true) {
+		int err = read_frame(track, start, end, size, ref, flags);
 		if (err)
 			return err;
-		assert(buffer.detail.pkt.buffer->refs == 1);
-		buffer.detail.pkt.track = track;
-		buffer.detail.pkt.size = size;
-		buffer.start_timestamp = start;
-		buffer.end_timestamp = end;
-		if (!(flags & FRAME_UNKNOWN_END && flags & FRAME_UNKNOWN_START)) {
-			if(flags & FRAME_UNKNOWN_END)
-				buffer.end_timestamp = buffer.start_timestamp;
-			else if(flags & FRAME_UNKNOWN_START)
-				buffer.start_timestamp = buffer.end_timestamp;
-		}
-		if (flags & FRAME_KF)
-			buffer.detail.pkt.key_frame = 1;
-		else
-			buffer.detail.pkt.key_frame = 0;
-		buffer.release = release_frame;
-		buffer.stream=&desc_out[track];
-		buffer.release_private_ptr = this;
-		if(desc_out[track].downstream)
-			desc_out[track].downstream->QueueBuffer(buffer);
-		return 0;
+		if (!tracks[track].wait_keyframe || flags & FRAME_KF)
+			break;
+		//before the keyframe the seek landed on, undecodable
+		_buffer_desc::buffer_detail::packet skipped{};
+		bind_frame(ref, skipped);
+		skipped.buffer->unref();
 	}
-	virtual int ReleaseBuffer(_buffer_desc& buffer) override final
-	{
-		if (buffer.detail.pkt.buffer && buffer.release) {
+	bind_frame(ref, buffer.detail.pkt);
+	buffer.detail.pkt.discontinuity = tracks[track].discontinuity;
+	tracks[track].wait_keyframe = false;
+	tracks[track].discontinuity = false;
+	buffer.detail.pkt.track = track;
+	buffer.detail.pkt.size = size;
+	buffer.start_timestamp = start;
+	buffer.end_timestamp = end;
+	if (!(flags & FRAME_UNKNOWN_END && flags & FRAME_UNKNOWN_START)) {
+		if(flags & FRAME_UNKNOWN_END)
+			buffer.end_timestamp = buffer.start_timestamp;
+		else if(flags & FRAME_UNKNOWN_START)
+			buffer.start_timestamp = buffer.end_timestamp;
+	}
+	if (flags & FRAME_KF)
+		buffer.detail.pkt.key_frame = 1;
+	else
+		buffer.detail.pkt.key_frame = 0;
+	buffer.release = release_frame;
+	buffer.stream=&desc_out[track];
+	buffer.release_private_ptr = this;
+	return 0;
+}
+
+namespace {
+
+//hands the packet in from over to to
+void move_packet(_buffer_desc& to, _buffer_desc& from)
+{
+	to.stream = from.stream;
+	to.start_timestamp = from.start_timestamp;
+	to.end_timestamp = from.end_timestamp;
+	to.detail.pkt = from.detail.pkt;
+	to.release = from.release;
+	to.release_private_ptr = from.release_private_ptr;
+	from.detail.pkt.buffer = nullptr;
+	from.detail.pkt.data = nullptr;
+	from.release = nullptr;
+}
+
+}
+
+//with the demux lock held; true once every refused packet is taken
+bool mkv_source::offer_refused()
+{
+	while (!refused.empty()) {
+		_buffer_desc& packet = refused.front();
+		media_buffer_node* downstream = packet.stream->downstream;
+		size_t queued = 0;
+		if (downstream)
+			downstream->QueueBuffers(&packet, 1, queued);
+		if (!queued && downstream)
+			return false;
+		//disconnected meanwhile
+		if (packet.detail.pkt.buffer && packet.release)
+			packet.release(&packet);
+		refused.pop_front();
+	}
+	return true;
+}
+
+void mkv_source::drop_refused()
+{
+	for (_buffer_desc& packet : refused) {
+		if (packet.detail.pkt.buffer && packet.release)
+			packet.release(&packet);
+	}
+	refused.clear();
+}
+
+int mkv_source::FetchBuffer(_buffer_desc& buffer)
+{
+	std::lock_guard<std::mutex> lock(demux_mtx);
+	if (!parser_open())
+		return E_INVALID_OPERATION;
+	if (!offer_refused())
+		return E_AGAIN;
+	update_track_mask();
+	int err = read_packet(buffer);
+	if (err)
+		return err;
+	//kept like a refused batch, the caller's descriptor is emptied
+	if (buffer.stream->downstream && buffer.stream->downstream->QueueBuffer(buffer) == E_AGAIN) {
+		refused.emplace_back();
+		move_packet(refused.back(), buffer);
+	}
+	return 0;
+}
+
+//Demuxes the whole batch first, then hands each run of packets
+//going to the same downstream over in one QueueBuffers call. From
+//the first packet a downstream does not take on, the rest of the
+//batch moves to refused, so each downstream still gets its packets
+//in order; their descriptors in buffers are emptied.
+int mkv_source::FetchBuffers(_buffer_desc* buffers, size_t max, size_t& done)
+{
+	done = 0;
+	std::lock_guard<std::mutex> lock(demux_mtx);
+	if (!parser_open())
+		return E_INVALID_OPERATION;
+	if (!offer_refused())
+		return E_AGAIN;
+	update_track_mask();
+	int err = S_OK;
+	while (done < max && !(err = read_packet(buffers[done])))
+		++done;
+	for (size_t i = 0; i < done;) {
+		media_buffer_node* downstream = buffers[i].stream->downstream;
+		size_t run = 1;
+		while (i + run < done && buffers[i + run].stream->downstream == downstream)
+			++run;
+		size_t queued = run;
+		if (downstream)
+			downstream->QueueBuffers(buffers + i, run, queued);
+		if (queued < run) {
+			for (size_t k = i + queued; k < done; ++k) {
+				if (!buffers[k].stream->downstream)
+					continue;
+				refused.emplace_back();
+				move_packet(refused.back(), buffers[k]);
+			}
+			break;
+		}
+		i += run;
+	}
+	return done ? S_OK : err;
+}
+
+//from the destructor, or before pulling started
+void mkv_source::drop_parked()
+{
+	for (std::unique_ptr<track_queue>& queue : queues) {
+		while (parked_packet* parked = queue->packets.front()) {
+			if (parked->desc.release)
+				parked->desc.release(&parked->desc);
+			queue->packets.pop();
+		}
+		queue->bytes.store(0, std::memory_order_relaxed);
+	}
+	if (stalled.detail.pkt.buffer && stalled.release)
+		stalled.release(&stalled);
+	stalled.detail.pkt.buffer = nullptr;
+	stalled.release = nullptr;
+}
+
+//with the demux lock held: the parked packets go stale, their
+//consumers drop them
+void mkv_source::invalidate_parked()
+{
+	seek_generation.fetch_add(1, std::memory_order_release);
+	if (stalled.detail.pkt.buffer && stalled.release)
+		stalled.release(&stalled);
+	stalled.detail.pkt.buffer = nullptr;
+	stalled.release = nullptr;
+}
+
+//with the demux lock held, while nobody pulls
+void mkv_source::reset_queues()
+{
+	drop_parked();
+	queues.clear();
+	for (size_t i = 0; i < num_out; ++i)
+		queues.emplace_back(new track_queue(pull_opts.max_packets));
+}
+
+//true if buffer is taken: parked, or dropped for a track nobody pulls
+bool mkv_source::park(_buffer_desc& buffer)
+{
+	track_queue& queue = *queues[buffer.detail.pkt.track];
+	//a packet larger than the byte cap still goes into an empty queue
+	size_t bytes = queue.bytes.load(std::memory_order_relaxed);
+	bool room = !bytes || bytes + buffer.detail.pkt.size <= pull_opts.max_bytes;
+	//a track the parser could not mask, or one never pulled and full
+	bool wanted = pull_opts.tracks ? buffer.detail.pkt.track < sizeof(pull_opts.tracks) * 8 &&
+		(pull_opts.tracks >> buffer.detail.pkt.track & 1) : queue.pulled.load(std::memory_order_relaxed);
+	if (pull_opts.tracks && !wanted) {
+		if (buffer.release)
+			buffer.release(&buffer);
+	}
+	else if (!room || !queue.packets.try_emplace(buffer, seek_generation.load(std::memory_order_relaxed))) {
+		if (wanted)
+			return false;
+		if (buffer.release)
 			buffer.release(&buffer);
-			buffer.detail.pkt.buffer = nullptr;
+	}
+	else {
+		queue.bytes.fetch_add(buffer.detail.pkt.size, std::memory_order_relaxed);
+	}
+	buffer.detail.pkt.buffer = nullptr;
+	buffer.detail.pkt.data = nullptr;
+	buffer.release = nullptr;
+	return true;
+}
+
+//by the track's consumer only
+bool mkv_source::take_parked(size_t track, _buffer_desc& buffer)
+{
+	track_queue& queue = *queues[track];
+	uint32_t generation = seek_generation.load(std::memory_order_acquire);
+	while (parked_packet* parked = queue.packets.front()) {
+		queue.bytes.fetch_sub(parked->desc.detail.pkt.size, std::memory_order_relaxed);
+		bool stale = parked->generation != generation;
+		if (stale) {
+			if (parked->desc.release)
+				parked->desc.release(&parked->desc);
+		}
+		else {
+			move_packet(buffer, parked->desc);
+		}
+		queue.packets.pop();
+		if (!stale)
+			return true;
+	}
+	return false;
+}
+
+int mkv_source::FetchBuffer(stream_desc* stream, _buffer_desc& buffer, int flags)
+{
+	if (!stream || stream < desc_out || stream >= desc_out + num_out)
+		return E_INVALID_OPERATION;
+	size_t track = stream - desc_out;
+	if (buffer.detail.pkt.buffer && buffer.release) {
+		buffer.release(&buffer);
+		buffer.detail.pkt.buffer = nullptr;
+	}
+	pulling.store(true, std::memory_order_relaxed);
+	queues[track]->pulled.store(true, std::memory_order_relaxed);
+	//the common case, never touches the lock
+	if (take_parked(track, buffer))
+		return S_OK;
+	std::unique_lock<std::mutex> lock(demux_mtx, std::defer_lock);
+	if (flags & PULL_NO_WAIT) {
+		if (!lock.try_lock())
+			return E_AGAIN;
+	}
+	else {
+		lock.lock();
+	}
+	//parked by another puller while this one waited
+	if (take_parked(track, buffer))
+		return S_OK;
+	if (!parser_open())
+		return E_INVALID_OPERATION;
+	update_track_mask();
+	while (true) {
+		if (!stalled.detail.pkt.buffer) {
+			int err = read_packet(stalled);
+			if (err)
+				return err;
 		}
+		if (stalled.detail.pkt.track == track) {
+			move_packet(buffer, stalled);
+			return S_OK;
+		}
+		//the other track is being pulled but not drained
+		if (!park(stalled))
+			return E_AGAIN;
+	}
+}
+
+int mkv_source::SetPullOptions(const pull_options& options)
+{
+	std::lock_guard<std::mutex> lock(demux_mtx);
+	size_t max_packets = options.max_packets ? options.max_packets : 1;
+	if (pulling.load(std::memory_order_relaxed)) {
+		//the queues are being read without the lock
+		if (max_packets != pull_opts.max_packets)
+			return E_INVALID_OPERATION;
+		pull_opts.max_bytes = options.max_bytes;
+		return S_OK;
+	}
+	pull_opts = options;
+	pull_opts.max_packets = max_packets;
+	reset_queues();
+	return S_OK;
+}
+
+int mkv_source::ReleaseBuffer(_buffer_desc& buffer)
+{
+	if (buffer.detail.pkt.buffer && buffer.release) {
+		buffer.release(&buffer);
+		buffer.detail.pkt.buffer = nullptr;
+	}
+	return 0;
+}
+
+namespace {
+
+//length of the EBML varint starting with first, 0 if invalid
+int vint_length(uint8_t first)
+{
+	if (!first)
+		return 0;
+	int len = 1;
+	while (!(first & (0x80 >> (len - 1))))
+		++len;
+	return len;
+}
+
+//reads an element id (marker kept) and size, returns the header length
+//or 0 if it does not fit in avail
+int element_header(const uint8_t* p, size_t avail, uint32_t& id, uint64_t& size, bool& unknown_size)
+{
+	int id_len = avail ? vint_length(p[0]) : 0;
+	if (!id_len || id_len > 4 || avail < size_t(id_len + 1))
+		return 0;
+	id = 0;
+	for (int i = 0; i < id_len; ++i)
+		id = (id << 8) | p[i];
+	int size_len = vint_length(p[id_len]);
+	if (!size_len || avail < size_t(id_len + size_len))
 		return 0;
+	size = p[id_len] & (0xFF >> size_len);
+	unknown_size = size == uint64_t(0xFF >> size_len);
+	for (int i = 1; i < size_len; ++i) {
+		size = (size << 8) | p[id_len + i];
+		unknown_size &= p[id_len + i] == 0xFF;
+	}
+	return id_len + size_len;
+}
+
+const uint32_t ID_CLUSTER = 0x1F43B675;
+const uint32_t ID_TIMECODE = 0xE7;
+const uint32_t ID_SIMPLEBLOCK = 0xA3;
+const uint32_t ID_BLOCKGROUP = 0xA0;
+const uint32_t ID_BLOCK = 0xA1;
+const uint32_t ID_REFERENCEBLOCK = 0xFB;
+
+//track number, 16 bit timecode relative to the cluster, flags
+bool block_header(const uint8_t* p, size_t avail, uint64_t& number, int16_t& offset, uint8_t& flags)
+{
+	int len = avail ? vint_length(p[0]) : 0;
+	if (!len || avail < size_t(len + 3))
+		return false;
+	number = p[0] & (0xFF >> len);
+	for (int i = 1; i < len; ++i)
+		number = (number << 8) | p[i];
+	offset = (int16_t)((p[len] << 8) | p[len + 1]);
+	flags = p[len + 2];
+	return true;
+}
+
+}
+
+//Walks every cluster and block header, skipping the payloads, and
+//records the keyframes of the video tracks (of every track in a file
+//without video) with the offset of the cluster they are in.
+int mkv_source::build_index(uint64_t file_size, int64_t file_mtime)
+{
+	index.clear();
+	uint64_t scale = file->Seg.TimestampScale ? file->Seg.TimestampScale : 1000000;
+	bool has_video = false;
+	for (size_t i = 0; i < num_out; ++i)
+		has_video |= desc_out[i].type == stream_desc::MTYPE_VIDEO;
+	auto indexed_track = [&](uint64_t number, uint32_t& track) {
+		for (size_t i = 0; i < num_out; ++i) {
+			if (mkv_GetTrackInfo(file, i)->Number == (int)number) {
+				track = (uint32_t)i;
+				return !has_video || desc_out[i].type == stream_desc::MTYPE_VIDEO;
+			}
+		}
+		return false;
+	};
+	filepos_t file_end = istream.getfilesize(&istream);
+	//unknown: as far as there is something to read
+	uint64_t end = file_end == INVALID_FILEPOS_T ? UINT64_MAX : (uint64_t)file_end;
+	uint64_t pos = file->pFirstCluster;
+	uint8_t hdr[32];
+	while (pos < end) {
+		int got = istream.read(&istream, pos, hdr, sizeof(hdr));
+		uint32_t id;
+		uint64_t size;
+		bool unknown_size;
+		int len = got > 0 ? element_header(hdr, got, id, size, unknown_size) : 0;
+		if (!len)
+			break;
+		uint64_t element_end = unknown_size ? end : pos + len + size;
+		if (id != ID_CLUSTER) {
+			if (unknown_size)
+				break;
+			pos = element_end;
+			continue;
+		}
+		int64_t cluster_time = 0;
+		uint64_t child = pos + len;
+		while (child < element_end) {
+			got = istream.read(&istream, child, hdr, sizeof(hdr));
+			uint32_t child_id;
+			uint64_t child_size;
+			bool child_unknown;
+			int child_len = got > 0 ? element_header(hdr, got, child_id, child_size, child_unknown) : 0;
+			//level 1 ids are 4 bytes, they end a cluster of unknown size
+			if (!child_len || child_id > 0xFFFFFF)
+				break;
+			const uint8_t* body = hdr + child_len;
+			size_t in_hdr = got - child_len;
+			if (child_id == ID_TIMECODE && child_size <= 8 && child_size <= in_hdr) {
+				uint64_t timecode = 0;
+				for (uint64_t i = 0; i < child_size; ++i)
+					timecode = (timecode << 8) | body[i];
+				cluster_time = (int64_t)timecode;
+			}
+			else if (child_id == ID_SIMPLEBLOCK || child_id == ID_BLOCKGROUP) {
+				bool key = false;
+				uint64_t number = 0;
+				int16_t offset = 0;
+				bool found = false;
+				if (child_id == ID_SIMPLEBLOCK) {
+					uint8_t flags;
+					found = block_header(body, in_hdr, number, offset, flags);
+					key = (flags & 0x80) != 0;
+				}
+				else {
+					//a Block without any ReferenceBlock is a keyframe
+					key = true;
+					uint64_t group_end = child + child_len + child_size;
+					for (uint64_t at = child + child_len; at < group_end;) {
+						uint8_t group_hdr[32];
+						int group_got = istream.read(&istream, at, group_hdr, sizeof(group_hdr));
+						uint32_t group_id;
+						uint64_t group_size;
+						bool group_unknown;
+						int group_len = group_got > 0 ? element_header(group_hdr, group_got, group_id, group_size, group_unknown) : 0;
+						if (!group_len || group_unknown)
+							break;
+						if (group_id == ID_BLOCK) {
+							uint8_t flags;
+							found = block_header(group_hdr + group_len, group_got - group_len, number, offset, flags);
+						}
+						else if (group_id == ID_REFERENCEBLOCK) {
+							key = false;
+						}
+						at += group_len + group_size;
+					}
+				}
+				uint32_t track;
+				if (found && key && indexed_track(number, track)) {
+					int64_t time = cluster_time + offset;
+					index.add(track, time > 0 ? (uint64_t)time * scale : 0, pos);
+				}
+			}
+			if (child_unknown)
+				break;
+			child += child_len + child_size;
+		}
+		pos = unknown_size ? child : element_end;
+	}
+	index.finish((uint32_t)num_out, file_size, file_mtime);
+	return S_OK;
+}
+
+int mkv_source::LoadIndex(const char* media_path, const char* index_path)
+{
+	uint64_t size;
+	int64_t mtime;
+	std::lock_guard<std::mutex> lock(demux_mtx);
+	if (!file || !can_seek() || !file_identity(media_path, size, mtime))
+		return E_INVALID_OPERATION;
+	std::string sidecar = index_path ? index_path : std::string(media_path) + ".kfidx";
+	if (index.load(sidecar.c_str(), size, mtime) && index.track_count() == num_out)
+		return S_OK;
+	int err = build_index(size, mtime);
+	if (err)
+		return err;
+	//without a writable directory the index just lives until close
+	index.save(sidecar.c_str());
+	return S_OK;
+}
+
+//The parser reads on from wherever the stream is once it has no
+//current cluster, which only holds right after opening.
+int mkv_source::reopen()
+{
+	char err[2048]{};
+	mkv_CloseInput(file);
+	istream.progress(&istream, 0, 0);
+	file = mkv_OpenInput(&istream, err, 2048);
+	if (!file)
+		return E_INVALID_OPERATION;
+	if (track_mask)
+		mkv_SetTrackMask(file, (int)track_mask);
+	return S_OK;
+}
+
+//Outputs without a downstream are masked, so the parser skips their
+//blocks without reading or makeref'ing the payload. If nothing is
+//connected the packets are pulled straight through FetchBuffer and
+//every track is read, or those of pull_options::tracks once pulling.
+void mkv_source::update_track_mask()
+{
+	uint32_t mask = 0;
+	bool connected = false;
+	for (size_t i = 0; i < num_out && i < sizeof(mask) * 8; ++i) {
+		if (desc_out[i].downstream)
+			connected = true;
+		else
+			mask |= 1u << i;
+	}
+	if (!connected)
+		mask = 0;
+	if (!connected && pulling.load(std::memory_order_relaxed) && pull_opts.tracks)
+		mask = ~pull_opts.tracks;
+	if (pinned_mask)
+		mask = pinned_mask;
+	if (mask != track_mask) {
+		track_mask = mask;
+		apply_track_mask(mask);
+	}
+}
+
+int mkv_source::Seek(uint64_t timestamp, int flags)
+{
+	std::lock_guard<std::mutex> lock(demux_mtx);
+	if (!file || !can_seek())
+		return E_INVALID_OPERATION;
+	if (file->CueList && index.empty() && !(flags & SEEK_SCAN_CLUSTERS)) {
+		mkv_Seek(file, timestamp, MKVF_SEEK_TO_PREV_KEYFRAME);
+	}
+	else {
+		if (index.empty())
+			build_index(0, 0);
+		//the earliest cluster holding a keyframe for every indexed track
+		uint64_t pos = UINT64_MAX;
+		for (uint32_t i = 0; i < index.track_count(); ++i) {
+			size_t count;
+			if (!index.entries(i, count) || !count)
+				continue;
+			const keyframe_index::entry* key = index.find(i, timestamp);
+			uint64_t at = key ? key->cluster_pos : file->pFirstCluster;
+			if (at < pos)
+				pos = at;
+		}
+		if (pos == UINT64_MAX)
+			pos = file->pFirstCluster;
+		int err = reopen();
+		if (err)
+			return err;
+		istream.progress(&istream, pos, 0);
+		file_pos = pos;
+	}
+	after_seek();
+	return S_OK;
+}
+
+//with the demux lock held, once the parser is at the new position
+void mkv_source::after_seek()
+{
+	for (size_t i = 0; i < num_out; ++i) {
+		tracks[i].wait_keyframe = desc_out[i].type == stream_desc::MTYPE_VIDEO;
+		tracks[i].discontinuity = true;
 	}
+	drop_refused();
+	invalidate_parked();
+}
+
+//Only touches the block, so packets may outlive the source.
+void mkv_source::release_frame(_buffer_desc* buffer)
+{
+	buffer->detail.pkt.buffer->unref();
+	buffer->detail.pkt.buffer = nullptr;
+	buffer->detail.pkt.data = nullptr;
+}
+
+class mkv_file_source:public mkv_source {
+	FILE* mfile_handle = nullptr;
+public:
 	virtual ~mkv_file_source() override final
 	{
 		if (mfile_handle) {
@@ -197,13 +779,6 @@ public:
 			mfile_handle = nullptr;
 		}
 	}
-private:
-	static void release_frame(_buffer_desc* buffer)
-	{
-		mkv_file_source* __this = (mkv_file_source*)buffer->release_private_ptr;
-		__this->istream.releaseref(&__this->istream, buffer->detail.pkt.buffer);
-		buffer->detail.pkt.buffer = nullptr;
-	}
 protected:
 	friend mkv_source_factory;
 	mkv_file_source(const char* path)
@@ -236,11 +811,6 @@ protected:
 			mfile_handle = nullptr;
 		}
 	}
-	void finish_open()
-	{
-		istream.progress(&istream, file->pFirstCluster, 0);
-		file_pos = file->pFirstCluster;
-	}
 private:
 	static const char* geterror(InputStream* cc) noexcept
 	{
@@ -275,23 +845,21 @@ private:
 	static void* makeref(InputStream* inf, int count)
 	{
 		mkv_file_source& reading = *(mkv_file_source*)inf->ptr;
-		refed_buffer_block* block = (refed_buffer_block*)inf->memalloc(inf, sizeof(refed_buffer_block) + count);
-		new(block)refed_buffer_block();
-		block->ref();
+		refed_buffer_block* block = packet_pool::alloc_block(count);
 		fread(block->buffer, 1, count, reading.mfile_handle);
 		return block;
 	}
 	static void* memalloc(InputStream* inf, size_t count) noexcept
 	{
-		return malloc(count);
+		return packet_pool::alloc(count);
 	}
 	static void memfree(InputStream* inf, void* mem) noexcept
 	{
-		free(mem);
+		packet_pool::dealloc(mem);
 	}
 	static void* memrealloc(InputStream* inf, void* mem, size_t count) noexcept
 	{
-		return realloc(mem, count);
+		return packet_pool::realloc(mem, count);
 	}
 	static int progress(InputStream* inf, filepos_t cur, filepos_t max) noexcept
 	{
@@ -312,17 +880,769 @@ private:
 	}
 };
 
-mkv_source* mkv_source_factory::CreateFromFile(const char* path)
-{
-	mkv_file_source* source = new mkv_file_source(path);
-	int err = source->finish_init();
-	if (err) {
-		source->cleanup_if_failed();
-		delete source;
-		source = nullptr;
+//Serves everything from memory, a read only mapping of the file
+//or a buffer handed over by the caller.
+//makeref does not copy: it hands out a pointer into the memory
+//and takes a ref on the block that owns it, so the memory
+//lives until both the source and the last packet are gone.
+class mkv_memory_source:public mkv_source {
+	refed_buffer_block* map_block = nullptr;
+	const uint8_t* base = nullptr;
+	uint64_t length = 0;
+	uint64_t pos = 0;
+public:
+	virtual ~mkv_memory_source() override final
+	{
+		//the parser may still hold refs that it drops on close
+		if (file) {
+			mkv_CloseInput(file);
+			file = nullptr;
+		}
+		if (map_block) {
+			map_block->unref();
+			map_block = nullptr;
+		}
 	}
-	else {
-		source->finish_open();
+protected:
+	friend mkv_source_factory;
+	mkv_memory_source(const char* path)
+	{
+		set_callbacks();
+		refed_buffer_block* block = (refed_buffer_block*)malloc(sizeof(refed_buffer_block) + sizeof(file_mapping));
+		new(block)refed_buffer_block();
+		block->dispose = dispose_mapping;
+		file_mapping* mapping = new(block->buffer)file_mapping();
+		block->ref();
+		if (!mapping->open(path)) {
+			printf("Cannot open file\n");
+			block->unref();
+			return;
+		}
+		map_block = block;
+		base = mapping->data();
+		length = mapping->size();
+	}
+	mkv_memory_source(const void* data, size_t size, void (*release)(const void* data, void* opaque), void* opaque)
+	{
+		set_callbacks();
+		refed_buffer_block* block = (refed_buffer_block*)malloc(sizeof(refed_buffer_block) + sizeof(caller_memory));
+		new(block)refed_buffer_block();
+		block->dispose = dispose_caller_memory;
+		new(block->buffer)caller_memory{ data, release, opaque };
+		block->ref();
+		map_block = block;
+		base = (const uint8_t*)data;
+		length = size;
+	}
+	void set_callbacks()
+	{
+		istream.geterror = geterror;
+		istream.getfilesize = getfilesize;
+		istream.ioread = ioread;
+		istream.ioreadch = ioreadch;
+		istream.ioseek = ioseek;
+		istream.iotell = iotell;
+		istream.makeref = makeref;
+		istream.memalloc = memalloc;
+		istream.memfree = memfree;
+		istream.memrealloc = memrealloc;
+		istream.progress = progress;
+		istream.read = read;
+		istream.releaseref = releaseref;
+		istream.scan = nullptr;
+	}
+	bool mapped() const
+	{
+		return map_block != nullptr;
+	}
+	virtual int read_frame(uint32_t& track, uint64_t& start, uint64_t& end, uint32_t& size, void*& ref, unsigned int& flags) override final
+	{
+		int err = mkv_source::read_frame(track, start, end, size, ref, flags);
+		if (!err && ref && size > base + length - (const uint8_t*)ref)
+			size = (uint32_t)(base + length - (const uint8_t*)ref);
+		return err;
+	}
+	virtual void bind_frame(void* ref, _buffer_desc::buffer_detail::packet& pkt) override final
+	{
+		//the ref taken in makeref now belongs to the packet
+		pkt.buffer = map_block;
+		pkt.data = (uint8_t*)ref;
+	}
+private:
+	struct caller_memory {
+		const void* data;
+		void (*release)(const void* data, void* opaque);
+		void* opaque;
+	};
+	static void dispose_mapping(refed_buffer_block* block)
+	{
+		((file_mapping*)block->buffer)->~file_mapping();
+		free(block);
+	}
+	static void dispose_caller_memory(refed_buffer_block* block)
+	{
+		caller_memory& memory = *(caller_memory*)block->buffer;
+		if (memory.release)
+			memory.release(memory.data, memory.opaque);
+		free(block);
+	}
+	static const char* geterror(InputStream* cc) noexcept
+	{
+		return "dummy error";
+	}
+	static filepos_t getfilesize(InputStream* cc) noexcept
+	{
+		return ((mkv_memory_source*)cc->ptr)->length;
+	}
+	static int ioread(InputStream* inf, void* buffer, int count) noexcept
+	{
+		mkv_memory_source& reading = *(mkv_memory_source*)inf->ptr;
+		uint64_t left = reading.pos < reading.length ? reading.length - reading.pos : 0;
+		if ((uint64_t)count > left)
+			count = (int)left;
+		memcpy(buffer, reading.base + reading.pos, count);
+		reading.pos += count;
+		return count;
+	}
+	static int ioreadch(InputStream* inf) noexcept
+	{
+		mkv_memory_source& reading = *(mkv_memory_source*)inf->ptr;
+		if (reading.pos >= reading.length)
+			return EOF;
+		return reading.base[reading.pos++];
+	}
+	static void ioseek(InputStream* inf, longlong wher, int how) noexcept
+	{
+		mkv_memory_source& reading = *(mkv_memory_source*)inf->ptr;
+		switch (how) {
+			case SEEK_CUR:
+				wher += reading.pos;
+				break;
+			case SEEK_END:
+				wher += reading.length;
+				break;
+		}
+		reading.pos = wher < 0 ? 0 : wher;
+	}
+	static filepos_t iotell(InputStream* inf) noexcept
+	{
+		return ((mkv_memory_source*)inf->ptr)->pos;
+	}
+	static void* makeref(InputStream* inf, int count)
+	{
+		//a frame cut off by the end of a truncated file gets the bytes
+		//there are, read_frame shortens it to them (to none past the end)
+		mkv_memory_source& reading = *(mkv_memory_source*)inf->ptr;
+		uint64_t at = reading.pos < reading.length ? reading.pos : reading.length;
+		void* ref = (void*)(reading.base + at);
+		reading.map_block->ref();
+		reading.pos = at + ((uint64_t)count < reading.length - at ? count : reading.length - at);
+		return ref;
+	}
+	static void* memalloc(InputStream* inf, size_t count) noexcept
+	{
+		return malloc(count);
+	}
+	static void memfree(InputStream* inf, void* mem) noexcept
+	{
+		free(mem);
+	}
+	static void* memrealloc(InputStream* inf, void* mem, size_t count) noexcept
+	{
+		return realloc(mem, count);
+	}
+	static int progress(InputStream* inf, filepos_t cur, filepos_t max) noexcept
+	{
+		((mkv_memory_source*)inf->ptr)->pos = cur;
+		return 0;
+	}
+	static int read(InputStream* inf, filepos_t pos, void* buffer, size_t count) noexcept
+	{
+		mkv_memory_source& reading = *(mkv_memory_source*)inf->ptr;
+		if ((uint64_t)pos >= reading.length)
+			return 0;
+		if (count > reading.length - pos)
+			count = reading.length - pos;
+		memcpy(buffer, reading.base + pos, count);
+		return count;
+	}
+	static void releaseref(InputStream* inf, void* ref)
+	{
+		((mkv_memory_source*)inf->ptr)->map_block->unref();
+	}
+};
+
+//Reads through a positional_file with its own position,
+//so the callbacks never move a shared file pointer and
+//one open file can be shared with other readers.
+//All callbacks go through a buffered_reader, so the byte by byte
+//EBML id/size parsing hits its window instead of the file.
+class mkv_pread_source:public mkv_source {
+	std::shared_ptr<const positional_file> pfile;
+	size_t window_size;
+	buffered_reader reader;
+	std::unique_ptr<cluster_readahead> readahead;
+	//per track parsers over the same file, see EnableTrackCursors
+	std::vector<std::unique_ptr<mkv_source>> cursors;
+public:
+	virtual ~mkv_pread_source() override final
+	{
+		cursors.clear();
+		//close while the reader and read ahead are still alive
+		if (file) {
+			mkv_CloseInput(file);
+			file = nullptr;
+		}
+		reader.set_cache(nullptr);
+	}
+	virtual const readahead_stats* GetReadaheadStats() const override final
+	{
+		return readahead ? &readahead->stats() : nullptr;
+	}
+	using mkv_source::FetchBuffer;
+	virtual int FetchBuffer(stream_desc* stream, _buffer_desc& buffer, int flags) override final
+	{
+		//the base rejects streams that are not ours
+		if (!stream || stream < desc_out || stream >= desc_out + cursors.size() || !cursors[stream - desc_out])
+			return mkv_source::FetchBuffer(stream, buffer, flags);
+		size_t track = stream - desc_out;
+		//the cursor only reads this track, nothing to park
+		int err = cursors[track]->FetchBuffer(buffer);
+		if (!err)
+			buffer.stream = stream;
+		return err;
+	}
+	virtual int Seek(uint64_t timestamp, int flags) override final
+	{
+		int err = mkv_source::Seek(timestamp, flags);
+		for (std::unique_ptr<mkv_source>& cursor : cursors) {
+			if (!err && cursor)
+				err = cursor->Seek(timestamp, flags);
+		}
+		return err;
+	}
+	//Each cursor is a parser of its own, with its own window over the
+	//shared positional_file, masked to a single track: it walks every
+	//cluster and skips the other tracks' blocks without reading them.
+	//Costs a second pass over the cluster structure per track, but
+	//no track waits for or buffers another however far apart they
+	//are muxed, and each can be pulled from its own thread.
+	virtual int EnableTrackCursors() override final
+	{
+		std::lock_guard<std::mutex> lock(demux_mtx);
+		if (!cursors.empty())
+			return S_OK;
+		std::vector<std::unique_ptr<mkv_source>> opened(num_out);
+		for (size_t i = 0; i < num_out; ++i) {
+			if (!desc_out[i].format_info.meta.mkv.Enabled || i >= sizeof(uint32_t) * 8)
+				continue;
+			mkv_pread_source* cursor = new mkv_pread_source(pfile, window_size);
+			opened[i].reset(cursor);
+			if (cursor->finish_init() || cursor->num_out != num_out)
+				return E_INVALID_OPERATION;
+			cursor->finish_open();
+			cursor->pinned_mask = ~(1u << i);
+		}
+		cursors = std::move(opened);
+		return S_OK;
+	}
+protected:
+	friend mkv_source_factory;
+	mkv_pread_source(std::shared_ptr<const positional_file> shared, size_t block_size):
+		pfile(shared), window_size(block_size), reader(std::move(shared), block_size)
+	{
+		istream.geterror = geterror;
+		istream.getfilesize = getfilesize;
+		istream.ioread = ioread;
+		istream.ioreadch = ioreadch;
+		istream.ioseek = ioseek;
+		istream.iotell = iotell;
+		istream.makeref = makeref;
+		istream.memalloc = memalloc;
+		istream.memfree = memfree;
+		istream.memrealloc = memrealloc;
+		istream.progress = progress;
+		istream.read = read;
+		istream.releaseref = releaseref;
+		istream.scan = nullptr;
+	}
+	//clusters are only known once the headers are parsed
+	void start_readahead(const readahead_options& options)
+	{
+		readahead.reset(new cluster_readahead(pfile, file->pFirstCluster, options));
+		reader.set_cache(readahead.get());
+	}
+private:
+	static const char* geterror(InputStream* cc) noexcept
+	{
+		return "dummy error";
+	}
+	static filepos_t getfilesize(InputStream* cc) noexcept
+	{
+		return ((mkv_pread_source*)cc->ptr)->reader.size();
+	}
+	static int ioread(InputStream* inf, void* buffer, int count) noexcept
+	{
+		return (int)((mkv_pread_source*)inf->ptr)->reader.read(buffer, count);
+	}
+	static int ioreadch(InputStream* inf) noexcept
+	{
+		int ch = ((mkv_pread_source*)inf->ptr)->reader.getc();
+		return ch < 0 ? EOF : ch;
+	}
+	static void ioseek(InputStream* inf, longlong wher, int how) noexcept
+	{
+		buffered_reader& reader = ((mkv_pread_source*)inf->ptr)->reader;
+		switch (how) {
+			case SEEK_CUR:
+				wher += reader.tell();
+				break;
+			case SEEK_END:
+				wher += reader.size();
+				break;
+		}
+		reader.seek(wher < 0 ? 0 : wher);
+	}
+	static filepos_t iotell(InputStream* inf) noexcept
+	{
+		return ((mkv_pread_source*)inf->ptr)->reader.tell();
+	}
+	static void* makeref(InputStream* inf, int count)
+	{
+		mkv_pread_source& reading = *(mkv_pread_source*)inf->ptr;
+		refed_buffer_block* block = packet_pool::alloc_block(count);
+		//copied from the window when the frame is already in it
+		reading.reader.read(block->buffer, count);
+		return block;
+	}
+	static void* memalloc(InputStream* inf, size_t count) noexcept
+	{
+		return packet_pool::alloc(count);
+	}
+	static void memfree(InputStream* inf, void* mem) noexcept
+	{
+		packet_pool::dealloc(mem);
+	}
+	static void* memrealloc(InputStream* inf, void* mem, size_t count) noexcept
+	{
+		return packet_pool::realloc(mem, count);
+	}
+	static int progress(InputStream* inf, filepos_t cur, filepos_t max) noexcept
+	{
+		((mkv_pread_source*)inf->ptr)->reader.seek(cur);
+		return 0;
+	}
+	static int read(InputStream* inf, filepos_t pos, void* buffer, size_t count) noexcept
+	{
+		return (int)((mkv_pread_source*)inf->ptr)->reader.read_at(pos, buffer, count);
+	}
+	static void releaseref(InputStream* inf, void* ref)
+	{
+		refed_buffer_block* block = (refed_buffer_block*)ref;
+		block->unref();
+	}
+};
+
+//Reads a stream that can only be read front to back.
+//The last lookback bytes stay in a ring, which serves the parser's
+//seeks back (to the first cluster after the headers, for example).
+//A seek forward reads on and drops the data in between, as long as
+//it is no further ahead than the ring holds; seeks outside that
+//range read nothing. Only the missing bytes are asked from read,
+//so a live producer is never waited on for more than the parser needs.
+class mkv_stream_source:public mkv_source {
+	size_t (*stream_read)(void* buffer, size_t count, void* opaque);
+	void* opaque;
+	std::unique_ptr<uint8_t[]> ring;
+	size_t capacity;
+	//bytes taken from the stream so far
+	uint64_t head = 0;
+	bool ended = false;
+	uint64_t pos = 0;
+public:
+	virtual ~mkv_stream_source() override final
+	{
+		if (file) {
+			mkv_CloseInput(file);
+			file = nullptr;
+		}
+	}
+protected:
+	friend mkv_source_factory;
+	mkv_stream_source(size_t (*read_cb)(void* buffer, size_t count, void* opaque), void* read_opaque, size_t lookback):
+		stream_read(read_cb), opaque(read_opaque), ring(new uint8_t[lookback]), capacity(lookback)
+	{
+		istream.geterror = geterror;
+		istream.getfilesize = getfilesize;
+		istream.ioread = ioread;
+		istream.ioreadch = ioreadch;
+		istream.ioseek = ioseek;
+		istream.iotell = iotell;
+		istream.makeref = makeref;
+		istream.memalloc = memalloc;
+		istream.memfree = memfree;
+		istream.memrealloc = memrealloc;
+		istream.progress = progress;
+		istream.read = read;
+		istream.releaseref = releaseref;
+		istream.scan = nullptr;
+	}
+	virtual bool can_seek() const override final
+	{
+		return false;
+	}
+	//takes up to count more bytes from the stream into the ring
+	size_t pull(size_t count)
+	{
+		size_t at = (size_t)(head % capacity);
+		if (count > capacity - at)
+			count = capacity - at;
+		size_t got = ended ? 0 : stream_read(ring.get() + at, count, opaque);
+		if (!got)
+			ended = true;
+		head += got;
+		return got;
+	}
+	size_t read_stream(uint64_t at, void* buffer, size_t count)
+	{
+		uint8_t* out = (uint8_t*)buffer;
+		uint64_t oldest = head > capacity ? head - capacity : 0;
+		if (at < oldest || (at > head && at - head > capacity))
+			return 0;
+		while (head < at) {
+			if (!pull((size_t)(at - head)))
+				return 0;
+		}
+		size_t done = 0;
+		while (done < count) {
+			if (at + done == head && !pull(count - done))
+				break;
+			//what was just pulled is never evicted before it is copied
+			size_t from = (size_t)((at + done) % capacity);
+			size_t chunk = (size_t)(head - (at + done));
+			if (chunk > count - done)
+				chunk = count - done;
+			if (chunk > capacity - from)
+				chunk = capacity - from;
+			memcpy(out + done, ring.get() + from, chunk);
+			done += chunk;
+		}
+		return done;
+	}
+private:
+	static const char* geterror(InputStream* cc) noexcept
+	{
+		return "dummy error";
+	}
+	//unknown, the stream ends when read returns 0
+	static filepos_t getfilesize(InputStream* cc) noexcept
+	{
+		return INVALID_FILEPOS_T;
+	}
+	static int ioread(InputStream* inf, void* buffer, int count) noexcept
+	{
+		mkv_stream_source& reading = *(mkv_stream_source*)inf->ptr;
+		size_t got = reading.read_stream(reading.pos, buffer, count);
+		reading.pos += got;
+		return (int)got;
+	}
+	static int ioreadch(InputStream* inf) noexcept
+	{
+		uint8_t ch;
+		if (!ioread(inf, &ch, 1))
+			return EOF;
+		return ch;
+	}
+	static void ioseek(InputStream* inf, longlong wher, int how) noexcept
+	{
+		mkv_stream_source& reading = *(mkv_stream_source*)inf->ptr;
+		switch (how) {
+			case SEEK_CUR:
+				wher += reading.pos;
+				break;
+			case SEEK_END:
+				//no end to seek from
+				return;
+		}
+		reading.pos = wher < 0 ? 0 : wher;
+	}
+	static filepos_t iotell(InputStream* inf) noexcept
+	{
+		return ((mkv_stream_source*)inf->ptr)->pos;
+	}
+	static void* makeref(InputStream* inf, int count)
+	{
+		mkv_stream_source& reading = *(mkv_stream_source*)inf->ptr;
+		refed_buffer_block* block = packet_pool::alloc_block(count);
+		reading.pos += reading.read_stream(reading.pos, block->buffer, count);
+		return block;
+	}
+	static void* memalloc(InputStream* inf, size_t count) noexcept
+	{
+		return packet_pool::alloc(count);
+	}
+	static void memfree(InputStream* inf, void* mem) noexcept
+	{
+		packet_pool::dealloc(mem);
+	}
+	static void* memrealloc(InputStream* inf, void* mem, size_t count) noexcept
+	{
+		return packet_pool::realloc(mem, count);
+	}
+	static int progress(InputStream* inf, filepos_t cur, filepos_t max) noexcept
+	{
+		((mkv_stream_source*)inf->ptr)->pos = cur;
+		return 0;
+	}
+	static int read(InputStream* inf, filepos_t pos, void* buffer, size_t count) noexcept
+	{
+		return (int)((mkv_stream_source*)inf->ptr)->read_stream(pos, buffer, count);
+	}
+	static void releaseref(InputStream* inf, void* ref)
+	{
+		refed_buffer_block* block = (refed_buffer_block*)ref;
+		block->unref();
+	}
+};
+
+//Demuxes with webm_demuxer over a buffered_reader instead of
+//matroska2. Element headers are parsed straight from the reader's
+//window and only the payloads of unmasked tracks are read, each into
+//a pooled block of its own. The frames of a laced block are read
+//together, in one read into one block, and each packet is a slice of
+//it holding a ref. Skips the matroska2 setup altogether, so file
+//stays null and whatever relies on it (LoadIndex) is unavailable.
+class mkv_native_source:public mkv_source {
+	buffered_reader reader;
+	webm_demuxer<buffered_reader> demuxer;
+	bool opened = false;
+	//the laced block being handed out, with a ref of its own
+	//until its last frame is
+	refed_buffer_block* lace = nullptr;
+	uint64_t lace_pos = 0;
+	//payload of the frame read_frame returned last
+	uint8_t* frame_data = nullptr;
+public:
+	virtual ~mkv_native_source() override final
+	{
+		if (lace)
+			lace->unref();
+	}
+	//through the Cues, or the cluster starts without them
+	virtual int Seek(uint64_t timestamp, int flags) override final
+	{
+		std::lock_guard<std::mutex> lock(demux_mtx);
+		if (!opened)
+			return E_INVALID_OPERATION;
+		demuxer.seek(timestamp);
+		after_seek();
+		return S_OK;
+	}
+protected:
+	friend mkv_source_factory;
+	mkv_native_source(std::shared_ptr<const positional_file> pfile, size_t block_size):
+		mkv_source(false), reader(std::move(pfile), block_size), demuxer(reader)
+	{
+	}
+	int open()
+	{
+		if (!demuxer.open())
+			return 1;
+		const std::vector<webm_track>& list = demuxer.tracks();
+		for (const webm_track& track : list) {
+			if (track.encoded)
+				return 1;
+		}
+		init_outputs(list.size());
+		for (size_t i = 0; i < list.size(); ++i) {
+			const webm_track& track = list[i];
+			TrackInfo info{};
+			info.Number = (int)track.number;
+			info.Type = track.type;
+			info.CodecID = track.codec_id.c_str();
+			info.CodecPrivate = track.codec_private.empty() ? nullptr : (uint8_t*)track.codec_private.data();
+			info.CodecPrivateSize = track.codec_private.size();
+			info.Name = track.name.empty() ? nullptr : (char*)track.name.c_str();
+			memcpy(info.Language, track.language, 4);
+			info.Enabled = track.enabled;
+			info.Default = track.is_default;
+			info.Forced = track.forced;
+			info.DefaultDuration = track.default_duration;
+			info.SeekPreRoll = (size_t)track.seek_preroll;
+			info.CodecDelay = (size_t)track.codec_delay;
+			if (track.type == TRACK_TYPE_VIDEO) {
+				info.AV.Video.PixelWidth = track.width;
+				info.AV.Video.PixelHeight = track.height;
+				info.AV.Video.Colour.BitsPerChannel = track.bits_per_channel;
+				info.AV.Video.Colour.ChromaSubsamplingHorz = track.chroma_subsampling_horz;
+				info.AV.Video.Colour.ChromaSubsamplingVert = track.chroma_subsampling_vert;
+				info.AV.Video.Colour.CbSubsamplingHorz = track.cb_subsampling_horz;
+				info.AV.Video.Colour.CbSubsamplingVert = track.cb_subsampling_vert;
+				info.AV.Video.Colour.Range = track.range;
+			}
+			else if (track.type == TRACK_TYPE_AUDIO) {
+				info.AV.Audio.SamplingFreq = (float)track.sampling_frequency;
+				info.AV.Audio.OutputSamplingFreq = (float)track.output_sampling_frequency;
+				info.AV.Audio.Channels = (uint8_t)track.channels;
+				info.AV.Audio.BitDepth = (uint8_t)track.bit_depth;
+			}
+			describe_track(i, &info);
+		}
+		file_pos = demuxer.first_cluster();
+		opened = true;
+		return 0;
+	}
+	virtual bool parser_open() const override final
+	{
+		return opened;
+	}
+	virtual void apply_track_mask(uint32_t mask) override final
+	{
+		demuxer.set_track_mask(mask);
+	}
+	virtual int read_frame(uint32_t& track, uint64_t& start, uint64_t& end, uint32_t& size, void*& ref, unsigned int& flags) override final
+	{
+		webm_frame frame;
+		if (!demuxer.next(frame))
+			return E_EOF;
+		refed_buffer_block* block;
+		if (frame.block_size != frame.size) {
+			if (!lace || lace_pos != frame.block_pos) {
+				if (lace)
+					lace->unref();
+				lace = packet_pool::alloc_block((size_t)frame.block_size);
+				lace_pos = frame.block_pos;
+				reader.seek(lace_pos);
+				if (reader.read(lace->buffer, (size_t)frame.block_size) != frame.block_size) {
+					lace->unref();
+					lace = nullptr;
+					return E_EOF;
+				}
+			}
+			block = lace;
+			frame_data = lace->buffer + (frame.pos - lace_pos);
+			//the last frame takes over the source's ref
+			if (frame.pos + frame.size == lace_pos + frame.block_size)
+				lace = nullptr;
+			else
+				block->ref();
+		}
+		else {
+			block = packet_pool::alloc_block(frame.size);
+			reader.seek(frame.pos);
+			if (reader.read(block->buffer, frame.size) != frame.size) {
+				block->unref();
+				return E_EOF;
+			}
+			frame_data = block->buffer;
+		}
+		track = frame.track;
+		start = frame.timestamp;
+		end = frame.timestamp + frame.duration;
+		size = frame.size;
+		ref = block;
+		flags = frame.key ? FRAME_KF : 0;
+		if (!frame.duration)
+			flags |= FRAME_UNKNOWN_END;
+		file_pos = frame.pos;
+		return S_OK;
+	}
+	//laced frames share their block
+	virtual void bind_frame(void* ref, _buffer_desc::buffer_detail::packet& pkt) override final
+	{
+		pkt.buffer = (refed_buffer_block*)ref;
+		pkt.data = frame_data;
+	}
+};
+
+mkv_source* mkv_source_factory::CreateFromFile(const char* path)
+{
+	mkv_file_source* source = new mkv_file_source(path);
+	int err = source->finish_init();
+	if (err) {
+		source->cleanup_if_failed();
+		delete source;
+		source = nullptr;
+	}
+	else {
+		source->finish_open();
+	}
+	return source;
+}
+
+
+mkv_source* mkv_source_factory::CreateFromFileMapped(const char* path)
+{
+	mkv_memory_source* source = new mkv_memory_source(path);
+	if (!source->mapped() || source->finish_init()) {
+		delete source;
+		return nullptr;
+	}
+	source->finish_open();
+	return source;
+}
+
+mkv_source* mkv_source_factory::CreateFromFilePositional(const char* path, size_t block_size, const readahead_options* readahead)
+{
+	std::shared_ptr<positional_file> pfile = std::make_shared<positional_file>();
+	if (!pfile->open(path)) {
+		printf("Cannot open file\n");
+		return nullptr;
+	}
+	return CreateFromFilePositional(std::move(pfile), block_size, readahead);
+}
+
+mkv_source* mkv_source_factory::CreateFromFilePositional(std::shared_ptr<const positional_file> file, size_t block_size, const readahead_options* readahead)
+{
+	mkv_pread_source* source = new mkv_pread_source(std::move(file), block_size);
+	if (source->finish_init()) {
+		delete source;
+		return nullptr;
+	}
+	source->finish_open();
+	if (readahead)
+		source->start_readahead(*readahead);
+	return source;
+}
+
+mkv_source* mkv_source_factory::CreateFromMemory(const void* data, size_t size,
+	void (*release)(const void* data, void* opaque), void* opaque)
+{
+	mkv_memory_source* source = new mkv_memory_source(data, size, release, opaque);
+	if (source->finish_init()) {
+		delete source;
+		return nullptr;
+	}
+	source->finish_open();
+	return source;
+}
+
+mkv_source* mkv_source_factory::CreateFromStream(size_t (*read)(void* buffer, size_t count, void* opaque),
+	void* opaque, size_t lookback)
+{
+	mkv_stream_source* source = new mkv_stream_source(read, opaque, lookback);
+	if (source->finish_init()) {
+		delete source;
+		return nullptr;
+	}
+	source->finish_open();
+	return source;
+}
+
+mkv_source* mkv_source_factory::CreateFromFileNative(const char* path, size_t block_size)
+{
+	std::shared_ptr<positional_file> pfile = std::make_shared<positional_file>();
+	if (!pfile->open(path)) {
+		printf("Cannot open file\n");
+		return nullptr;
+	}
+	//peek needs whole element headers and laces in the window
+	if (block_size < 4096)
+		block_size = 4096;
+	mkv_native_source* source = new mkv_native_source(std::move(pfile), block_size);
+	if (source->open()) {
+		delete source;
+		return nullptr;
 	}
 	return source;
 }
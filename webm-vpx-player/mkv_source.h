@@ -1,6 +1,16 @@
 #pragma once
 
 #include "media_source.h"
+#include "mkv_readahead.h"
+#include "mkv_index.h"
+
+#include <memory>
+#include <vector>
+#include <deque>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <rigtorp/SPSCQueue.h>
 
 class mkv_source_factory;
 
@@ -12,13 +22,107 @@ class mkv_source_factory;
 class mkv_source:public media_source {
 protected:
 	friend mkv_source_factory;
-	mkv_source();
+	//use_parser false skips acquiring matroska2's context, for
+	//backends that override the parser hooks below
+	mkv_source(bool use_parser = true);
+	const bool registered;
 	InputStream istream{};
-	nodecontext ctx{};
+	//held by this instance alone, see mkv_context
+	nodecontext* ctx = nullptr;
 	MatroskaFile* file = nullptr;
+	uint64_t file_pos = 0;
+	//keyframes per track, loaded from a sidecar file or
+	//built by scanning for files without Cues
+	keyframe_index index;
+	struct track_state {
+		//drop packets until a keyframe, set by Seek
+		bool wait_keyframe;
+		bool discontinuity;
+	};
+	std::vector<track_state> tracks;
+	//tracks the parser skips, bit per output
+	uint32_t track_mask = 0;
+	//if set, used instead of the mask from the downstreams
+	uint32_t pinned_mask = 0;
+	void update_track_mask();
+public:
+	//caps of each track's queue when pulling per stream
+	struct pull_options {
+		size_t max_packets = 512;
+		size_t max_bytes = 16 * 1024 * 1024;
+		//bit per output pulled, the parser skips the others; 0 for
+		//the tracks pulled so far, see FetchBuffer(stream)
+		uint32_t tracks = 0;
+	};
+protected:
+	//a packet demuxed for another track than the one pulling, with
+	//the seek generation it was demuxed in
+	struct parked_packet {
+		_buffer_desc desc;
+		uint32_t generation;
+		parked_packet(const _buffer_desc& desc, uint32_t generation):desc(desc), generation(generation) {}
+	};
+	//One consumer per track, producers are serialized by demux_mtx.
+	//Only the consumer pops: a seek leaves the parked packets where
+	//they are and bumps seek_generation, the consumer drops the
+	//stale ones as it comes to them. The queues live as long as the
+	//source once pulling started.
+	struct track_queue {
+		rigtorp::SPSCQueue<parked_packet> packets;
+		std::atomic<size_t> bytes{0};
+		//pulled at least once, else its packets are dropped when full
+		std::atomic<bool> pulled{false};
+		track_queue(size_t capacity):packets(capacity) {}
+	};
+	std::vector<std::unique_ptr<track_queue>> queues;
+	std::atomic<uint32_t> seek_generation{0};
+	//set by the first pull, the queues are not replaced after
+	std::atomic<bool> pulling{false};
+	pull_options pull_opts;
+	//held by whoever drives the parser
+	std::mutex demux_mtx;
+	//read, but its track's queue was full
+	_buffer_desc stalled{};
+	//packets FetchBuffers demuxed that their downstream's QueueBuffers
+	//did not take, offered again before anything else is demuxed
+	std::deque<_buffer_desc> refused;
+	bool offer_refused();
+	void drop_refused();
+	void drop_parked();
+	void invalidate_parked();
+	void reset_queues();
+	bool park(_buffer_desc& buffer);
+	bool take_parked(size_t track, _buffer_desc& buffer);
+	//copies, so the descriptors outlive a reopened parser
+	std::vector<std::vector<uint8_t>> codec_privates;
+	std::vector<std::string> track_names;
 	int finish_init();
-
-//	uint64_t file_pos;
+	void init_outputs(size_t count);
+	void describe_track(size_t i, TrackInfo* info);
+	void finish_open();
+	void after_seek();
+	int build_index(uint64_t file_size, int64_t file_mtime);
+	int reopen();
+	int read_packet(_buffer_desc& buffer);
+	//the parser hooks, matroska2 by default
+	virtual bool parser_open() const
+	{
+		return file != nullptr;
+	}
+	virtual int read_frame(uint32_t& track, uint64_t& start, uint64_t& end, uint32_t& size, void*& ref, unsigned int& flags);
+	virtual void apply_track_mask(uint32_t mask)
+	{
+		mkv_SetTrackMask(file, (int)mask);
+	}
+	//turns the FrameRef from mkv_ReadFrame into the packet's
+	//owner block and payload pointer. Default is a refed_buffer_block
+	//made by makeref that holds the payload itself.
+	virtual void bind_frame(void* ref, _buffer_desc::buffer_detail::packet& pkt);
+	//false for streams that can only be read front to back
+	virtual bool can_seek() const
+	{
+		return true;
+	}
 public:
 	virtual ~mkv_source();
 	virtual int GetOutputs(stream_desc *& desc, size_t& num) override final
@@ -27,11 +131,100 @@ public:
 		desc = desc_out;
 		return S_OK;
 	}
-//	virtual int FetchBuffer(_buffer_desc& buffer) override final;
+	virtual int FetchBuffer(_buffer_desc& buffer) override;
+	//Packets a downstream's QueueBuffer(s) does not take are kept and
+	//offered again first by the next FetchBuffer(s); until it takes
+	//them those return E_AGAIN without demuxing.
+	virtual int FetchBuffers(_buffer_desc* buffers, size_t max, size_t& done) override;
+	enum pull_flags {
+		PULL_WAIT = 0,
+		//E_AGAIN instead of waiting for another thread's demuxing
+		PULL_NO_WAIT = 1
+	};
+	//MODE_DOWN_NOTIFY_UP: returns the next packet of stream (one of
+	//the outputs), demuxing only until one turns up. Packets of other
+	//tracks are parked in their track's queue for their own pull; if
+	//that queue is full, demuxing stops with E_AGAIN until it is drained.
+	//With pull_options::tracks set, only those tracks are demuxed and
+	//each must be pulled, else the others stall once its queue is full.
+	//Without, a track never pulled does not hold the others up: its
+	//packets are parked while there is room and dropped after, so a
+	//puller starting later than the queue fills misses packets. Set
+	//tracks when starting several pullers at once.
+	//Packets are not passed downstream. One thread per stream may pull
+	//concurrently; do not mix with FetchBuffer(s) during pulls. A Seek
+	//meanwhile is safe, though a pull racing it may still return a
+	//packet from before the seek.
+	virtual int FetchBuffer(stream_desc* stream, _buffer_desc& buffer, int flags = PULL_WAIT);
+	//sizes the queues, call before pulling: once pulling started,
+	//only max_bytes can change, E_INVALID_OPERATION for max_packets
+	virtual int SetPullOptions(const pull_options& options);
+	//Gives every enabled track its own demux cursor, which the
+	//per stream FetchBuffer then reads from instead of the shared
+	//one, so nothing is parked however badly the tracks are
+	//interleaved. Only for sources over a positional file.
+	virtual int EnableTrackCursors()
+	{
+		return E_UNIMPLEMENTED;
+	}
+	virtual int ReleaseBuffer(_buffer_desc& buffer) override;
+	enum seek_flags {
+		//the keyframe at or before the timestamp, located through the Cues
+		SEEK_PREV_KEYFRAME = 0,
+		//ignore the Cues and go through the keyframe index,
+		//building it by scanning the file if none is loaded
+		SEEK_SCAN_CLUSTERS = 1
+	};
+	//Loads the keyframe index saved next to media_path (or at index_path)
+	//if it matches the file's size and mtime, otherwise builds it by
+	//scanning the file and saves it for the next open.
+	//Seek prefers a loaded index over the Cues.
+	virtual int LoadIndex(const char* media_path, const char* index_path = nullptr);
+	//Continues demuxing at the keyframe at or before timestamp (ns).
+	//Video tracks drop packets until their next keyframe and the
+	//first packet of every track carries pkt.discontinuity.
+	virtual int Seek(uint64_t timestamp, int flags = SEEK_PREV_KEYFRAME);
+	//counters of the cluster read ahead, null if it is not enabled
+	virtual const readahead_stats* GetReadaheadStats() const
+	{
+		return nullptr;
+	}
+private:
+	static void release_frame(_buffer_desc* buffer);
 };
 
 class mkv_source_factory {
 public:
 	static mkv_source* CreateFromFile(const char* path);
+	//packets point straight into a read only mapping of the file,
+	//which is kept alive until the last packet is released
+	static mkv_source* CreateFromFileMapped(const char* path);
+	//reads with pread (ReadFile at an offset on windows) and
+	//tracks its own position instead of seeking a FILE*.
+	//block_size is the read window under the parser, 0 reads unbuffered.
+	//readahead, if set, keeps the next clusters read in the background.
+	static mkv_source* CreateFromFilePositional(const char* path, size_t block_size = 64 * 1024,
+		const readahead_options* readahead = nullptr);
+	//same, over a file that other readers may share concurrently
+	static mkv_source* CreateFromFilePositional(std::shared_ptr<const positional_file> file, size_t block_size = 64 * 1024,
+		const readahead_options* readahead = nullptr);
+	//demuxes with the built in WebM parser (webm_demux.h) instead of
+	//matroska2, reading through a window of block_size bytes, at least
+	//4K. Returns null for files it does not handle (no tracks, or
+	//compressed or encrypted ones), open those with the others.
+	//LoadIndex is not available, Seek uses the Cues or a cluster scan.
+	static mkv_source* CreateFromFileNative(const char* path, size_t block_size = 64 * 1024);
+	//packets point straight into data, which must stay valid and unchanged
+	//until release(data, opaque) is called, once the source and the
+	//last packet are gone (also when opening fails). release may be null.
+	static mkv_source* CreateFromMemory(const void* data, size_t size,
+		void (*release)(const void* data, void* opaque) = nullptr, void* opaque = nullptr);
+	//demuxes a stream that cannot seek (pipe, stdin, live producer).
+	//read returns the bytes read, fewer than asked if that is all there
+	//is yet, and 0 at the end. The parser's seeks back are served from
+	//the last lookback bytes, so the headers must fit in them.
+	//Seek and LoadIndex are not available.
+	static mkv_source* CreateFromStream(size_t (*read)(void* buffer, size_t count, void* opaque), void* opaque,
+		size_t lookback = 4 * 1024 * 1024);
 };
 
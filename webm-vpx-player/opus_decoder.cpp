@@ -51,12 +51,10 @@ public:
 	}
 	virtual int QueueBuffer(_buffer_desc& in_buffer) override final
 	{
-		while (out_queue.front()) {
-			_buffer_desc* to_pop = out_queue.front();
-			to_pop->release(to_pop);
-			out_queue.pop();
-		}
-		in_queue.push(in_buffer);
+		release_decoded();
+		//a full queue refuses, the packet stays with the caller
+		if (!in_queue.try_emplace(in_buffer))
+			return E_AGAIN;
 		in_buffer.detail.pkt.buffer = nullptr;
 		in_buffer.release = nullptr;
 	//	nb_samples = opus_decoder_get_nb_samples(handle, in_buffer.detail.pkt.buffer->buffer, in_buffer.detail.pkt.size);
@@ -66,6 +64,18 @@ public:
 	//	return err;
 		return S_OK;
 	}
+	//takes what fits in the input queue, the rest stays with the caller
+	virtual int QueueBuffers(_buffer_desc* in_buffers, size_t count, size_t& done) override final
+	{
+		release_decoded();
+		done = 0;
+		while (done < count && in_queue.try_emplace(in_buffers[done])) {
+			in_buffers[done].detail.pkt.buffer = nullptr;
+			in_buffers[done].release = nullptr;
+			++done;
+		}
+		return done ? S_OK : E_AGAIN;
+	}
 	virtual int FetchBuffer(_buffer_desc& out_buffer) override final
 	{
 		int write_request = out_buffer.detail.aframe.nb_samples;
@@ -73,6 +83,11 @@ public:
 		int rate = out_buffer.detail.aframe.sample_rate;
 		float* to_fill = (float*)out_buffer.detail.aframe.channels[0];
 		int channel_count = out_stream.detail.audio.layout.channel_count;
+		//samples left over from before a seek
+		if (in_queue.front() && in_queue.front()->detail.pkt.discontinuity) {
+			nb_samples_in_buffer = 0;
+			sample_offset_in_buffer = 0;
+		}
 		if (nb_samples_in_buffer > sample_offset_in_buffer) {
 			int copied_samples = (write_request < nb_samples_in_buffer - sample_offset_in_buffer)?
 				write_request : nb_samples_in_buffer - sample_offset_in_buffer;
@@ -95,11 +110,15 @@ public:
 			}
 			else {
 				_buffer_desc& cur_input = *in_queue.front();
-				refed_buffer_block* block = cur_input.detail.pkt.buffer;
-				assert(block->refs.load() == 1);
-				int samples_in_packet = opus_decoder_get_nb_samples(handle, block->buffer, cur_input.detail.pkt.size);
+				const uint8_t* data = cur_input.detail.pkt.data;
+				assert(data);
+				if (cur_input.detail.pkt.discontinuity) {
+					opus_decoder_ctl(handle, OPUS_RESET_STATE);
+					cur_input.detail.pkt.discontinuity = false;
+				}
+				int samples_in_packet = opus_decoder_get_nb_samples(handle, data, cur_input.detail.pkt.size);
 				if (samples_in_packet < write_request - written) {
-					int decoded = opus_decode_float(handle, block->buffer, cur_input.detail.pkt.size, to_fill + channel_count * written, samples_in_packet, 0);
+					int decoded = opus_decode_float(handle, data, cur_input.detail.pkt.size, to_fill + channel_count * written, samples_in_packet, 0);
 					assert(decoded == samples_in_packet);
 					written += samples_in_packet;
 					out_buffer.detail.aframe.nb_samples = written;
@@ -108,7 +127,7 @@ public:
 					in_queue.pop();
 				}
 				else {
-					int decoded = opus_decode_float(handle, block->buffer, cur_input.detail.pkt.size, buffer, samples_in_packet, 0);
+					int decoded = opus_decode_float(handle, data, cur_input.detail.pkt.size, buffer, samples_in_packet, 0);
 					assert(decoded == samples_in_packet);
 					memcpy((to_fill + channel_count * written), buffer, (write_request-written)*sizeof(float)*channel_count);
 					nb_samples_in_buffer = samples_in_packet;
@@ -128,6 +147,18 @@ public:
 		cur_frame += written;
 		return S_OK;
 	}
+	//stops where a single fetch would have to conceal
+	virtual int FetchBuffers(_buffer_desc* out_buffers, size_t max, size_t& done) override final
+	{
+		done = 0;
+		while (done < max && (in_queue.front() || nb_samples_in_buffer > sample_offset_in_buffer)) {
+			int err = opus_decoder::FetchBuffer(out_buffers[done]);
+			if (err)
+				return done ? S_OK : err;
+			++done;
+		}
+		return done ? S_OK : E_AGAIN;
+	}
 	virtual int Probe()
 	{
 		return S_OK;
@@ -148,6 +179,16 @@ public:
 	{
 		return E_INVALID_OPERATION;
 	}
+private:
+	//packets already decoded go back to the demuxer
+	void release_decoded()
+	{
+		while (out_queue.front()) {
+			_buffer_desc* to_pop = out_queue.front();
+			to_pop->release(to_pop);
+			out_queue.pop();
+		}
+	}
 };
 
 audio_decoder* audio_decoder_factory::CreateDefaultOpusDecoder(stream_desc* upstream)
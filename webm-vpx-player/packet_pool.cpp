@@ -0,0 +1,206 @@
+#include "packet_pool.h"
+#include "media_buffer.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <new>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+struct thread_heap;
+
+//in front of every allocation, keeps the payload 16 byte aligned
+struct alignas(16) pool_header {
+	//null for allocations above the largest class
+	thread_heap* owner;
+	pool_header* next;
+	uint32_t size_class;
+	//requested size of large allocations
+	size_t size;
+};
+
+struct thread_heap {
+	//only touched by the thread owning the heap
+	pool_header* local[packet_pool::class_count]{};
+	//pushed by any thread, taken whole by the owner
+	std::atomic<pool_header*> remote[packet_pool::class_count]{};
+	std::atomic<uint64_t> allocs{0};
+	std::atomic<uint64_t> frees{0};
+	std::atomic<uint64_t> remote_frees{0};
+	std::atomic<uint64_t> system_allocs{0};
+	thread_heap* next_heap = nullptr;
+};
+
+std::mutex registry_mtx;
+thread_heap* all_heaps = nullptr;
+std::vector<thread_heap*> abandoned_heaps;
+std::atomic<uint64_t> large_allocs{0};
+std::atomic<uint64_t> large_frees{0};
+
+struct heap_handle {
+	thread_heap* heap = nullptr;
+	~heap_handle()
+	{
+		//blocks of this heap may still be in flight,
+		//so it is reused by the next thread, never freed
+		if (heap) {
+			std::lock_guard<std::mutex> lock(registry_mtx);
+			abandoned_heaps.push_back(heap);
+			heap = nullptr;
+		}
+	}
+};
+thread_local heap_handle current;
+
+thread_heap* get_heap()
+{
+	if (current.heap)
+		return current.heap;
+	std::lock_guard<std::mutex> lock(registry_mtx);
+	if (!abandoned_heaps.empty()) {
+		current.heap = abandoned_heaps.back();
+		abandoned_heaps.pop_back();
+	}
+	else {
+		current.heap = new thread_heap();
+		current.heap->next_heap = all_heaps;
+		all_heaps = current.heap;
+	}
+	return current.heap;
+}
+
+inline size_t class_bytes(uint32_t size_class)
+{
+	return size_t(1) << (size_class + packet_pool::min_class_shift);
+}
+
+inline uint32_t class_of(size_t bytes)
+{
+	uint32_t size_class = 0;
+	while (size_class < packet_pool::class_count && class_bytes(size_class) < bytes)
+		++size_class;
+	return size_class;
+}
+
+void dispose_block(refed_buffer_block* block)
+{
+	packet_pool::dealloc(block);
+}
+
+}
+
+void* packet_pool::alloc(size_t size)
+{
+	uint32_t size_class = class_of(size + sizeof(pool_header));
+	pool_header* header;
+	if (size_class == class_count) {
+		header = (pool_header*)malloc(sizeof(pool_header) + size);
+		if (!header)
+			return nullptr;
+		header->owner = nullptr;
+		header->size_class = class_count;
+		header->size = size;
+		++large_allocs;
+		return header + 1;
+	}
+	thread_heap* heap = get_heap();
+	header = heap->local[size_class];
+	if (!header)
+		header = heap->remote[size_class].exchange(nullptr, std::memory_order_acquire);
+	if (header) {
+		heap->local[size_class] = header->next;
+	}
+	else {
+		header = (pool_header*)malloc(class_bytes(size_class));
+		if (!header)
+			return nullptr;
+		header->owner = heap;
+		header->size_class = size_class;
+		heap->system_allocs.fetch_add(1, std::memory_order_relaxed);
+	}
+	header->size = size;
+	heap->allocs.fetch_add(1, std::memory_order_relaxed);
+	return header + 1;
+}
+
+void packet_pool::dealloc(void* mem)
+{
+	if (!mem)
+		return;
+	pool_header* header = (pool_header*)mem - 1;
+	thread_heap* owner = header->owner;
+	if (!owner) {
+		++large_frees;
+		free(header);
+		return;
+	}
+	uint32_t size_class = header->size_class;
+	owner->frees.fetch_add(1, std::memory_order_relaxed);
+	if (owner == current.heap) {
+		header->next = owner->local[size_class];
+		owner->local[size_class] = header;
+		return;
+	}
+	//push only, the owner takes the whole list, so no ABA
+	std::atomic<pool_header*>& remote = owner->remote[size_class];
+	header->next = remote.load(std::memory_order_relaxed);
+	while (!remote.compare_exchange_weak(header->next, header, std::memory_order_release, std::memory_order_relaxed)) {
+	}
+	owner->remote_frees.fetch_add(1, std::memory_order_relaxed);
+}
+
+size_t packet_pool::capacity(const void* mem)
+{
+	const pool_header* header = (const pool_header*)mem - 1;
+	if (!header->owner)
+		return header->size;
+	return class_bytes(header->size_class) - sizeof(pool_header);
+}
+
+void* packet_pool::realloc(void* mem, size_t size)
+{
+	if (!mem)
+		return alloc(size);
+	size_t old_capacity = capacity(mem);
+	if (size <= old_capacity) {
+		((pool_header*)mem - 1)->size = size;
+		return mem;
+	}
+	void* grown = alloc(size);
+	if (!grown)
+		return nullptr;
+	memcpy(grown, mem, old_capacity);
+	dealloc(mem);
+	return grown;
+}
+
+refed_buffer_block* packet_pool::alloc_block(size_t size)
+{
+	void* mem = alloc(sizeof(refed_buffer_block) + size);
+	if (!mem)
+		return nullptr;
+	refed_buffer_block* block = new(mem)refed_buffer_block();
+	block->dispose = dispose_block;
+	block->ref();
+	return block;
+}
+
+packet_pool::stats_t packet_pool::stats()
+{
+	stats_t out{};
+	std::lock_guard<std::mutex> lock(registry_mtx);
+	for (thread_heap* heap = all_heaps; heap; heap = heap->next_heap) {
+		out.allocs += heap->allocs.load(std::memory_order_relaxed);
+		out.frees += heap->frees.load(std::memory_order_relaxed);
+		out.remote_frees += heap->remote_frees.load(std::memory_order_relaxed);
+		out.system_allocs += heap->system_allocs.load(std::memory_order_relaxed);
+	}
+	out.large_allocs = large_allocs;
+	out.allocs += large_allocs;
+	out.frees += large_frees;
+	out.system_allocs += large_allocs;
+	return out;
+}
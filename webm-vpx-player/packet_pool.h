@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+struct refed_buffer_block;
+
+//Size class allocator for packet payloads (and the parser's own
+//allocations through InputStream::memalloc).
+//Every thread gets a heap with a plain free list per size class.
+//A block freed on the thread that allocated it goes back on that
+//list; a block freed elsewhere (decoder thread releasing a demuxed
+//packet) is pushed lock free onto the owning heap's remote list,
+//which the owner takes over in one exchange when its list runs dry.
+//Heaps of exited threads are handed to the next new thread.
+//Sizes above the largest class go straight to malloc.
+class packet_pool {
+public:
+	//256 bytes
+	static constexpr int min_class_shift = 8;
+	//256 bytes .. 4 MiB including the header
+	static constexpr int class_count = 15;
+	struct stats_t {
+		uint64_t allocs;
+		uint64_t frees;
+		//frees from a thread other than the allocating one
+		uint64_t remote_frees;
+		//allocations that had to go to malloc
+		uint64_t system_allocs;
+		uint64_t large_allocs;
+	};
+	static void* alloc(size_t size);
+	static void dealloc(void* mem);
+	static void* realloc(void* mem, size_t size);
+	//usable bytes of an allocation
+	static size_t capacity(const void* mem);
+	//a block with room for size bytes holding one ref,
+	//recycled into the pool by its last unref
+	static refed_buffer_block* alloc_block(size_t size);
+	static stats_t stats();
+};
@@ -0,0 +1,324 @@
+#include "media_transform.h"
+#include "vp9_header.h"
+
+#include <cassert>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <memory>
+
+//Offline VP9 decoding over key frame segments: a key frame refreshes
+//every reference slot, so the packets from one key frame up to the
+//next decode on their own. QueueBuffer cuts the packets into such
+//segments, a pool of workers, each with a VP9 decoder of its own
+//(refed frames, reused from segment to segment as each starts with a
+//key frame), takes them in order and FetchBuffer hands the frames out
+//segment by segment. The segments waiting to be fetched form the
+//reorder buffer: their frames count against max_buffered, and a
+//worker past it waits unless its segment is the one being fetched
+//and all its frames were, so the buffer drains.
+//One thread queues and flushes, any other fetches; the output
+//stream's format is updated by FetchBuffer, from the frame it hands out.
+class vp9_gop_decoder: public video_decoder {
+	//a decoded frame and its format, or the error of its packet
+	struct output {
+		_buffer_desc frame;
+		stream_desc::video_info format;
+		int error;
+	};
+	struct segment {
+		std::vector<_buffer_desc> packets;
+		//decoded, in order, waiting to be fetched
+		std::deque<output> frames;
+		bool taken = false;
+		bool done = false;
+	};
+	struct worker {
+		//a copy of the upstream, the decoder takes it over
+		stream_desc upstream;
+		video_decoder* decoder = nullptr;
+		std::thread thread;
+		worker(const stream_desc& upstream) : upstream(upstream) {}
+	};
+	stream_desc out_stream;
+	const size_t max_buffered;
+	size_t max_queued;
+	std::vector<std::unique_ptr<worker>> workers;
+	//being queued into, only touched by the queueing thread
+	std::unique_ptr<segment> open{new segment()};
+	//the rest guarded by mtx
+	std::mutex mtx;
+	//workers: a segment to take, room in the buffer
+	std::condition_variable work_cond;
+	//fetch: a frame, a segment done
+	std::condition_variable fetch_cond;
+	//queue: a segment taken
+	std::condition_variable queue_cond;
+	//in stream order, the front one is being fetched
+	std::deque<std::unique_ptr<segment>> segments;
+	//segments not taken yet
+	size_t queued = 0;
+	//bytes of the frames in segments
+	size_t buffered = 0;
+	bool ended = false;
+	bool stop = false;
+public:
+	vp9_gop_decoder(stream_desc* upstream, const video_decoder_factory::gop_options& options):
+		video_decoder(decoder_type::VD_VP9_GOP_PARALLEL_DECODER), max_buffered(options.max_buffered) {
+		assert(upstream->type == stream_desc::MTYPE_VIDEO);
+		assert(upstream->detail.video.codec == stream_desc::video_info::VCODEC_VP9);
+		uint32_t count = options.workers;
+		if (!count)
+			count = std::thread::hardware_concurrency();
+		if (!count)
+			count = 1;
+		max_queued = options.max_queued_segments ? options.max_queued_segments : 2 * count;
+		video_decoder_factory::vp9_options decoder_options = options.decoder;
+		decoder_options.refed_frames = true;
+		decoder_options.decode_ahead = 0;
+		for (uint32_t i = 0; i < count; ++i) {
+			workers.emplace_back(new worker(*upstream));
+			worker& w = *workers.back();
+			w.decoder = video_decoder_factory::CreateVP9Decoder(&w.upstream, decoder_options);
+		}
+		out_stream.type = stream_desc::MTYPE_VIDEO;
+		out_stream.detail.video = upstream->detail.video;
+		out_stream.detail.video.codec = stream_desc::video_info::VCODEC_RAW;
+		out_stream.upstream = this;
+		out_stream.time_base = upstream->time_base;
+		out_stream.mode = stream_desc::MODE_REACTIVE;
+		upstream->downstream = this;
+		desc_in = upstream;
+		desc_out = &out_stream;
+		for (auto& w : workers)
+			w->thread = std::thread(&vp9_gop_decoder::work, this, w.get());
+	}
+	virtual ~vp9_gop_decoder()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stop = true;
+		}
+		work_cond.notify_all();
+		queue_cond.notify_all();
+		for (auto& w : workers)
+			w->thread.join();
+		for (auto& s : segments)
+			drop(*s);
+		drop(*open);
+		for (auto& w : workers)
+			delete w->decoder;
+	}
+	//Takes the packet over; a key frame closes the segment queued so
+	//far and hands it to the workers, waiting while max_queued_segments
+	//are not taken yet.
+	virtual int QueueBuffer(_buffer_desc& buffer) override final
+	{
+		bool key = buffer.detail.pkt.key_frame;
+		//the container's flag for streams that set it wrong or not at all
+		vp9_frame_header header;
+		const uint8_t* frames[8];
+		size_t sizes[8];
+		if (buffer.detail.pkt.size && split_vp9_superframe(buffer.detail.pkt.data, buffer.detail.pkt.size, frames, sizes) &&
+			parse_vp9_header(frames[0], sizes[0], header))
+			key = header.key_frame;
+		if (key && !open->packets.empty())
+			close_open();
+		if (open->packets.empty() && !key) {
+			//nothing to decode it against
+			if (buffer.release)
+				buffer.release(&buffer);
+			return S_OK;
+		}
+		open->packets.push_back(buffer);
+		buffer.detail.pkt.buffer = nullptr;
+		buffer.release = nullptr;
+		if (ended) {
+			std::lock_guard<std::mutex> lock(mtx);
+			ended = false;
+		}
+		return S_OK;
+	}
+	//The next frame in order, waiting for it while its segment is
+	//being decoded; E_DECODE_ERROR in place of a packet that failed.
+	virtual int FetchBuffer(_buffer_desc& buffer) override final
+	{
+		//the previous frame's ref, if not released
+		if (buffer.release)
+			buffer.release(&buffer);
+		buffer.release = nullptr;
+		std::unique_lock<std::mutex> lock(mtx);
+		while (!segments.empty()) {
+			segment& head = *segments.front();
+			if (!head.frames.empty() && head.frames.front().error) {
+				int err = head.frames.front().error;
+				head.frames.pop_front();
+				lock.unlock();
+				work_cond.notify_all();
+				for (int i = 0; i < 4; ++i) {
+					buffer.detail.image.planes[i] = nullptr;
+					buffer.detail.image.line_size[i] = 0;
+				}
+				return err;
+			}
+			if (!head.frames.empty()) {
+				const _buffer_desc& frame = head.frames.front().frame;
+				buffered -= frame_bytes(frame, head.frames.front().format);
+				out_stream.detail.video = head.frames.front().format;
+				buffer.stream = &out_stream;
+				buffer.start_timestamp = frame.start_timestamp;
+				buffer.end_timestamp = frame.end_timestamp;
+				buffer.detail.image = frame.detail.image;
+				buffer.release = frame.release;
+				buffer.release_private_ptr = frame.release_private_ptr;
+				head.frames.pop_front();
+				lock.unlock();
+				work_cond.notify_all();
+				return S_OK;
+			}
+			if (head.done) {
+				segments.pop_front();
+				//the next one may go on past max_buffered now
+				work_cond.notify_all();
+				continue;
+			}
+			fetch_cond.wait(lock);
+		}
+		for (int i = 0; i < out_stream.detail.video.planes; ++i) {
+			buffer.detail.image.planes[i] = nullptr;
+			buffer.detail.image.line_size[i] = 0;
+		}
+		return ended ? E_EOF : E_AGAIN;
+	}
+	//drops the frame's ref
+	virtual int ReleaseBuffer(_buffer_desc& buffer) override final
+	{
+		if (buffer.release)
+			buffer.release(&buffer);
+		return S_OK;
+	}
+	virtual int AllocBuffer(_buffer_desc& buffer) override final
+	{
+		return E_INVALID_OPERATION;
+	}
+	//the last packet is queued: the segment queued so far goes to the
+	//workers, FetchBuffer returns E_EOF after its last frame
+	virtual int Flush() override final
+	{
+		if (!open->packets.empty())
+			close_open();
+		std::lock_guard<std::mutex> lock(mtx);
+		ended = true;
+		return S_OK;
+	}
+	virtual int Dropped(int samples) override final
+	{
+		return E_UNIMPLEMENTED;
+	}
+	virtual int Probe() override final
+	{
+		return E_UNIMPLEMENTED;
+	}
+private:
+	static size_t frame_bytes(const _buffer_desc& frame, const stream_desc::video_info& format)
+	{
+		const _buffer_desc::buffer_detail::image_frame& image = frame.detail.image;
+		size_t shift = format.fmt.subsample_vert;
+		size_t chroma_height = ((size_t)image.height + (1 << shift) - 1) >> shift;
+		return ((size_t)image.line_size[0] + image.line_size[3]) * image.height +
+			((size_t)image.line_size[1] + image.line_size[2]) * chroma_height;
+	}
+	static void drop(segment& s)
+	{
+		for (_buffer_desc& packet : s.packets) {
+			if (packet.release)
+				packet.release(&packet);
+		}
+		for (output& out : s.frames) {
+			if (out.frame.release)
+				out.frame.release(&out.frame);
+		}
+		s.packets.clear();
+		s.frames.clear();
+	}
+	void close_open()
+	{
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			queue_cond.wait(lock, [this] { return stop || queued < max_queued; });
+			segments.push_back(std::move(open));
+			++queued;
+		}
+		work_cond.notify_all();
+		open.reset(new segment());
+	}
+	segment* next_segment()
+	{
+		for (auto& s : segments) {
+			if (!s->taken)
+				return s.get();
+		}
+		return nullptr;
+	}
+	void work(worker* w)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		while (true) {
+			segment* job = nullptr;
+			work_cond.wait(lock, [&] { return stop || (job = next_segment()) != nullptr; });
+			if (stop)
+				return;
+			job->taken = true;
+			--queued;
+			queue_cond.notify_one();
+			for (_buffer_desc& packet : job->packets) {
+				//the fetched segment goes on only while its frames are
+				//drained, else a long one would fill memory on its own
+				work_cond.wait(lock, [&] { return stop || buffered < max_buffered || (job == segments.front().get() && job->frames.empty()); });
+				if (stop)
+					return;
+				lock.unlock();
+				uint64_t start = packet.start_timestamp;
+				uint64_t end = packet.end_timestamp;
+				//released by the decoder once decoded
+				w->decoder->QueueBuffer(packet);
+				_buffer_desc frame{};
+				int err = w->decoder->FetchBuffer(frame);
+				//no shown frame in the packet
+				if (err == E_AGAIN) {
+					lock.lock();
+					continue;
+				}
+				//the worker's decoder updated it on this thread
+				stream_desc* decoded;
+				size_t num;
+				w->decoder->GetOutputs(decoded, num);
+				lock.lock();
+				if (err) {
+					//fetched in its place in the stream
+					job->frames.push_back(output{ frame, decoded->detail.video, err });
+				}
+				else {
+					frame.stream = &out_stream;
+					frame.start_timestamp = start;
+					frame.end_timestamp = end;
+					buffered += frame_bytes(frame, decoded->detail.video);
+					job->frames.push_back(output{ frame, decoded->detail.video, S_OK });
+				}
+				if (job == segments.front().get())
+					fetch_cond.notify_one();
+			}
+			job->packets.clear();
+			job->done = true;
+			fetch_cond.notify_one();
+		}
+	}
+};
+
+video_decoder* video_decoder_factory::CreateParallelVP9Decoder(stream_desc* upstream, const gop_options& options)
+{
+	assert(upstream);
+	return new vp9_gop_decoder(upstream, options);
+}
@@ -0,0 +1,324 @@
+#pragma once
+
+//Header only reader of the VP9 uncompressed frame header (VP9
+//bitstream specification, 6.2) and the superframe index (annex B),
+//for what the player decides before decoding: whether a frame is
+//shown, which reference slots it refreshes, whether it can be left
+//undecoded and its tile layout.
+//
+//Stateless: an inter frame that takes its size from a reference
+//leaves the size and with it the tile layout unknown, so has_tiles
+//is set only for key frames, intra only frames and inter frames
+//that code their size.
+
+#include <cstdint>
+#include <cstddef>
+
+struct vp9_frame_header {
+	uint32_t profile = 0;
+	//shows a frame decoded before, nothing else is coded
+	bool show_existing_frame = false;
+	bool key_frame = false;
+	bool show_frame = false;
+	bool intra_only = false;
+	bool error_resilient = false;
+	//bit i set: reference slot i takes this frame
+	uint8_t refresh_frame_flags = 0;
+	//0 none, 2 the frame context used, 3 all of them reset to defaults
+	//(for intra only frames; key and error resilient frames reset all)
+	uint32_t reset_frame_context = 0;
+	//the probabilities adapted by the frame are saved for later frames
+	bool refresh_frame_context = false;
+	//0 if taken from a reference
+	uint32_t width = 0;
+	uint32_t height = 0;
+	bool has_tiles = false;
+	uint32_t log2_tile_cols = 0;
+	uint32_t log2_tile_rows = 0;
+};
+
+//msb first, reads past the end as zeros and remembers it
+class vp9_bit_reader {
+	const uint8_t* data;
+	size_t size;
+	size_t pos = 0;
+public:
+	vp9_bit_reader(const uint8_t* data, size_t size) : data(data), size(size) {}
+	uint32_t f(int bits)
+	{
+		uint32_t value = 0;
+		for (int i = 0; i < bits; ++i, ++pos) {
+			uint32_t bit = pos >> 3 < size ? (data[pos >> 3] >> (7 - (pos & 7))) & 1 : 0;
+			value = (value << 1) | bit;
+		}
+		return value;
+	}
+	//a magnitude followed by its sign, only skipped here
+	void su(int bits)
+	{
+		f(bits + 1);
+	}
+	bool overrun() const
+	{
+		return pos > size * 8;
+	}
+};
+
+namespace vp9_header_detail {
+
+inline bool sync_code(vp9_bit_reader& bits)
+{
+	return bits.f(24) == 0x498342;
+}
+
+inline void color_config(vp9_bit_reader& bits, uint32_t profile)
+{
+	if (profile >= 2)
+		bits.f(1);
+	//CS_RGB
+	if (bits.f(3) != 7) {
+		bits.f(1);
+		if (profile == 1 || profile == 3)
+			bits.f(3);
+	}
+	else if (profile == 1 || profile == 3) {
+		bits.f(1);
+	}
+}
+
+inline void frame_size(vp9_bit_reader& bits, vp9_frame_header& header)
+{
+	header.width = bits.f(16) + 1;
+	header.height = bits.f(16) + 1;
+}
+
+inline void render_size(vp9_bit_reader& bits)
+{
+	if (bits.f(1))
+		bits.f(32);
+}
+
+inline void loop_filter_params(vp9_bit_reader& bits)
+{
+	bits.f(6 + 3);
+	if (bits.f(1) && bits.f(1)) {
+		for (int i = 0; i < 4 + 2; ++i) {
+			if (bits.f(1))
+				bits.su(6);
+		}
+	}
+}
+
+inline void quantization_params(vp9_bit_reader& bits)
+{
+	bits.f(8);
+	for (int i = 0; i < 3; ++i) {
+		if (bits.f(1))
+			bits.su(4);
+	}
+}
+
+inline void segmentation_params(vp9_bit_reader& bits)
+{
+	if (!bits.f(1))
+		return;
+	if (bits.f(1)) {
+		for (int i = 0; i < 7; ++i) {
+			if (bits.f(1))
+				bits.f(8);
+		}
+		if (bits.f(1)) {
+			for (int i = 0; i < 3; ++i) {
+				if (bits.f(1))
+					bits.f(8);
+			}
+		}
+	}
+	if (bits.f(1)) {
+		static const int feature_bits[4] = { 8, 6, 2, 0 };
+		static const bool feature_signed[4] = { true, true, false, false };
+		bits.f(1);
+		for (int segment = 0; segment < 8; ++segment) {
+			for (int feature = 0; feature < 4; ++feature) {
+				if (bits.f(1)) {
+					bits.f(feature_bits[feature]);
+					if (feature_signed[feature])
+						bits.f(1);
+				}
+			}
+		}
+	}
+}
+
+inline void tile_info(vp9_bit_reader& bits, vp9_frame_header& header)
+{
+	uint32_t sb64_cols = (((header.width + 7) >> 3) + 7) >> 3;
+	uint32_t min_log2 = 0;
+	while ((64u << min_log2) < sb64_cols)
+		++min_log2;
+	uint32_t max_log2 = 1;
+	while ((sb64_cols >> max_log2) >= 4)
+		++max_log2;
+	--max_log2;
+	header.log2_tile_cols = min_log2;
+	while (header.log2_tile_cols < max_log2 && bits.f(1))
+		++header.log2_tile_cols;
+	header.log2_tile_rows = bits.f(1);
+	if (header.log2_tile_rows)
+		header.log2_tile_rows += bits.f(1);
+	header.has_tiles = true;
+}
+
+}
+
+//false if data does not start with a VP9 frame header
+inline bool parse_vp9_header(const uint8_t* data, size_t size, vp9_frame_header& header)
+{
+	using namespace vp9_header_detail;
+	header = vp9_frame_header();
+	vp9_bit_reader bits(data, size);
+	//frame_marker
+	if (bits.f(2) != 2)
+		return false;
+	header.profile = bits.f(1);
+	header.profile |= bits.f(1) << 1;
+	if (header.profile == 3 && bits.f(1))
+		return false;
+	header.show_existing_frame = bits.f(1) != 0;
+	if (header.show_existing_frame) {
+		bits.f(3);
+		header.show_frame = true;
+		return !bits.overrun();
+	}
+	header.key_frame = bits.f(1) == 0;
+	header.show_frame = bits.f(1) != 0;
+	header.error_resilient = bits.f(1) != 0;
+	bool sized = true;
+	if (header.key_frame) {
+		if (!sync_code(bits))
+			return false;
+		color_config(bits, header.profile);
+		frame_size(bits, header);
+		render_size(bits);
+		header.refresh_frame_flags = 0xFF;
+	}
+	else {
+		header.intra_only = header.show_frame ? false : bits.f(1) != 0;
+		if (!header.error_resilient)
+			header.reset_frame_context = bits.f(2);
+		if (header.intra_only) {
+			if (!sync_code(bits))
+				return false;
+			if (header.profile > 0)
+				color_config(bits, header.profile);
+			header.refresh_frame_flags = (uint8_t)bits.f(8);
+			frame_size(bits, header);
+			render_size(bits);
+		}
+		else {
+			header.refresh_frame_flags = (uint8_t)bits.f(8);
+			//ref_frame_idx and sign bias
+			bits.f(3 * 4);
+			bool found_ref = false;
+			for (int i = 0; i < 3 && !found_ref; ++i)
+				found_ref = bits.f(1) != 0;
+			if (found_ref)
+				sized = false;
+			else
+				frame_size(bits, header);
+			render_size(bits);
+			//allow_high_precision_mv, interpolation filter
+			bits.f(1);
+			if (!bits.f(1))
+				bits.f(2);
+		}
+	}
+	if (!header.error_resilient) {
+		header.refresh_frame_context = bits.f(1) != 0;
+		//frame_parallel_decoding_mode
+		bits.f(1);
+	}
+	//frame_context_idx
+	bits.f(2);
+	loop_filter_params(bits);
+	quantization_params(bits);
+	segmentation_params(bits);
+	if (sized)
+		tile_info(bits, header);
+	return !bits.overrun();
+}
+
+//whether frame can be left undecoded when next is the frame after it:
+//decoding next alone gives what decoding both would. frame refreshes
+//no reference slot, and next does not read what else frame leaves in
+//the decoder (the previous frame's motion vectors and segmentation
+//map, the loop filter deltas and segmentation features), which holds
+//for key, intra only and error resilient frames; frame contexts saved
+//by frame have to be reset by next too.
+inline bool vp9_frame_skippable(const vp9_frame_header& frame, const vp9_frame_header& next)
+{
+	if (frame.refresh_frame_flags)
+		return false;
+	if (!next.key_frame && !next.intra_only && !next.error_resilient)
+		return false;
+	return !frame.refresh_frame_context || next.key_frame || next.error_resilient || next.reset_frame_context == 3;
+}
+
+//the frames of a superframe, or the packet as its only frame.
+//Returns the number of frames (up to 8) put into frames and sizes.
+inline size_t split_vp9_superframe(const uint8_t* data, size_t size, const uint8_t* frames[8], size_t sizes[8])
+{
+	if (size) {
+		uint8_t marker = data[size - 1];
+		if ((marker & 0xE0) == 0xC0) {
+			size_t count = (marker & 7) + 1;
+			size_t bytes = ((marker >> 3) & 3) + 1;
+			size_t index_size = 2 + bytes * count;
+			if (size >= index_size && data[size - index_size] == marker) {
+				const uint8_t* p = data + size - index_size + 1;
+				const uint8_t* frame = data;
+				size_t left = size - index_size;
+				size_t n = 0;
+				for (size_t i = 0; i < count; ++i) {
+					size_t frame_size = 0;
+					for (size_t b = 0; b < bytes; ++b)
+						frame_size |= (size_t)*p++ << (8 * b);
+					if (frame_size > left)
+						break;
+					frames[n] = frame;
+					sizes[n++] = frame_size;
+					frame += frame_size;
+					left -= frame_size;
+				}
+				if (n)
+					return n;
+			}
+		}
+	}
+	frames[0] = data;
+	sizes[0] = size;
+	return 1;
+}
+
+//vp9_frame_skippable for every frame of the packet, next being the
+//packet after it; false if either does not parse
+inline bool vp9_packet_skippable(const uint8_t* data, size_t size, const uint8_t* next, size_t next_size)
+{
+	const uint8_t* frames[8 + 1];
+	size_t sizes[8 + 1];
+	size_t count = split_vp9_superframe(data, size, frames, sizes);
+	const uint8_t* next_frames[8];
+	size_t next_sizes[8];
+	split_vp9_superframe(next, next_size, next_frames, next_sizes);
+	frames[count] = next_frames[0];
+	sizes[count] = next_sizes[0];
+	vp9_frame_header frame, following;
+	if (!parse_vp9_header(frames[0], sizes[0], frame))
+		return false;
+	for (size_t i = 0; i < count; ++i) {
+		if (!parse_vp9_header(frames[i + 1], sizes[i + 1], following) || !vp9_frame_skippable(frame, following))
+			return false;
+		frame = following;
+	}
+	return true;
+}
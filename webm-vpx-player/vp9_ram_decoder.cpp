@@ -1,4 +1,6 @@
 #include "media_transform.h"
+#include "frame_pool.h"
+#include "vp9_header.h"
 
 #include <vpx/vpx_codec.h>
 #include <vpx/vpx_decoder.h>
@@ -8,12 +10,35 @@
 #include <rigtorp/SPSCQueue.h>
 
 #include <thread>
+#include <atomic>
 #include <condition_variable>
+#include <vector>
+#include <memory>
+#include <cstring>
+
+//vp8dx.h declares VP9_SET_BYTE_ALIGNMENT without its argument type
+//before libvpx 1.8, which vpx_codec_control needs to be type checked
+#ifndef VPX_CTRL_VP9_SET_BYTE_ALIGNMENT
+VPX_CTRL_USE_TYPE(VP9_SET_BYTE_ALIGNMENT, int)
+#define VPX_CTRL_VP9_SET_BYTE_ALIGNMENT
+#endif
 
 //implemets the default vp9 decoder with internal
 //framebuffers and frame by frame decoding.
 //(Also with postprocessing by default, maybe
 //add a flag to request)
+//With decode_depth set, decodes ahead on a thread of its own
+//instead: the worker drains in_queue and copies every frame out
+//of the decoder's buffers (they are only valid until the next
+//decode) into a slot, up to decode_depth frames wait to be fetched.
+//With refed_frames, decodes into buffers of a frame_pool instead:
+//every frame fetched holds a ref on its buffer until ReleaseBuffer,
+//and decoding ahead passes the buffers on without copying.
+//The libvpx controls of vp9_options are set before the first decode.
+//FetchBufferBefore leaves late packets undecoded where the header of
+//the packet after tells that nothing depends on them; to look past a
+//packet, it is taken out of in_queue into held, which whoever decodes
+//(the fetching thread, or the worker decoding ahead) takes first.
 class libvpx_vp9_ram_decoder: public video_decoder {
 	const vpx_codec_iface_t* const iface;
 	vpx_codec_ctx ctx;
@@ -26,15 +51,59 @@ class libvpx_vp9_ram_decoder: public video_decoder {
 	rigtorp::SPSCQueue<_buffer_desc> in_queue{10000};
 	vpx_image_t* last_image = nullptr;
 	uint64_t cur_timestamp = 0;
+	//auto_threads: row-MT is still to be picked at the first key frame
+	bool tune_pending;
+	//the next packet to decode when holding, out of in_queue
+	_buffer_desc held;
+	bool holding = false;
+	//packets skipped since the last frame out of the decoder
+	uint32_t skipped = 0;
+	//from the last FetchBufferBefore for the worker decoding ahead,
+	//0 none: FetchBuffer and Flush clear it
+	std::atomic<uint64_t> late_deadline{0};
+
+	//decode ahead, 0 decodes in FetchBuffer
+	const uint32_t decode_depth;
+	//the decoder's frame buffers with refed_frames, else null
+	frame_pool* pool = nullptr;
+	//a decoded frame, copied out of the decoder or holding a ref
+	struct frame_slot {
+		std::vector<uint8_t> storage;
+		//planes point into storage or frame
+		vpx_image_t image;
+		frame_buffer* frame = nullptr;
+		uint32_t skipped = 0;
+		//in place of a frame: the packet here failed to decode,
+		//a fetch returns it in stream order
+		int error = S_OK;
+	};
+	//all below guarded by decode_mtx. Slots are free, ready to be
+	//fetched or lent to the consumer until its next fetch or release
+	//(copies only, a ref moves on to the fetched frame).
+	std::vector<std::unique_ptr<frame_slot>> slots;
+	std::vector<frame_slot*> free_slots;
+	//ring of decode_depth
+	std::vector<frame_slot*> ready_frames;
+	size_t ready_head = 0;
+	size_t ready_count = 0;
+	std::vector<frame_slot*> lent_frames;
+	bool stop = false;
+	//Flush was called, the worker drains the decoder after in_queue
+	bool end_requested = false;
+	//the decoder is drained, nothing more comes until the next packet
+	bool ended = false;
 
 	std::thread decode_thread;
 	std::condition_variable decode_cond;
 	std::mutex decode_mtx;
 public:
-	libvpx_vp9_ram_decoder(stream_desc* upstream, uint32_t threads = 1, int flags = VPX_CODEC_USE_POSTPROC):
+	//options.threads already resolved with auto_threads
+	libvpx_vp9_ram_decoder(stream_desc* upstream, const video_decoder_factory::vp9_options& options):
 		video_decoder(decoder_type::VD_VP9_RAM_VPX_IMG_DECODER),iface(vpx_codec_vp9_dx()), 
-		cfg{threads, upstream->detail.video.width, upstream->detail.video.height}, mflags(flags),
-		init_err(vpx_codec_dec_init(&ctx, iface, &cfg, mflags)), iter(NULL) {
+		cfg{options.threads, upstream->detail.video.width, upstream->detail.video.height},
+		mflags(options.post_proc ? VPX_CODEC_USE_POSTPROC : 0),
+		init_err(vpx_codec_dec_init(&ctx, iface, &cfg, mflags)), iter(NULL),
+		tune_pending(options.auto_threads && !init_err), decode_depth(options.decode_ahead) {
 		assert(upstream->type == stream_desc::MTYPE_VIDEO);
 		assert(upstream->detail.video.codec == stream_desc::video_info::VCODEC_VP9);
 		out_stream.type =stream_desc::MTYPE_VIDEO;
@@ -46,10 +115,54 @@ public:
 		upstream->downstream = this;
 		desc_in = upstream;
 		desc_out = &out_stream;
+		if (!init_err) {
+			if (options.row_mt && !options.auto_threads)
+				vpx_codec_control(&ctx, VP9D_SET_ROW_MT, 1);
+			if (options.loop_filter_opt)
+				vpx_codec_control(&ctx, VP9D_SET_LOOP_FILTER_OPT, 1);
+			if (options.skip_loop_filter)
+				vpx_codec_control(&ctx, VP9_SET_SKIP_LOOP_FILTER, 1);
+			if (options.svc_spatial_layer >= 0)
+				vpx_codec_control(&ctx, VP9_DECODE_SVC_SPATIAL_LAYER, options.svc_spatial_layer);
+		}
+		//planes and strides of the pool's frames aligned to 64 bytes;
+		//if the decoder cannot, frames are copied out as without a pool
+		if (options.refed_frames && !init_err && vpx_codec_control(&ctx, VP9_SET_BYTE_ALIGNMENT, 64) == VPX_CODEC_OK) {
+			pool = frame_pool::create(frame_size(upstream->detail.video), options.huge_pages);
+			if (vpx_codec_set_frame_buffer_functions(&ctx, get_frame_buffer, release_frame_buffer, pool)) {
+				pool->close();
+				pool = nullptr;
+			}
+		}
+		ready_frames.resize(decode_depth);
+		if (decode_depth && !init_err)
+			decode_thread = std::thread(thread_proc_proxy, this);
 	}
 	virtual ~libvpx_vp9_ram_decoder() override final
 	{
+		if (decode_thread.joinable()) {
+			{
+				std::lock_guard<std::mutex> lock(decode_mtx);
+				stop = true;
+			}
+			decode_cond.notify_one();
+			decode_thread.join();
+		}
+		//fetched ones keep theirs
+		for (auto& slot : slots) {
+			if (slot->frame)
+				slot->frame->unref();
+		}
+		//packets never decoded
+		while (_buffer_desc* input = next_packet()) {
+			if (input->release)
+				input->release(input);
+			pop_packet();
+		}
 		vpx_codec_destroy(&ctx);
+		//after the decoder's refs are gone
+		if (pool)
+			pool->close();
 	}
 	//for decoders, this means sending a packet into decoder
 	virtual int QueueBuffer(_buffer_desc& buffer) override final
@@ -61,15 +174,42 @@ public:
 //		int err = vpx_codec_decode(&ctx, buffer.detail.pkt.buffer->buffer,buffer.detail.pkt.size, (void*)buffer.start_timestamp, 0);
 //		buffer.release(&buffer);
 //		return err;
-		in_queue.emplace(buffer);
+		//a full queue refuses, the packet stays with the caller
+		if (!in_queue.try_emplace(buffer))
+			return E_AGAIN;
+		//the queued copy owns the packet now
+		buffer.detail.pkt.buffer = nullptr;
+		buffer.release = nullptr;
+		if (decode_depth)
+			wake_worker();
 		return S_OK;
 	}
-	//for decoders, this means getting a frame from decoder
+	virtual int QueueBuffers(_buffer_desc* buffers, size_t count, size_t& done) override final
+	{
+		done = 0;
+		while (done < count && in_queue.try_emplace(buffers[done])) {
+			buffers[done].detail.pkt.buffer = nullptr;
+			buffers[done].release = nullptr;
+			++done;
+		}
+		if (done && decode_depth)
+			wake_worker();
+		return done ? S_OK : E_AGAIN;
+	}
+	//for decoders, this means getting a frame from decoder.
+	//Decoding ahead, never waits: E_AGAIN if no frame is ready yet,
+	//E_EOF once everything before Flush has been fetched.
 	virtual int FetchBuffer(_buffer_desc& buffer) override final
 	{
+		if (decode_depth) {
+			//no deadline, the worker decodes everything from here on
+			late_deadline.store(0, std::memory_order_relaxed);
+			size_t done;
+			return fetch_ready(&buffer, 1, done);
+		}
 		//Get next video frame.
 		int err = S_OK;
-		if (!in_queue.front()) {
+		if (!next_packet()) {
 			for (int i = 0; i < out_stream.detail.video.planes; ++i) {
 				buffer.detail.image.planes[i] = nullptr;
 				buffer.detail.image.line_size[i] = 0;
@@ -79,16 +219,27 @@ public:
 		else {
 			last_image = vpx_codec_get_frame(&ctx, &iter);
 			if (!last_image) {
-				_buffer_desc& cur_input = *in_queue.front();
+				_buffer_desc& cur_input = *next_packet();
 				assert(cur_input.detail.pkt.size);
-				err = vpx_codec_decode(&ctx, cur_input.detail.pkt.buffer->buffer, cur_input.detail.pkt.size, (void*)cur_input.start_timestamp, 0);
+				err = decode(cur_input);
 				iter = nullptr;
-				cur_input.release(&buffer);
-				in_queue.pop();
+				if (cur_input.release)
+					cur_input.release(&cur_input);
+				pop_packet();
 				last_image = vpx_codec_get_frame(&ctx, &iter);
-				assert(last_image);
+				//a corrupt packet, or one without a shown frame
+				if (!last_image) {
+					for (int i = 0; i < out_stream.detail.video.planes; ++i) {
+						buffer.detail.image.planes[i] = nullptr;
+						buffer.detail.image.line_size[i] = 0;
+					}
+					return err ? E_DECODE_ERROR : E_AGAIN;
+				}
 			}
 			translate_from_vpx_img(buffer, last_image);
+			hold_frame(buffer, pooled_ref(last_image));
+			buffer.detail.image.skipped = skipped;
+			skipped = 0;
 			desc_out->detail.video.space = translate_from_vpx_cs(last_image->cs);
 			video_sample_format fmt;
 			translate_from_vpx_fmt(fmt, last_image->fmt);
@@ -97,10 +248,64 @@ public:
 			return S_OK;
 		}
 	}
+	//Skips the late packets first, decoding or not. Decoding ahead,
+	//the worker skips against the latest deadline given before it
+	//decodes a packet; frames decoded already are fetched as they are.
+	virtual int FetchBufferBefore(_buffer_desc& buffer, uint64_t deadline) override final
+	{
+		if (decode_depth) {
+			late_deadline.store(deadline, std::memory_order_relaxed);
+			size_t done;
+			return fetch_ready(&buffer, 1, done);
+		}
+		skip_late(deadline);
+		return libvpx_vp9_ram_decoder::FetchBuffer(buffer);
+	}
+	//Images from the decoder's internal buffers are only valid until
+	//the next decode, so a batch never goes past the frames of one
+	//decode call (a single frame for vp9 without superframe output).
+	virtual int FetchBuffers(_buffer_desc* buffers, size_t max, size_t& done) override final
+	{
+		done = 0;
+		if (!max)
+			return S_OK;
+		if (decode_depth)
+			return fetch_ready(buffers, max, done);
+		int err = libvpx_vp9_ram_decoder::FetchBuffer(buffers[0]);
+		if (err)
+			return err;
+		done = 1;
+		while (done < max) {
+			vpx_image_t* image = vpx_codec_get_frame(&ctx, &iter);
+			if (!image)
+				break;
+			last_image = image;
+			translate_from_vpx_img(buffers[done], image);
+			hold_frame(buffers[done], pooled_ref(image));
+			++done;
+		}
+		return S_OK;
+	}
 	//This is for cases where the frame is owned or refed
-	//by the user and needs to be freed
+	//by the user and needs to be freed.
+	//Drops the frame's ref with refed_frames. Decoding ahead into
+	//copies, hands the frame's slot back before the next fetch would.
 	virtual int ReleaseBuffer(_buffer_desc& buffer) override final
 	{
+		if (buffer.release) {
+			buffer.release(&buffer);
+			return S_OK;
+		}
+		if (!decode_depth)
+			return S_OK;
+		std::lock_guard<std::mutex> lock(decode_mtx);
+		for (size_t i = 0; i < lent_frames.size(); ++i) {
+			if (lent_frames[i]->image.planes[0] == buffer.detail.image.planes[0]) {
+				free_slots.push_back(lent_frames[i]);
+				lent_frames.erase(lent_frames.begin() + i);
+				break;
+			}
+		}
 		return S_OK;
 	}
 	//This is for cases where the frame is owned or refed
@@ -110,8 +315,20 @@ public:
 		return E_INVALID_OPERATION;
 	}
 	//This means that the last packet is recieved.
+	//Decoding ahead, returns at once, the worker drains the
+	//decoder after the packets queued so far.
 	virtual int Flush() override final
 	{
+		if (decode_depth) {
+			late_deadline.store(0, std::memory_order_relaxed);
+			{
+				std::lock_guard<std::mutex> lock(decode_mtx);
+				end_requested = true;
+				ended = false;
+			}
+			decode_cond.notify_one();
+			return S_OK;
+		}
 		return vpx_codec_decode(&ctx, nullptr, 0, 0, 0);
 	}
 	//This means that a packet is dropped and requests
@@ -125,15 +342,315 @@ public:
 	{
 		return E_UNIMPLEMENTED;
 	}
+	virtual const frame_pool* GetFramePool() const override final
+	{
+		return pool;
+	}
 private:
+	//only by whoever decodes
+	_buffer_desc* next_packet()
+	{
+		return holding ? &held : in_queue.front();
+	}
+	void pop_packet()
+	{
+		if (holding)
+			holding = false;
+		else
+			in_queue.pop();
+	}
+	//Drops the packets before deadline that vp9_packet_skippable
+	//allows against the packet after them, stops at the first one
+	//that has to be decoded (held if it was looked past).
+	void skip_late(uint64_t deadline)
+	{
+		while (_buffer_desc* packet = next_packet()) {
+			if (packet->start_timestamp >= deadline)
+				return;
+			if (!holding) {
+				held.stream = packet->stream;
+				held.start_timestamp = packet->start_timestamp;
+				held.end_timestamp = packet->end_timestamp;
+				held.detail = packet->detail;
+				held.release = packet->release;
+				held.release_private_ptr = packet->release_private_ptr;
+				in_queue.pop();
+				holding = true;
+			}
+			_buffer_desc* following = in_queue.front();
+			if (!following || !vp9_packet_skippable(held.detail.pkt.data, held.detail.pkt.size,
+				following->detail.pkt.data, following->detail.pkt.size))
+				return;
+			if (held.release)
+				held.release(&held);
+			holding = false;
+			++skipped;
+		}
+	}
+	int decode(const _buffer_desc& input)
+	{
+		if (tune_pending)
+			tune(input.detail.pkt.data, input.detail.pkt.size);
+		return vpx_codec_decode(&ctx, input.detail.pkt.data, input.detail.pkt.size, (void*)input.start_timestamp, 0);
+	}
+	//libvpx decodes each tile column on a thread of its own, row-MT
+	//shares the rows of a column between threads too. Worth it only
+	//with more threads than columns, which the first key frame tells
+	//(libvpx sets its threads up on it, so the control still counts).
+	void tune(const uint8_t* data, size_t size)
+	{
+		const uint8_t* frames[8];
+		size_t sizes[8];
+		split_vp9_superframe(data, size, frames, sizes);
+		vp9_frame_header header;
+		if (!parse_vp9_header(frames[0], sizes[0], header) || !header.key_frame)
+			return;
+		tune_pending = false;
+		uint32_t tile_cols = header.has_tiles ? 1u << header.log2_tile_cols : 1;
+		vpx_codec_control(&ctx, VP9D_SET_ROW_MT, cfg.threads > tile_cols ? 1 : 0);
+	}
+	void wake_worker()
+	{
+		{
+			std::lock_guard<std::mutex> lock(decode_mtx);
+			ended = false;
+		}
+		decode_cond.notify_one();
+	}
 	void thread_proc()
 	{
-		
+		while (true) {
+			_buffer_desc* input;
+			int err = S_OK;
+			{
+				std::unique_lock<std::mutex> lock(decode_mtx);
+				decode_cond.wait(lock, [this] { return stop || next_packet() || end_requested; });
+				if (stop)
+					return;
+				input = next_packet();
+				if (!input)
+					end_requested = false;
+			}
+			if (input) {
+				if (uint64_t deadline = late_deadline.load(std::memory_order_relaxed)) {
+					skip_late(deadline);
+					//all skipped, the count goes with the next frame
+					input = next_packet();
+					if (!input)
+						continue;
+				}
+				assert(input->detail.pkt.size);
+				err = decode(*input);
+				if (input->release)
+					input->release(input);
+				pop_packet();
+			}
+			else {
+				err = vpx_codec_decode(&ctx, nullptr, 0, 0, 0);
+			}
+			if (err) {
+				std::unique_lock<std::mutex> lock(decode_mtx);
+				frame_slot* slot = wait_slot(lock);
+				if (!slot)
+					return;
+				slot->error = E_DECODE_ERROR;
+				ready_frames[(ready_head + ready_count++) % decode_depth] = slot;
+			}
+			iter = nullptr;
+			while (vpx_image_t* image = vpx_codec_get_frame(&ctx, &iter)) {
+				frame_slot* slot;
+				{
+					std::unique_lock<std::mutex> lock(decode_mtx);
+					slot = wait_slot(lock);
+					if (!slot)
+						return;
+				}
+				slot->skipped = skipped;
+				skipped = 0;
+				slot->frame = pooled_ref(image);
+				if (slot->frame) {
+					slot->image = *image;
+				}
+				else {
+					copy_image(*slot, image);
+				}
+				std::lock_guard<std::mutex> lock(decode_mtx);
+				ready_frames[(ready_head + ready_count++) % decode_depth] = slot;
+			}
+			if (!input) {
+				std::lock_guard<std::mutex> lock(decode_mtx);
+				//unless packets came in meanwhile
+				ended = !next_packet();
+			}
+		}
+	}
+	//a free slot once the ready ring has room, null when stopping
+	frame_slot* wait_slot(std::unique_lock<std::mutex>& lock)
+	{
+		decode_cond.wait(lock, [this] { return stop || ready_count < decode_depth; });
+		if (stop)
+			return nullptr;
+		if (free_slots.empty()) {
+			slots.emplace_back(new frame_slot());
+			free_slots.push_back(slots.back().get());
+		}
+		frame_slot* slot = free_slots.back();
+		free_slots.pop_back();
+		return slot;
 	}
 	static void thread_proc_proxy(libvpx_vp9_ram_decoder* This)
 	{
 		This->thread_proc();
 	}
+	static int get_frame_buffer(void* priv, size_t min_size, vpx_codec_frame_buffer_t* fb)
+	{
+		frame_buffer* buffer = ((frame_pool*)priv)->get(min_size);
+		if (!buffer)
+			return -1;
+		fb->data = buffer->data;
+		fb->size = buffer->capacity;
+		fb->priv = buffer;
+		return 0;
+	}
+	static int release_frame_buffer(void* priv, vpx_codec_frame_buffer_t* fb)
+	{
+		if (fb->priv)
+			((frame_buffer*)fb->priv)->unref();
+		return 0;
+	}
+	//what vp9 asks the pool for a frame of the stream (as
+	//vpx_realloc_frame_buffer sizes it): 8 aligned planes with the
+	//decoder's 32 pixel border, 32 aligned strides, 4:2:0 8 bit
+	//unless the stream says otherwise
+	static size_t frame_size(const stream_desc::video_info& info)
+	{
+		const size_t border = 32, alignment = 64;
+		const bool known = info.fmt.planar != 0;
+		const int ss_x = known ? info.fmt.subsample_horiz : 1;
+		const int ss_y = known ? info.fmt.subsample_vert : 1;
+		size_t width = (info.width + 7) & ~7;
+		size_t height = (info.height + 7) & ~7;
+		size_t y_stride = (width + 2 * border + 31) & ~31;
+		size_t y_size = (height + 2 * border) * y_stride + alignment;
+		size_t uv_size = ((height >> ss_y) + 2 * (border >> ss_y)) * (y_stride >> ss_x) + alignment;
+		size_t size = y_size + 2 * uv_size;
+		if (known && info.fmt.bitdepth > 8)
+			size *= 2;
+		return size + 31;
+	}
+	//the pool's buffer the image is in, null for copies and for
+	//postprocessed images (the decoder's own buffer)
+	frame_buffer* pooled(const vpx_image_t* img) const
+	{
+		if (!pool || !img->fb_priv)
+			return nullptr;
+		frame_buffer* buffer = (frame_buffer*)img->fb_priv;
+		return buffer->contains(img->planes[0]) ? buffer : nullptr;
+	}
+	frame_buffer* pooled_ref(const vpx_image_t* img) const
+	{
+		frame_buffer* buffer = pooled(img);
+		if (buffer)
+			buffer->ref();
+		return buffer;
+	}
+	//the fetched frame owns a ref on buffer (taken by the caller),
+	//dropped by its release; a frame still held in desc is released
+	static void hold_frame(_buffer_desc& desc, frame_buffer* buffer)
+	{
+		if (desc.release)
+			desc.release(&desc);
+		desc.release = buffer ? release_frame : nullptr;
+		desc.release_private_ptr = buffer;
+	}
+	static void release_frame(_buffer_desc* desc)
+	{
+		((frame_buffer*)desc->release_private_ptr)->unref();
+		desc->release = nullptr;
+		desc->release_private_ptr = nullptr;
+	}
+	//planes copied stride by stride, the chroma ones subsampled
+	static void copy_image(frame_slot& slot, const vpx_image_t* img)
+	{
+		size_t sizes[4]{};
+		size_t total = 0;
+		for (int i = 0; i < 4; ++i) {
+			if (!img->planes[i])
+				continue;
+			unsigned rows = i == 1 || i == 2 ? (img->d_h + img->y_chroma_shift) >> img->y_chroma_shift : img->d_h;
+			sizes[i] = (size_t)img->stride[i] * rows;
+			total += sizes[i];
+		}
+		if (slot.storage.size() < total)
+			slot.storage.resize(total);
+		slot.image = *img;
+		slot.image.fb_priv = nullptr;
+		slot.image.img_data = slot.storage.data();
+		slot.image.img_data_owner = 0;
+		slot.image.self_allocd = 0;
+		uint8_t* to = slot.storage.data();
+		for (int i = 0; i < 4; ++i) {
+			if (!img->planes[i])
+				continue;
+			memcpy(to, img->planes[i], sizes[i]);
+			slot.image.planes[i] = to;
+			to += sizes[i];
+		}
+	}
+	//the next ready frames, up to the next failed packet, which is
+	//returned on its own. The ones fetched before go back to the
+	//worker, unless released already, only once new ones are
+	//handed out: the consumer can keep showing the last one.
+	int fetch_ready(_buffer_desc* buffers, size_t max, size_t& done)
+	{
+		done = 0;
+		std::unique_lock<std::mutex> lock(decode_mtx);
+		if (!ready_count || ready_frames[ready_head]->error) {
+			for (int i = 0; i < 4; ++i) {
+				buffers[0].detail.image.planes[i] = nullptr;
+				buffers[0].detail.image.line_size[i] = 0;
+			}
+			if (!ready_count)
+				return ended ? E_EOF : E_AGAIN;
+			frame_slot* failed = ready_frames[ready_head];
+			ready_head = (ready_head + 1) % decode_depth;
+			--ready_count;
+			int err = failed->error;
+			failed->error = S_OK;
+			free_slots.push_back(failed);
+			lock.unlock();
+			decode_cond.notify_one();
+			return err;
+		}
+		free_slots.insert(free_slots.end(), lent_frames.begin(), lent_frames.end());
+		lent_frames.clear();
+		vpx_image_t last;
+		while (done < max && ready_count && !ready_frames[ready_head]->error) {
+			frame_slot* slot = ready_frames[ready_head];
+			ready_head = (ready_head + 1) % decode_depth;
+			--ready_count;
+			last = slot->image;
+			translate_from_vpx_img(buffers[done], &slot->image);
+			buffers[done].detail.image.skipped = slot->skipped;
+			hold_frame(buffers[done++], slot->frame);
+			if (slot->frame) {
+				//the fetched frame took the ref over
+				slot->frame = nullptr;
+				free_slots.push_back(slot);
+			}
+			else {
+				lent_frames.push_back(slot);
+			}
+		}
+		lock.unlock();
+		decode_cond.notify_one();
+		desc_out->detail.video.space = translate_from_vpx_cs(last.cs);
+		video_sample_format fmt;
+		translate_from_vpx_fmt(fmt, last.fmt);
+		desc_out->detail.video.fmt = fmt;
+		desc_out->detail.video.range = translate_from_vpx_cr(last.range);
+		return S_OK;
+	}
 	static vpx_color_space translate_to_vpx_cs(color_space my_space) noexcept
 	{
 		switch (my_space) {
@@ -268,6 +785,9 @@ private:
 		desc.detail.image.height = img->h;
 		desc.detail.image.space = translate_from_vpx_cs(img->cs);
 		desc.detail.image.range = translate_from_vpx_cr(img->range);
+		desc.detail.image.skipped = 0;
+		//the packet's, passed to the decode as user data
+		desc.start_timestamp = (uint64_t)(uintptr_t)img->user_priv;
 		for (int i = 0; i < 4; ++i) {
 			desc.detail.image.line_size[i] = img->stride[i];
 			desc.detail.image.planes[i] = img->planes[i];
@@ -276,15 +796,39 @@ private:
 };
 
 
-video_decoder* video_decoder_factory::CreateDefaultVP9Decoder(stream_desc* upstream, uint32_t threads, bool use_post_proc)
+//Threads worth giving a stream: libvpx's VP9 decoder stops scaling at
+//a few per 720p worth of pixels, beyond the cores they only compete.
+static uint32_t auto_vp9_threads(unsigned width, unsigned height)
+{
+	uint64_t pixels = (uint64_t)width * height;
+	uint32_t wanted = !pixels ? 4 : pixels <= 640 * 480 ? 2 : pixels <= 1280 * 720 ? 4 : pixels <= 1920 * 1088 ? 8 : 16;
+	uint32_t cores = std::thread::hardware_concurrency();
+	if (!cores)
+		cores = 1;
+	return wanted < cores ? wanted : cores;
+}
+
+video_decoder* video_decoder_factory::CreateVP9Decoder(stream_desc* upstream, const vp9_options& options)
 {
 	assert(upstream);
-	int flags = 0;
-	if(use_post_proc)
-		flags |= VPX_CODEC_USE_POSTPROC;
-	if(threads>1)
-		flags |= VPX_CODEC_USE_FRAME_THREADING;
-	else 
-		threads = 1;
-	return new libvpx_vp9_ram_decoder(upstream,threads,flags);
+	vp9_options resolved = options;
+	if (resolved.auto_threads)
+		resolved.threads = auto_vp9_threads(upstream->detail.video.width, upstream->detail.video.height);
+	if (!resolved.threads)
+		resolved.threads = 1;
+	return new libvpx_vp9_ram_decoder(upstream, resolved);
+}
+
+video_decoder* video_decoder_factory::CreateDefaultVP9Decoder(stream_desc* upstream, uint32_t threads, bool use_post_proc, uint32_t decode_ahead,
+	bool refed_frames, bool huge_pages)
+{
+	//VPX_CODEC_USE_FRAME_THREADING, set for threads > 1 before, is
+	//ignored by libvpx's VP9 decoder; the threads decode tiles
+	vp9_options options;
+	options.threads = threads;
+	options.post_proc = use_post_proc;
+	options.decode_ahead = decode_ahead;
+	options.refed_frames = refed_frames;
+	options.huge_pages = huge_pages;
+	return CreateVP9Decoder(upstream, options);
 }
@@ -0,0 +1,826 @@
+#pragma once
+
+//Header only demuxer for the WebM subset of Matroska:
+//EBML header, Segment, SeekHead, Info, Tracks, Cues and Clusters
+//with SimpleBlocks and BlockGroups, including Xiph, EBML and fixed
+//lacing. Compressed or encrypted tracks are not supported.
+//
+//It never reads a payload: frames come out as a file position and a
+//size, so the caller decides whether and where to read them, and a
+//masked track costs nothing but its block headers.
+//Element ids and sizes are decoded straight from the reader's window
+//(count leading zeros of the first byte gives the length), so the
+//reader must provide
+//	void seek(uint64_t pos), uint64_t tell(), uint64_t size(),
+//	size_t read(void* buffer, size_t count) and
+//	const uint8_t* peek(size_t count) (null if not available),
+//as buffered_reader does. Not thread safe.
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//leading zero bits of a non zero byte
+inline int webm_leading_zeros(uint8_t byte)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse(&index, byte);
+	return 7 - (int)index;
+#else
+	return __builtin_clz((unsigned)byte) - 24;
+#endif
+}
+
+struct webm_track {
+	uint64_t number = 0;
+	//TrackType, 1 video, 2 audio
+	uint8_t type = 0;
+	bool enabled = true;
+	bool is_default = true;
+	bool forced = false;
+	std::string codec_id;
+	std::string name;
+	char language[4] = { 'e', 'n', 'g', 0 };
+	std::vector<uint8_t> codec_private;
+	//ns
+	uint64_t default_duration = 0;
+	uint64_t codec_delay = 0;
+	uint64_t seek_preroll = 0;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint8_t bits_per_channel = 0;
+	uint8_t chroma_subsampling_horz = 0;
+	uint8_t chroma_subsampling_vert = 0;
+	uint8_t cb_subsampling_horz = 0;
+	uint8_t cb_subsampling_vert = 0;
+	uint8_t range = 0;
+	double sampling_frequency = 8000;
+	double output_sampling_frequency = 0;
+	uint32_t channels = 1;
+	uint32_t bit_depth = 0;
+	//ContentEncodings present, payloads are not usable as they are
+	bool encoded = false;
+};
+
+struct webm_frame {
+	//index into tracks()
+	uint32_t track;
+	//ns, 0 for frames before the start
+	uint64_t timestamp;
+	//ns, 0 if unknown
+	uint64_t duration;
+	//payload position in the file
+	uint64_t pos;
+	uint32_t size;
+	bool key;
+	//payloads of all the frames of the block, the same as pos and size
+	//unless it is laced: the laced frames follow each other in it
+	uint64_t block_pos;
+	uint64_t block_size;
+};
+
+template<class reader_type>
+class webm_demuxer {
+public:
+	webm_demuxer(reader_type& reader):in(reader) {}
+	webm_demuxer(const webm_demuxer&) = delete;
+	webm_demuxer& operator=(const webm_demuxer&) = delete;
+	//parses everything up to the first cluster
+	bool open();
+	const std::vector<webm_track>& tracks() const
+	{
+		return track_list;
+	}
+	uint64_t timestamp_scale() const
+	{
+		return scale;
+	}
+	//ns, 0 if unknown
+	uint64_t duration() const
+	{
+		return duration_ns;
+	}
+	uint64_t first_cluster() const
+	{
+		return first_cluster_pos;
+	}
+	//bit per track index, a set bit skips the track
+	void set_track_mask(uint32_t mask)
+	{
+		track_mask = mask;
+	}
+	//false at the end of the segment or on damaged data
+	bool next(webm_frame& frame);
+	//continues at the cluster of the last cued keyframe at or before
+	//timestamp (ns), or without Cues at the last cluster starting at
+	//or before it. The caller skips to the keyframes it needs.
+	bool seek(uint64_t timestamp);
+private:
+	enum : uint32_t {
+		ID_EBML = 0x1A45DFA3,
+		ID_DOCTYPE = 0x4282,
+		ID_SEGMENT = 0x18538067,
+		ID_SEEKHEAD = 0x114D9B74,
+		ID_SEEK = 0x4DBB,
+		ID_SEEKID = 0x53AB,
+		ID_SEEKPOSITION = 0x53AC,
+		ID_INFO = 0x1549A966,
+		ID_TIMESTAMPSCALE = 0x2AD7B1,
+		ID_DURATION = 0x4489,
+		ID_TRACKS = 0x1654AE6B,
+		ID_TRACKENTRY = 0xAE,
+		ID_TRACKNUMBER = 0xD7,
+		ID_TRACKTYPE = 0x83,
+		ID_FLAGENABLED = 0xB9,
+		ID_FLAGDEFAULT = 0x88,
+		ID_FLAGFORCED = 0x55AA,
+		ID_DEFAULTDURATION = 0x23E383,
+		ID_NAME = 0x536E,
+		ID_LANGUAGE = 0x22B59C,
+		ID_CODECID = 0x86,
+		ID_CODECPRIVATE = 0x63A2,
+		ID_CODECDELAY = 0x56AA,
+		ID_SEEKPREROLL = 0x56BB,
+		ID_CONTENTENCODINGS = 0x6D80,
+		ID_VIDEO = 0xE0,
+		ID_PIXELWIDTH = 0xB0,
+		ID_PIXELHEIGHT = 0xBA,
+		ID_COLOUR = 0x55B0,
+		ID_BITSPERCHANNEL = 0x55B2,
+		ID_CHROMASUBSAMPLINGHORZ = 0x55B3,
+		ID_CHROMASUBSAMPLINGVERT = 0x55B4,
+		ID_CBSUBSAMPLINGHORZ = 0x55B5,
+		ID_CBSUBSAMPLINGVERT = 0x55B6,
+		ID_RANGE = 0x55B9,
+		ID_AUDIO = 0xE1,
+		ID_SAMPLINGFREQUENCY = 0xB5,
+		ID_OUTPUTSAMPLINGFREQUENCY = 0x78B5,
+		ID_CHANNELS = 0x9F,
+		ID_BITDEPTH = 0x6264,
+		ID_CUES = 0x1C53BB6B,
+		ID_CUEPOINT = 0xBB,
+		ID_CUETIME = 0xB3,
+		ID_CUETRACKPOSITIONS = 0xB7,
+		ID_CUETRACK = 0xF7,
+		ID_CUECLUSTERPOSITION = 0xF1,
+		ID_CLUSTER = 0x1F43B675,
+		ID_TIMECODE = 0xE7,
+		ID_SIMPLEBLOCK = 0xA3,
+		ID_BLOCKGROUP = 0xA0,
+		ID_BLOCK = 0xA1,
+		ID_BLOCKDURATION = 0x9B,
+		ID_REFERENCEBLOCK = 0xFB
+	};
+	struct element {
+		uint32_t id;
+		uint64_t start;
+		uint64_t data;
+		uint64_t size;
+		bool unknown_size;
+		uint64_t end() const
+		{
+			return data + size;
+		}
+	};
+	struct cue {
+		uint64_t timestamp;
+		uint64_t cluster_pos;
+		uint32_t track;
+	};
+	struct cluster_start {
+		uint64_t timestamp;
+		uint64_t pos;
+	};
+	reader_type& in;
+	std::vector<webm_track> track_list;
+	uint64_t scale = 1000000;
+	uint64_t duration_ns = 0;
+	uint64_t segment_data = 0;
+	uint64_t segment_end = 0;
+	uint64_t first_cluster_pos = 0;
+	uint64_t cues_pos = 0;
+	bool cues_loaded = false;
+	std::vector<cue> cue_list;
+	std::vector<cluster_start> cluster_list;
+	uint32_t track_mask = 0;
+	//next level 1 element once outside a cluster
+	uint64_t level1_pos = 0;
+	bool in_cluster = false;
+	bool cluster_unknown = false;
+	uint64_t cluster_end = 0;
+	int64_t cluster_time = 0;
+	//next child of the current cluster
+	uint64_t child_pos = 0;
+	//frames of a laced block not returned yet
+	std::vector<webm_frame> laced;
+	size_t laced_next = 0;
+
+	bool read_vint(uint64_t& value, int& length, bool keep_marker)
+	{
+		const uint8_t* p = in.peek(1);
+		if (!p || !*p)
+			return false;
+		length = webm_leading_zeros(*p) + 1;
+		p = in.peek(length);
+		if (!p)
+			return false;
+		value = keep_marker ? p[0] : p[0] & (0xFF >> length);
+		for (int i = 1; i < length; ++i)
+			value = (value << 8) | p[i];
+		in.seek(in.tell() + length);
+		return true;
+	}
+	bool element_at(uint64_t pos, element& e)
+	{
+		in.seek(pos);
+		uint64_t id;
+		int id_len, size_len;
+		if (!read_vint(id, id_len, true) || id_len > 4 || !read_vint(e.size, size_len, false))
+			return false;
+		e.id = (uint32_t)id;
+		e.start = pos;
+		e.data = pos + id_len + size_len;
+		e.unknown_size = e.size == (uint64_t(1) << (7 * size_len)) - 1;
+		if (e.unknown_size)
+			e.size = segment_end > e.data ? segment_end - e.data : 0;
+		return true;
+	}
+	uint64_t read_uint(const element& e)
+	{
+		if (e.size > 8)
+			return 0;
+		in.seek(e.data);
+		const uint8_t* p = in.peek((size_t)e.size);
+		uint64_t value = 0;
+		for (uint64_t i = 0; p && i < e.size; ++i)
+			value = (value << 8) | p[i];
+		return value;
+	}
+	double read_float(const element& e)
+	{
+		if (e.size != 4 && e.size != 8)
+			return 0;
+		in.seek(e.data);
+		const uint8_t* p = in.peek((size_t)e.size);
+		if (!p)
+			return 0;
+		if (e.size == 4) {
+			uint32_t bits = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+			float value;
+			memcpy(&value, &bits, 4);
+			return value;
+		}
+		if (e.size == 8) {
+			uint64_t bits = 0;
+			for (int i = 0; i < 8; ++i)
+				bits = (bits << 8) | p[i];
+			double value;
+			memcpy(&value, &bits, 8);
+			return value;
+		}
+		return 0;
+	}
+	//false, and out empty, for an element running past the segment
+	//(the file while in the EBML header): its size comes from the
+	//file and is checked before anything is allocated for it
+	bool read_binary(const element& e, std::vector<uint8_t>& out)
+	{
+		out.clear();
+		if (e.data > segment_end || e.size > segment_end - e.data)
+			return false;
+		out.resize((size_t)e.size);
+		in.seek(e.data);
+		if (in.read(out.data(), out.size()) != out.size()) {
+			out.clear();
+			return false;
+		}
+		return true;
+	}
+	std::string read_string(const element& e)
+	{
+		std::vector<uint8_t> bytes;
+		if (!read_binary(e, bytes))
+			return std::string();
+		return std::string(bytes.begin(), std::find(bytes.begin(), bytes.end(), 0));
+	}
+	//calls child(e) for every child of parent, false on damaged data
+	template<class handler_type>
+	bool children(const element& parent, handler_type child)
+	{
+		for (uint64_t pos = parent.data; pos < parent.end();) {
+			element e;
+			if (!element_at(pos, e) || e.unknown_size)
+				return false;
+			child(e);
+			pos = e.end();
+		}
+		return true;
+	}
+	bool parse_tracks(const element& tracks);
+	void parse_seekhead(const element& seekhead);
+	void load_cues();
+	void scan_clusters();
+	bool enter_cluster();
+	void parse_block(uint64_t pos, uint64_t size, bool simple, bool key, uint64_t duration);
+	int track_index(uint64_t number) const
+	{
+		for (size_t i = 0; i < track_list.size(); ++i) {
+			if (track_list[i].number == number)
+				return (int)i;
+		}
+		return -1;
+	}
+};
+
+template<class reader_type>
+bool webm_demuxer<reader_type>::open()
+{
+	element header;
+	segment_end = in.size();
+	if (!element_at(0, header) || header.id != ID_EBML || header.unknown_size)
+		return false;
+	std::string doctype = "matroska";
+	children(header, [&](const element& e) {
+		if (e.id == ID_DOCTYPE)
+			doctype = read_string(e);
+	});
+	if (doctype != "webm" && doctype != "matroska")
+		return false;
+	element segment;
+	if (!element_at(header.end(), segment) || segment.id != ID_SEGMENT)
+		return false;
+	segment_data = segment.data;
+	if (!segment.unknown_size && segment.end() < segment_end)
+		segment_end = segment.end();
+	for (uint64_t pos = segment_data; pos < segment_end;) {
+		element e;
+		if (!element_at(pos, e))
+			return false;
+		switch (e.id) {
+			case ID_SEEKHEAD:
+				parse_seekhead(e);
+				break;
+			case ID_INFO: {
+				double duration = 0;
+				children(e, [&](const element& child) {
+					if (child.id == ID_TIMESTAMPSCALE)
+						scale = read_uint(child);
+					else if (child.id == ID_DURATION)
+						duration = read_float(child);
+				});
+				if (!scale)
+					scale = 1000000;
+				duration_ns = (uint64_t)(duration * scale);
+				break;
+			}
+			case ID_TRACKS:
+				if (!parse_tracks(e))
+					return false;
+				break;
+			case ID_CUES:
+				cues_pos = e.start;
+				break;
+			case ID_CLUSTER:
+				first_cluster_pos = e.start;
+				level1_pos = e.start;
+				return !track_list.empty();
+		}
+		if (e.unknown_size)
+			return false;
+		pos = e.end();
+	}
+	return false;
+}
+
+template<class reader_type>
+bool webm_demuxer<reader_type>::parse_tracks(const element& tracks)
+{
+	return children(tracks, [&](const element& entry) {
+		if (entry.id != ID_TRACKENTRY)
+			return;
+		webm_track track;
+		children(entry, [&](const element& e) {
+			switch (e.id) {
+				case ID_TRACKNUMBER:
+					track.number = read_uint(e);
+					break;
+				case ID_TRACKTYPE:
+					track.type = (uint8_t)read_uint(e);
+					break;
+				case ID_FLAGENABLED:
+					track.enabled = read_uint(e) != 0;
+					break;
+				case ID_FLAGDEFAULT:
+					track.is_default = read_uint(e) != 0;
+					break;
+				case ID_FLAGFORCED:
+					track.forced = read_uint(e) != 0;
+					break;
+				case ID_DEFAULTDURATION:
+					track.default_duration = read_uint(e);
+					break;
+				case ID_NAME:
+					track.name = read_string(e);
+					break;
+				case ID_LANGUAGE: {
+					std::string language = read_string(e);
+					memset(track.language, 0, sizeof(track.language));
+					memcpy(track.language, language.c_str(), language.size() < 3 ? language.size() : 3);
+					break;
+				}
+				case ID_CODECID:
+					track.codec_id = read_string(e);
+					break;
+				case ID_CODECPRIVATE:
+					read_binary(e, track.codec_private);
+					break;
+				case ID_CODECDELAY:
+					track.codec_delay = read_uint(e);
+					break;
+				case ID_SEEKPREROLL:
+					track.seek_preroll = read_uint(e);
+					break;
+				case ID_CONTENTENCODINGS:
+					track.encoded = true;
+					break;
+				case ID_VIDEO:
+					children(e, [&](const element& video) {
+						if (video.id == ID_PIXELWIDTH)
+							track.width = (uint32_t)read_uint(video);
+						else if (video.id == ID_PIXELHEIGHT)
+							track.height = (uint32_t)read_uint(video);
+						else if (video.id == ID_COLOUR) {
+							children(video, [&](const element& colour) {
+								switch (colour.id) {
+									case ID_BITSPERCHANNEL:
+										track.bits_per_channel = (uint8_t)read_uint(colour);
+										break;
+									case ID_CHROMASUBSAMPLINGHORZ:
+										track.chroma_subsampling_horz = (uint8_t)read_uint(colour);
+										break;
+									case ID_CHROMASUBSAMPLINGVERT:
+										track.chroma_subsampling_vert = (uint8_t)read_uint(colour);
+										break;
+									case ID_CBSUBSAMPLINGHORZ:
+										track.cb_subsampling_horz = (uint8_t)read_uint(colour);
+										break;
+									case ID_CBSUBSAMPLINGVERT:
+										track.cb_subsampling_vert = (uint8_t)read_uint(colour);
+										break;
+									case ID_RANGE:
+										track.range = (uint8_t)read_uint(colour);
+										break;
+								}
+							});
+						}
+					});
+					break;
+				case ID_AUDIO:
+					children(e, [&](const element& audio) {
+						if (audio.id == ID_SAMPLINGFREQUENCY)
+							track.sampling_frequency = read_float(audio);
+						else if (audio.id == ID_OUTPUTSAMPLINGFREQUENCY)
+							track.output_sampling_frequency = read_float(audio);
+						else if (audio.id == ID_CHANNELS)
+							track.channels = (uint32_t)read_uint(audio);
+						else if (audio.id == ID_BITDEPTH)
+							track.bit_depth = (uint32_t)read_uint(audio);
+					});
+					break;
+			}
+		});
+		if (track.number)
+			track_list.push_back(std::move(track));
+	});
+}
+
+template<class reader_type>
+void webm_demuxer<reader_type>::parse_seekhead(const element& seekhead)
+{
+	children(seekhead, [&](const element& seek) {
+		if (seek.id != ID_SEEK)
+			return;
+		uint64_t id = 0, position = 0;
+		bool has_position = false;
+		children(seek, [&](const element& e) {
+			if (e.id == ID_SEEKID) {
+				id = read_uint(e);
+			}
+			else if (e.id == ID_SEEKPOSITION) {
+				position = read_uint(e);
+				has_position = true;
+			}
+		});
+		if (id == ID_CUES && has_position)
+			cues_pos = segment_data + position;
+	});
+}
+
+template<class reader_type>
+void webm_demuxer<reader_type>::load_cues()
+{
+	cues_loaded = true;
+	element cues;
+	if (!cues_pos || !element_at(cues_pos, cues) || cues.id != ID_CUES || cues.unknown_size)
+		return;
+	children(cues, [&](const element& point) {
+		if (point.id != ID_CUEPOINT)
+			return;
+		uint64_t time = 0;
+		children(point, [&](const element& e) {
+			if (e.id == ID_CUETIME) {
+				time = read_uint(e);
+			}
+			else if (e.id == ID_CUETRACKPOSITIONS) {
+				uint64_t number = 0, position = 0;
+				children(e, [&](const element& positions) {
+					if (positions.id == ID_CUETRACK)
+						number = read_uint(positions);
+					else if (positions.id == ID_CUECLUSTERPOSITION)
+						position = read_uint(positions);
+				});
+				int track = track_index(number);
+				if (track >= 0)
+					cue_list.push_back(cue{ time * scale, segment_data + position, (uint32_t)track });
+			}
+		});
+	});
+	//seeks go to video keyframes if there is video, so only those are kept
+	bool has_video = false;
+	for (const webm_track& track : track_list)
+		has_video |= track.type == 1;
+	if (has_video) {
+		cue_list.erase(std::remove_if(cue_list.begin(), cue_list.end(),
+			[this](const cue& point) { return track_list[point.track].type != 1; }), cue_list.end());
+	}
+	std::stable_sort(cue_list.begin(), cue_list.end(),
+		[](const cue& a, const cue& b) { return a.timestamp < b.timestamp; });
+}
+
+//cluster positions and timestamps, for files without Cues
+template<class reader_type>
+void webm_demuxer<reader_type>::scan_clusters()
+{
+	for (uint64_t pos = first_cluster_pos; pos < segment_end;) {
+		element e;
+		if (!element_at(pos, e))
+			break;
+		if (e.id == ID_CLUSTER) {
+			cluster_start start{ 0, e.start };
+			element first;
+			//the Timecode comes first
+			if (element_at(e.data, first) && first.id == ID_TIMECODE)
+				start.timestamp = read_uint(first) * scale;
+			cluster_list.push_back(start);
+		}
+		if (e.unknown_size)
+			break;
+		pos = e.end();
+	}
+}
+
+template<class reader_type>
+bool webm_demuxer<reader_type>::seek(uint64_t timestamp)
+{
+	if (!cues_loaded)
+		load_cues();
+	uint64_t pos = first_cluster_pos;
+	//both lists are sorted by timestamp, the last entry at or before it
+	if (!cue_list.empty()) {
+		auto next = std::upper_bound(cue_list.begin(), cue_list.end(), timestamp,
+			[](uint64_t timestamp, const cue& point) { return timestamp < point.timestamp; });
+		if (next != cue_list.begin())
+			pos = (next - 1)->cluster_pos;
+	}
+	else {
+		if (cluster_list.empty())
+			scan_clusters();
+		auto next = std::upper_bound(cluster_list.begin(), cluster_list.end(), timestamp,
+			[](uint64_t timestamp, const cluster_start& start) { return timestamp < start.timestamp; });
+		if (next != cluster_list.begin())
+			pos = (next - 1)->pos;
+	}
+	level1_pos = pos;
+	in_cluster = false;
+	laced.clear();
+	laced_next = 0;
+	return true;
+}
+
+template<class reader_type>
+bool webm_demuxer<reader_type>::enter_cluster()
+{
+	while (level1_pos < segment_end) {
+		element e;
+		if (!element_at(level1_pos, e))
+			return false;
+		if (e.id == ID_CLUSTER) {
+			in_cluster = true;
+			cluster_unknown = e.unknown_size;
+			//a cluster claiming more than the segment ends with it
+			cluster_end = e.end() < e.data || e.end() > segment_end ? segment_end : e.end();
+			cluster_time = 0;
+			child_pos = e.data;
+			level1_pos = cluster_end;
+			return true;
+		}
+		if (e.unknown_size)
+			return false;
+		level1_pos = e.end();
+	}
+	return false;
+}
+
+template<class reader_type>
+bool webm_demuxer<reader_type>::next(webm_frame& frame)
+{
+	while (true) {
+		if (laced_next < laced.size()) {
+			frame = laced[laced_next++];
+			return true;
+		}
+		laced.clear();
+		laced_next = 0;
+		if (!in_cluster && !enter_cluster())
+			return false;
+		if (child_pos >= cluster_end) {
+			in_cluster = false;
+			continue;
+		}
+		element e;
+		if (!element_at(child_pos, e)) {
+			in_cluster = false;
+			level1_pos = segment_end;
+			return false;
+		}
+		//level 1 ids are 4 bytes, one ends a cluster of unknown size
+		if (e.id > 0xFFFFFF) {
+			in_cluster = false;
+			level1_pos = e.start;
+			continue;
+		}
+		if (e.unknown_size)
+			return false;
+		//a size past its cluster is damaged, so is the rest of the cluster
+		if (e.end() < e.data || e.end() > cluster_end) {
+			in_cluster = false;
+			continue;
+		}
+		switch (e.id) {
+			case ID_TIMECODE:
+				cluster_time = (int64_t)read_uint(e);
+				break;
+			case ID_SIMPLEBLOCK:
+				parse_block(e.data, e.size, true, false, 0);
+				break;
+			case ID_BLOCKGROUP: {
+				uint64_t block_pos = 0, block_size = 0, duration = 0;
+				bool referenced = false;
+				children(e, [&](const element& child) {
+					if (child.id == ID_BLOCK) {
+						if (child.end() < child.data || child.end() > e.end())
+							return;
+						block_pos = child.data;
+						block_size = child.size;
+					}
+					else if (child.id == ID_BLOCKDURATION) {
+						duration = read_uint(child);
+					}
+					else if (child.id == ID_REFERENCEBLOCK) {
+						referenced = true;
+					}
+				});
+				if (block_size)
+					parse_block(block_pos, block_size, false, !referenced, duration);
+				break;
+			}
+		}
+		child_pos = e.end();
+	}
+}
+
+//queues the frames of one block in laced
+template<class reader_type>
+void webm_demuxer<reader_type>::parse_block(uint64_t pos, uint64_t size, bool simple, bool key, uint64_t duration)
+{
+	in.seek(pos);
+	uint64_t number;
+	int number_len;
+	if (!read_vint(number, number_len, false))
+		return;
+	const uint8_t* p = in.peek(3);
+	int track = track_index(number);
+	if (!p || track < 0 || size < uint64_t(number_len + 3))
+		return;
+	if (track < 32 && (track_mask >> track) & 1)
+		return;
+	int16_t offset = (int16_t)((p[0] << 8) | p[1]);
+	uint8_t flags = p[2];
+	if (simple)
+		key = (flags & 0x80) != 0;
+	int64_t time = cluster_time + offset;
+	const webm_track& info = track_list[track];
+	webm_frame frame;
+	frame.track = (uint32_t)track;
+	frame.timestamp = time > 0 ? (uint64_t)time * scale : 0;
+	frame.duration = duration ? duration * scale : info.default_duration;
+	frame.key = key;
+	uint64_t data = pos + number_len + 3;
+	uint64_t end = pos + size;
+	//the caller keeps the block inside its cluster; frames are sized
+	//in 32 bits
+	if (end - data > UINT32_MAX)
+		return;
+	int lacing = (flags >> 1) & 3;
+	if (!lacing) {
+		frame.pos = data;
+		frame.size = (uint32_t)(end - data);
+		frame.block_pos = frame.pos;
+		frame.block_size = frame.size;
+		laced.push_back(frame);
+		return;
+	}
+	in.seek(data);
+	const uint8_t* count_byte = end > data ? in.peek(1) : nullptr;
+	if (!count_byte)
+		return;
+	size_t count = size_t(*count_byte) + 1;
+	in.seek(data + 1);
+	std::vector<uint64_t> sizes(count);
+	uint64_t known = 0;
+	//every lace size is checked against the block before it is summed,
+	//so the sum can neither wrap nor run past the block
+	uint64_t room = end - data - 1;
+	switch (lacing) {
+		case 1:
+			//Xiph: runs of 255 plus a final byte
+			for (size_t i = 0; i + 1 < count; ++i) {
+				uint64_t lace = 0;
+				const uint8_t* b;
+				do {
+					b = in.peek(1);
+					if (!b)
+						return;
+					lace += *b;
+					in.seek(in.tell() + 1);
+				} while (*b == 255 && lace <= room);
+				if (lace > room - known)
+					return;
+				sizes[i] = lace;
+				known += lace;
+			}
+			break;
+		case 3: {
+			//EBML: the first size, then signed differences
+			uint64_t value;
+			int len;
+			if (!read_vint(value, len, false) || value > room)
+				return;
+			sizes[0] = value;
+			known = value;
+			for (size_t i = 1; i + 1 < count; ++i) {
+				if (!read_vint(value, len, false))
+					return;
+				//value is at most 56 bits, neither side overflows
+				int64_t diff = (int64_t)value - ((int64_t(1) << (7 * len - 1)) - 1);
+				if (diff < 0 ? uint64_t(-diff) > sizes[i - 1] : uint64_t(diff) > room - sizes[i - 1])
+					return;
+				sizes[i] = sizes[i - 1] + diff;
+				if (sizes[i] > room - known)
+					return;
+				known += sizes[i];
+			}
+			break;
+		}
+		case 2: {
+			uint64_t each = (end - data - 1) / count;
+			for (size_t i = 0; i + 1 < count; ++i)
+				sizes[i] = each;
+			known = each * (count - 1);
+			break;
+		}
+	}
+	uint64_t at = in.tell();
+	if (at + known > end)
+		return;
+	sizes[count - 1] = end - at - known;
+	frame.block_pos = at;
+	frame.block_size = end - at;
+	uint64_t lace_duration = info.default_duration ? info.default_duration : frame.duration / count;
+	for (size_t i = 0; i < count; ++i) {
+		frame.pos = at;
+		frame.size = (uint32_t)sizes[i];
+		laced.push_back(frame);
+		at += sizes[i];
+		frame.timestamp += lace_duration;
+		frame.duration = lace_duration;
+	}
+	laced.front().duration = lace_duration;
+}